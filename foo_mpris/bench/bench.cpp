@@ -0,0 +1,337 @@
+// Copyright (c) 2023 Ally Sommers
+// This code is licensed under the BSD 3-Clause License. A copy of this license
+// is included in the repository.
+
+// Measures foo_mpris's command round trips without foobar2000 or D-Bus: the protocol core runs against a mock_player
+// in a thread of its own, and this program plays foobard, listening on a Unix socket and sending it commands. "hops"
+// counts the trips to the player's thread a scenario took, which are what cost the most inside foobar2000. Last, the
+// connection is left idle for a while to count how often foo_mpris wakes up with nothing to do.
+//
+// Usage: foo_mpris_bench [iterations]
+
+#include "mock_player.hpp"
+#include "server.hpp"
+
+#include "protocol.h"
+#include "ubjson/ubjson.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using bench_clock = std::chrono::steady_clock;
+
+void logMessage(char const *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+    fputc('\n', stderr);
+}
+
+namespace
+{
+    // Commands sent back-to-back in one write when measuring throughput.
+    constexpr size_t PIPELINE_DEPTH = 64;
+    // Tracks in the mock player's library; every one of them matches "Track".
+    constexpr size_t LIBRARY_SIZE = 10000;
+    // How long the connection is left idle while wakeups are counted, in milliseconds.
+    constexpr unsigned IDLE_MILLISECONDS = 2000;
+
+    // foobard's end of the socket. Replies which arrive split across reads are put back together, as search pages
+    // can be larger than one read.
+    class bench_peer {
+        public:
+        explicit bench_peer(int sock) : sock(sock)
+        {
+        }
+
+        void send(std::string const &frame)
+        {
+            size_t sent = 0;
+            while (sent < frame.size())
+            {
+                ssize_t n = ::send(sock, frame.data() + sent, frame.size() - sent, MSG_NOSIGNAL);
+                if (n <= 0)
+                {
+                    perror("send");
+                    exit(1);
+                }
+                sent += n;
+            }
+        }
+
+        // Reads the next message into `ctx`, which the caller frees.
+        void receive(ubjson_ctx *ctx)
+        {
+            for (;;)
+            {
+                if (!inbox.empty())
+                {
+                    ubjson_ctx_init(ctx, inbox.data(), inbox.size());
+                    if (ubjson_ctx_parse(ctx))
+                    {
+                        inbox.erase(inbox.begin(), inbox.begin() + std::min(ctx->src_index, inbox.size()));
+                        return;
+                    }
+                    ubjson_ctx_free(ctx);
+                }
+
+                char buf[65536];
+                ssize_t n = recv(sock, buf, sizeof(buf), 0);
+                if (n <= 0)
+                {
+                    fprintf(stderr, "foo_mpris hung up\n");
+                    exit(1);
+                }
+                inbox.insert(inbox.end(), buf, buf + n);
+            }
+        }
+
+        private:
+        int sock;
+        std::vector<char> inbox;
+    };
+
+    template <typename Encode>
+    std::string renderFrame(Encode encode)
+    {
+        ubjson_writer writer;
+        ubjson_writer_init(&writer, NULL, 0);
+        encode(&writer);
+        std::string frame(writer.buf, writer.len);
+        ubjson_writer_free(&writer);
+        return frame;
+    }
+
+    struct scenario
+    {
+        char const *name;
+        std::string frame;
+    };
+
+    // Receives the reply to a command, or the last chunk of a search's results.
+    void receiveReply(bench_peer &peer, ubjson_ctx *reply)
+    {
+        for (;;)
+        {
+            peer.receive(reply);
+            protocol_search_results chunk;
+            if (protocol_read_message(reply) != PROTOCOL_MESSAGE_search_chunk || !protocol_read_search_results(reply, &chunk) ||
+                chunk.done)
+                return;
+            ubjson_ctx_free(reply);
+        }
+    }
+
+    double percentile(std::vector<double> &samples, double p)
+    {
+        size_t index = (size_t)(p * (samples.size() - 1));
+        std::nth_element(samples.begin(), samples.begin() + index, samples.end());
+        return samples[index];
+    }
+
+    void run(bench_peer &peer, mock_player &player, scenario const &s, size_t iterations)
+    {
+        size_t hops = player.hops();
+        std::vector<double> latencies;
+        latencies.reserve(iterations);
+        ubjson_ctx reply;
+
+        // One command at a time, the way foobard asks while a D-Bus call waits
+        for (size_t i = 0; i < iterations; i++)
+        {
+            auto start = bench_clock::now();
+            peer.send(s.frame);
+            receiveReply(peer, &reply);
+            latencies.push_back(std::chrono::duration<double, std::micro>(bench_clock::now() - start).count());
+            ubjson_ctx_free(&reply);
+        }
+
+        // Many in flight, for the cost of the core itself rather than of the round trip
+        std::string batch;
+        for (size_t i = 0; i < PIPELINE_DEPTH; i++)
+            batch += s.frame;
+        size_t batches = std::max<size_t>(iterations / PIPELINE_DEPTH, 1);
+        auto start = bench_clock::now();
+        for (size_t i = 0; i < batches; i++)
+        {
+            peer.send(batch);
+            for (size_t j = 0; j < PIPELINE_DEPTH; j++)
+            {
+                receiveReply(peer, &reply);
+                ubjson_ctx_free(&reply);
+            }
+        }
+        double seconds = std::chrono::duration<double>(bench_clock::now() - start).count();
+
+        printf("%-18s %9.1f %9.1f %9.1f %12.0f %6zu\n", s.name, percentile(latencies, 0.5), percentile(latencies, 0.99),
+               *std::max_element(latencies.begin(), latencies.end()), batches * PIPELINE_DEPTH / seconds,
+               player.hops() - hops);
+    }
+    // A status query sent right behind a search for the whole library: the status reply shouldn't have to wait for the
+    // search's results.
+    void runLanes(bench_peer &peer, std::string const &searchFrame, std::string const &statusFrame, size_t matches,
+                  size_t iterations)
+    {
+        std::vector<double> statusLatencies;
+        std::vector<double> searchLatencies;
+        std::string frames = searchFrame + statusFrame;
+        ubjson_ctx message;
+
+        for (size_t i = 0; i < iterations; i++)
+        {
+            auto start = bench_clock::now();
+            peer.send(frames);
+
+            bool statusDone = false;
+            bool searchDone = false;
+            while (!statusDone || !searchDone)
+            {
+                peer.receive(&message);
+                double elapsed = std::chrono::duration<double, std::micro>(bench_clock::now() - start).count();
+                protocol_search_results chunk;
+                if (protocol_read_message(&message) != PROTOCOL_MESSAGE_search_chunk)
+                {
+                    statusLatencies.push_back(elapsed);
+                    statusDone = true;
+                }
+                else if (protocol_read_search_results(&message, &chunk) && chunk.done)
+                {
+                    searchLatencies.push_back(elapsed);
+                    searchDone = true;
+                }
+                ubjson_ctx_free(&message);
+            }
+        }
+
+        printf("\nplaybackstatus sent right behind a %zu-result search, %zu times:\n", matches, iterations);
+        printf("  status reply      p50 %9.1f us, p99 %9.1f us\n", percentile(statusLatencies, 0.5),
+               percentile(statusLatencies, 0.99));
+        printf("  search complete   p50 %9.1f us, p99 %9.1f us\n", percentile(searchLatencies, 0.5),
+               percentile(searchLatencies, 0.99));
+    }
+
+    // Counts the socket thread's returns from link.wait() while nothing is sent, and the voluntary context switches of
+    // the whole process, which also take in the bulk thread and this thread's own sleep.
+    void measureIdle(command_server &server)
+    {
+        // The last reply is in, but the socket thread may still be on its way back to waiting
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+        rusage before;
+        rusage after;
+        uint64_t wakeups = server.wakeups();
+        getrusage(RUSAGE_SELF, &before);
+        std::this_thread::sleep_for(std::chrono::milliseconds(IDLE_MILLISECONDS));
+        getrusage(RUSAGE_SELF, &after);
+
+        printf("\nidle for %u ms:\n", IDLE_MILLISECONDS);
+        printf("  socket thread wakeups %6llu\n", (unsigned long long)(server.wakeups() - wakeups));
+        printf("  context switches      %6ld\n", after.ru_nvcsw - before.ru_nvcsw);
+    }
+} // namespace
+
+int main(int argc, char **argv)
+{
+    size_t iterations = argc > 1 ? strtoul(argv[1], NULL, 10) : 20000;
+
+    char dir[] = "/tmp/foo_mpris_bench.XXXXXX";
+    if (!mkdtemp(dir))
+    {
+        perror("mkdtemp");
+        return 1;
+    }
+    std::string path = std::string(dir) + "/foo_mpris.sock";
+
+    sockaddr_un address = { AF_UNIX };
+    strcpy(address.sun_path, path.c_str());
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0 || bind(listener, (sockaddr *)&address, sizeof(address)) || listen(listener, 1))
+    {
+        perror("listen");
+        return 1;
+    }
+
+    mock_player player(LIBRARY_SIZE);
+    command_server server(player);
+    std::thread serverThread([&] { server.serve(path.c_str()); });
+
+    int sock = accept(listener, NULL, NULL);
+    if (sock < 0)
+    {
+        perror("accept");
+        return 1;
+    }
+    bench_peer peer(sock);
+
+    ubjson_ctx hello;
+    peer.receive(&hello);
+    if (!protocol_string_equals(protocol_read_tag(&hello, PROTOCOL_TAG_COMMAND), "hello"))
+    {
+        fprintf(stderr, "Expected a hello from foo_mpris\n");
+        return 1;
+    }
+    ubjson_ctx_free(&hello);
+
+    peer.send(renderFrame([](ubjson_writer *writer) { protocol_encode_play(writer, NULL); }));
+
+    protocol_metadata_args defaultFields = {};
+    defaultFields.fields = METADATA_FIELDS_DEFAULT;
+    protocol_metadata_args allFields = {};
+    allFields.present = PROTOCOL_BIT(metadata_args, fields);
+    allFields.fields = METADATA_FIELDS_ALL;
+
+    protocol_search_args query = {};
+    query.query = protocol_string_of("Track 1");
+    query.offset = 0;
+    query.limit = 20;
+    query.serial = 1;
+
+    protocol_search_args everything = {};
+    everything.query = protocol_string_of("Track");
+    everything.offset = 0;
+    everything.limit = LIBRARY_SIZE;
+    everything.serial = 2;
+
+    scenario scenarios[] = {
+        { "playbackstatus", renderFrame([](ubjson_writer *writer) { protocol_encode_playbackstatus(writer, NULL); }) },
+        { "position", renderFrame([](ubjson_writer *writer) { protocol_encode_position(writer, NULL); }) },
+        { "metadata", renderFrame([&](ubjson_writer *writer) { protocol_encode_metadata(writer, &defaultFields); }) },
+        { "metadata (all)", renderFrame([&](ubjson_writer *writer) { protocol_encode_metadata(writer, &allFields); }) },
+        { "search", renderFrame([&](ubjson_writer *writer) { protocol_encode_search(writer, &query); }) },
+        // A control command has no reply, so each is followed by a status query to wait on
+        { "playpause+status",
+          renderFrame([](ubjson_writer *writer) { protocol_encode_playpause(writer, NULL); }) +
+              renderFrame([](ubjson_writer *writer) { protocol_encode_playbackstatus(writer, NULL); }) },
+    };
+
+    printf("%zu round trips per command, %zu pipelined\n\n", iterations, PIPELINE_DEPTH);
+    printf("%-18s %9s %9s %9s %12s %6s\n", "command", "p50 (us)", "p99 (us)", "max (us)", "pipelined/s", "hops");
+    for (scenario const &s : scenarios)
+        run(peer, player, s, iterations);
+    runLanes(peer, renderFrame([&](ubjson_writer *writer) { protocol_encode_search(writer, &everything); }),
+             renderFrame([](ubjson_writer *writer) { protocol_encode_playbackstatus(writer, NULL); }), LIBRARY_SIZE,
+             std::max<size_t>(iterations / 100, 10));
+    measureIdle(server);
+
+    server.shutdown();
+    serverThread.join();
+    close(sock);
+    close(listener);
+    unlink(path.c_str());
+    rmdir(dir);
+    return 0;
+}
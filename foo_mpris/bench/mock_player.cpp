@@ -0,0 +1,153 @@
+// Copyright (c) 2023 Ally Sommers
+// This code is licensed under the BSD 3-Clause License. A copy of this license
+// is included in the repository.
+
+#include "mock_player.hpp"
+
+#include "protocol.h"
+
+#include <cstdio>
+#include <cstring>
+
+mock_player::mock_player(size_t trackCount) : current(0), playbackStatus("Stopped"), playbackPosition(0), hopCount(0)
+{
+    char buf[64];
+    for (size_t i = 0; i < trackCount; i++)
+    {
+        track t;
+        snprintf(buf, sizeof(buf), "/org/foobar2000/track/%016zx", i);
+        t.id = buf;
+        snprintf(buf, sizeof(buf), "Track %zu", i);
+        t.title = buf;
+        snprintf(buf, sizeof(buf), "Album %zu", i / 10);
+        t.album = buf;
+        snprintf(buf, sizeof(buf), "Artist %zu", i % 97);
+        t.artists.push_back(buf);
+        t.artists.push_back("Guest Artist");
+        snprintf(buf, sizeof(buf), "Z:\\music\\album %zu\\%02zu.flac", i / 10, i % 10);
+        t.url = buf;
+        t.length = (int64_t)(180 + i % 120) * 1000000;
+        library.push_back(std::move(t));
+    }
+}
+
+void mock_player::post(std::function<void()> task)
+{
+    hopCount++;
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    task();
+}
+
+void mock_player::call(std::function<void()> const &task)
+{
+    hopCount++;
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    task();
+}
+
+void mock_player::play()
+{
+    playbackStatus = library.empty() ? "Stopped" : "Playing";
+}
+
+void mock_player::pause()
+{
+    if (strcmp(playbackStatus, "Stopped"))
+        playbackStatus = "Paused";
+}
+
+void mock_player::playPause()
+{
+    if (!strcmp(playbackStatus, "Playing"))
+        pause();
+    else
+        play();
+}
+
+void mock_player::stop()
+{
+    playbackStatus = "Stopped";
+    playbackPosition = 0;
+}
+
+void mock_player::next()
+{
+    if (!library.empty())
+        current = (current + 1) % library.size();
+    playbackPosition = 0;
+}
+
+void mock_player::previous()
+{
+    if (!library.empty())
+        current = (current + library.size() - 1) % library.size();
+    playbackPosition = 0;
+}
+
+void mock_player::seek(int64_t offset)
+{
+    playbackPosition = playbackPosition + offset > 0 ? playbackPosition + offset : (int64_t)0;
+}
+
+void mock_player::setPosition(std::string_view trackId, int64_t position)
+{
+    if (current < library.size() && library[current].id == trackId)
+        playbackPosition = position;
+}
+
+char const *mock_player::status()
+{
+    return playbackStatus;
+}
+
+int64_t mock_player::position()
+{
+    return playbackPosition;
+}
+
+bool mock_player::metadata(ubjson_writer *writer, int32_t fields)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    if (!strcmp(playbackStatus, "Stopped") || current >= library.size())
+        return false;
+
+    track const &t = library[current];
+    protocol_write_cstring(writer, protocol_key_track(PROTOCOL_INDEX(track, id)), t.id.c_str());
+    if (fields & METADATA_FIELD_LENGTH)
+        protocol_write_INT64(writer, protocol_key_track(PROTOCOL_INDEX(track, length)), t.length);
+    if (fields & METADATA_FIELD_ALBUM)
+        protocol_write_cstring(writer, protocol_key_track(PROTOCOL_INDEX(track, album)), t.album.c_str());
+    if (fields & METADATA_FIELD_ARTIST)
+    {
+        ubjson_writer_key(writer, protocol_key_track(PROTOCOL_INDEX(track, artist)));
+        ubjson_writer_begin_array(writer);
+        for (std::string const &artist : t.artists)
+            ubjson_writer_string(writer, artist.c_str());
+        ubjson_writer_end_array(writer);
+    }
+    if (fields & METADATA_FIELD_TITLE)
+        protocol_write_cstring(writer, protocol_key_track(PROTOCOL_INDEX(track, title)), t.title.c_str());
+    if (fields & METADATA_FIELD_URL)
+        protocol_write_cstring(writer, protocol_key_track(PROTOCOL_INDEX(track, url)), t.url.c_str());
+    return true;
+}
+
+// Matches titles containing the query, like a plain keyword search.
+int64_t mock_player::search(std::string_view query, size_t offset, size_t limit, search_page &page)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+
+    int64_t total = 0;
+    for (track const &t : library)
+    {
+        if (t.title.find(query) == std::string::npos)
+            continue;
+        if ((size_t)total >= offset && page.ids.size() < limit)
+        {
+            page.ids.push_back(t.id);
+            page.titles.push_back(t.artists[0] + " - " + t.title);
+        }
+        total++;
+    }
+    return total;
+}
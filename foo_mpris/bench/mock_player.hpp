@@ -0,0 +1,61 @@
+// Copyright (c) 2023 Ally Sommers
+// This code is licensed under the BSD 3-Clause License. A copy of this license
+// is included in the repository.
+
+#pragma once
+
+#include "player.hpp"
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// An in-memory player_backend holding a generated library, for running the protocol core without foobar2000. post()
+// and call() run their task right away under the player's lock, standing in for foobar2000's main thread.
+class mock_player: public player_backend {
+    public:
+    explicit mock_player(size_t trackCount);
+
+    void post(std::function<void()> task) override;
+    void call(std::function<void()> const &task) override;
+
+    void play() override;
+    void pause() override;
+    void playPause() override;
+    void stop() override;
+    void next() override;
+    void previous() override;
+    void seek(int64_t offset) override;
+    void setPosition(std::string_view trackId, int64_t position) override;
+
+    char const *status() override;
+    int64_t position() override;
+    bool metadata(ubjson_writer *writer, int32_t fields) override;
+    int64_t search(std::string_view query, size_t offset, size_t limit, search_page &page) override;
+
+    // Number of post() and call() so far, each of which would be a trip to foobar2000's main thread.
+    size_t hops() const
+    {
+        return hopCount;
+    }
+
+    private:
+    struct track
+    {
+        std::string id;
+        std::string title;
+        std::string album;
+        std::vector<std::string> artists;
+        std::string url;
+        int64_t length;
+    };
+
+    std::recursive_mutex lock;
+    std::vector<track> library;
+    size_t current;
+    // Readable without the lock, like foobar2000_player's published snapshot
+    std::atomic<char const *> playbackStatus;
+    std::atomic<int64_t> playbackPosition;
+    std::atomic<size_t> hopCount;
+};
@@ -0,0 +1,106 @@
+// Copyright (c) 2023 Ally Sommers
+// This code is licensed under the BSD 3-Clause License. A copy of this license
+// is included in the repository.
+
+#include "capture.hpp"
+
+#include "defines.hpp"
+#include "pcm.h"
+#include "socket.hpp"
+
+#include <cstring>
+#include <stdint.h>
+#include <type_traits>
+
+namespace
+{
+    // 100 ns intervals between 1601-01-01 and 1970-01-01
+    constexpr int64_t FILETIME_UNIX_EPOCH = 116444736000000000LL;
+
+    int64_t unixTimeNs()
+    {
+        FILETIME now;
+        GetSystemTimePreciseAsFileTime(&now);
+        int64_t ticks = ((int64_t)now.dwHighDateTime << 32) | now.dwLowDateTime;
+        return (ticks - FILETIME_UNIX_EPOCH) * 100;
+    }
+
+    void copySamples(float *out, audio_sample const *in, size_t count)
+    {
+        if constexpr (std::is_same_v<audio_sample, float>)
+            memcpy(out, in, count * sizeof(float));
+        else
+            for (size_t i = 0; i < count; i++)
+                out[i] = (float)in[i];
+    }
+} // namespace
+
+pcm_capture::pcm_capture(HANDLE file, HANDLE mapping, void *view)
+    : file(file), mapping(mapping), ring((pcm_ring *)view), blocks((pcm_block *)(ring + 1)),
+      samples((float *)(blocks + PCM_RING_BLOCK_CAPACITY))
+{
+}
+
+pcm_capture *pcm_capture::create()
+{
+    pfc::string8 path = MPRIS::siblingPath(PCM_RING_FILE_NAME);
+
+    // Readers keep their mapping of an old ring if foobar2000 restarts, so the file is replaced rather than reused
+    DeleteFileA(path.c_str());
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL,
+                              CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        LOG("Failed to create PCM ring \"%s\"", path.c_str());
+        return NULL;
+    }
+
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READWRITE, 0, (DWORD)PCM_RING_SIZE, NULL);
+    void *view = mapping ? MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, PCM_RING_SIZE) : NULL;
+    if (!view)
+    {
+        LOG("Failed to map PCM ring \"%s\"", path.c_str());
+        if (mapping)
+            CloseHandle(mapping);
+        CloseHandle(file);
+        return NULL;
+    }
+
+    pcm_capture *capture = new pcm_capture(file, mapping, view);
+    capture->ring->sample_capacity = PCM_RING_SAMPLE_CAPACITY;
+    capture->ring->block_capacity = PCM_RING_BLOCK_CAPACITY;
+    __atomic_store_n(&capture->ring->magic, PCM_RING_MAGIC, __ATOMIC_RELEASE);
+
+    playback_stream_capture::get()->add_callback(capture);
+    return capture;
+}
+
+void pcm_capture::on_chunk(audio_chunk const &chunk)
+{
+    size_t count = chunk.get_used_size();
+    if (!count || count > PCM_RING_SAMPLE_CAPACITY)
+        return;
+
+    uint64_t position = ring->write_position;
+    uint64_t blockIndex = ring->block_count;
+
+    // Readers check this after copying, so it has to be visible before any sample is overwritten
+    __atomic_store_n(&ring->reserve_position, position + count, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    size_t start = position % PCM_RING_SAMPLE_CAPACITY;
+    size_t first = pfc::min_t<size_t>(count, PCM_RING_SAMPLE_CAPACITY - start);
+    copySamples(samples + start, chunk.get_data(), first);
+    copySamples(samples, chunk.get_data() + first, count - first);
+
+    pcm_block &block = blocks[blockIndex % PCM_RING_BLOCK_CAPACITY];
+    block.position = position;
+    block.frames = (uint32_t)chunk.get_sample_count();
+    block.sample_rate = chunk.get_srate();
+    block.channels = chunk.get_channels();
+    block.channel_config = chunk.get_channel_config();
+    block.timestamp = unixTimeNs();
+
+    __atomic_store_n(&ring->write_position, position + count, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->block_count, blockIndex + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,26 @@
+// Copyright (c) 2023 Ally Sommers
+// This code is licensed under the BSD 3-Clause License. A copy of this license
+// is included in the repository.
+
+#pragma once
+
+#include <helpers/foobar2000+atl.h>
+
+// Copies everything foobar2000 plays into the PCM ring described in pcm.h, a file which Linux programs can map
+// directly. on_chunk only ever copies into the mapping; it never waits on a reader.
+class pcm_capture: public playback_stream_capture_callback {
+    public:
+    // Creates the ring and registers the callback. Must be called on the main thread; returns NULL on failure.
+    static pcm_capture *create();
+
+    void on_chunk(audio_chunk const &chunk) override;
+
+    private:
+    pcm_capture(HANDLE file, HANDLE mapping, void *view);
+
+    HANDLE file;
+    HANDLE mapping;
+    struct pcm_ring *ring;
+    struct pcm_block *blocks;
+    float *samples;
+};
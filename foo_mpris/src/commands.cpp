@@ -0,0 +1,415 @@
+// Copyright (c) 2023 Ally Sommers
+// This code is licensed under the BSD 3-Clause License. A copy of this license
+// is included in the repository.
+
+#include "commands.hpp"
+
+#include "defines.hpp"
+
+#include <cstring>
+#include <memory>
+#include <stdint.h>
+#include <vector>
+
+namespace
+{
+    // Where a command runs.
+    enum class command_thread
+    {
+        // On the socket thread.
+        socket,
+        // Posted to the player's thread without waiting for it. These commands have no reply.
+        main,
+        // Called on the player's thread while the socket thread waits, so the reply can be sent straight after.
+        mainSynchronous,
+        // The low-priority lane: on the server's bulk thread, which streams the results in chunks while the socket
+        // thread keeps answering everything else.
+        bulk,
+    };
+
+    struct command_handler
+    {
+        char const *name;
+        size_t length;
+        command_thread thread;
+        bool replies;
+        // Decodes the command's parameter record and checks the required ones are present.
+        bool (*validate)(ubjson_ctx const *message);
+        // Decodes the parameters again and runs the command, writing its reply (if any) to `reply`. Not set for bulk
+        // commands.
+        void (*run)(ubjson_ctx const *message, player_backend &player, ubjson_writer *reply);
+        // Bulk commands only: like `run`, but sends its results in chunks as it goes.
+        bulk_command::stream_function stream;
+    };
+
+    template <typename Args, bool (*read)(ubjson_ctx const *, Args *), uint32_t required>
+    bool validateCommand(ubjson_ctx const *message)
+    {
+        Args args;
+        return read(message, &args) && (args.present & required) == required;
+    }
+
+    template <typename Args, bool (*read)(ubjson_ctx const *, Args *), void (*handle)(Args const &, player_backend &, ubjson_writer *)>
+    void runCommand(ubjson_ctx const *message, player_backend &player, ubjson_writer *reply)
+    {
+        Args args;
+        read(message, &args);
+        handle(args, player, reply);
+    }
+
+    template <typename Args, bool (*read)(ubjson_ctx const *, Args *), void (*handle)(Args const &, player_backend &, frame_sink const &)>
+    void streamCommand(ubjson_ctx const *message, player_backend &player, frame_sink const &send)
+    {
+        Args args;
+        read(message, &args);
+        handle(args, player, send);
+    }
+
+    void handlePause(protocol_none const &, player_backend &player, ubjson_writer *)
+    {
+        player.pause();
+    }
+
+    void handlePlay(protocol_none const &, player_backend &player, ubjson_writer *)
+    {
+        player.play();
+    }
+
+    void handlePlayPause(protocol_none const &, player_backend &player, ubjson_writer *)
+    {
+        player.playPause();
+    }
+
+    void handleNext(protocol_none const &, player_backend &player, ubjson_writer *)
+    {
+        player.next();
+    }
+
+    void handlePrevious(protocol_none const &, player_backend &player, ubjson_writer *)
+    {
+        player.previous();
+    }
+
+    void handleStop(protocol_none const &, player_backend &player, ubjson_writer *)
+    {
+        player.stop();
+    }
+
+    void handlePlaybackStatus(protocol_none const &, player_backend &player, ubjson_writer *reply)
+    {
+        protocol_playback_status status = {};
+        status.status = protocol_string_of(player.status());
+        protocol_encode_playback_status(reply, &status);
+    }
+
+    void handleMetadata(protocol_metadata_args const &args, player_backend &player, ubjson_writer *reply)
+    {
+        int32_t fields = PROTOCOL_HAS(&args, metadata_args, fields) ? args.fields : METADATA_FIELDS_DEFAULT;
+
+        ubjson_writer_begin_object(reply);
+        if (!player.metadata(reply, fields))
+            protocol_write_cstring(reply, protocol_key_track(PROTOCOL_INDEX(track, id)), "/");
+        ubjson_writer_end_object(reply);
+    }
+
+    void handlePosition(protocol_none const &, player_backend &player, ubjson_writer *reply)
+    {
+        protocol_playback_position position = {};
+        position.position = player.position();
+        protocol_encode_playback_position(reply, &position);
+    }
+
+    void handleSeek(protocol_seek_args const &args, player_backend &player, ubjson_writer *)
+    {
+        player.seek(args.offset);
+    }
+
+    void handleSetPosition(protocol_setposition_args const &args, player_backend &player, ubjson_writer *)
+    {
+        player.setPosition(std::string_view(args.track_id.data, args.track_id.length), args.offset);
+    }
+
+    // Search results go out this many at a time, so other replies can be sent in between.
+    constexpr size_t SEARCH_CHUNK_ITEMS = 32;
+
+    void handleSearch(protocol_search_args const &args, player_backend &player, frame_sink const &send)
+    {
+        search_page page;
+        size_t offset = args.offset > 0 ? (size_t)args.offset : 0;
+        size_t limit = args.limit > 0 ? (size_t)args.limit : 0;
+        int64_t total = player.search(std::string_view(args.query.data, args.query.length), offset, limit, page);
+
+        size_t count = page.ids.size() < page.titles.size() ? page.ids.size() : page.titles.size();
+        char const *idItems[SEARCH_CHUNK_ITEMS];
+        char const *titleItems[SEARCH_CHUNK_ITEMS];
+
+        // Every chunk is written into the same buffer
+        ubjson_writer chunk;
+        ubjson_writer_init(&chunk, NULL, 0);
+
+        // Always at least one chunk, as the last one says so
+        size_t sent = 0;
+        do
+        {
+            size_t chunkCount = count - sent < SEARCH_CHUNK_ITEMS ? count - sent : SEARCH_CHUNK_ITEMS;
+            for (size_t i = 0; i < chunkCount; i++)
+            {
+                idItems[i] = page.ids[sent + i].c_str();
+                titleItems[i] = page.titles[sent + i].c_str();
+            }
+            sent += chunkCount;
+
+            protocol_search_results out = {};
+            out.serial = args.serial;
+            out.total = total;
+            out.ids.count = chunkCount;
+            out.ids.items = idItems;
+            out.titles.count = chunkCount;
+            out.titles.items = titleItems;
+            out.done = sent == count;
+
+            ubjson_writer_reset(&chunk);
+            protocol_encode_search_chunk(&chunk, &out);
+            if (chunk.failed)
+                break;
+            send(chunk.buf, chunk.len);
+        } while (sent < count);
+
+        // foobard waits on the last chunk to answer the search, so one which couldn't be encoded is replaced by a
+        // failure, which fits the buffer on the stack and so can't fail itself
+        if (chunk.failed)
+        {
+            char buf[128];
+            ubjson_writer failure;
+            ubjson_writer_init(&failure, buf, sizeof(buf));
+            protocol_search_results out = {};
+            out.serial = args.serial;
+            out.total = PROTOCOL_SEARCH_FAILED;
+            out.done = 1;
+            protocol_encode_search_chunk(&failure, &out);
+            send(failure.buf, failure.len);
+            ubjson_writer_free(&failure);
+        }
+
+        ubjson_writer_free(&chunk);
+    }
+
+#define COMMAND(message, thread, replies, record, required, handler)                                                  \
+    {                                                                                                                  \
+        #message, sizeof(#message) - 1, command_thread::thread, replies,                                              \
+            validateCommand<protocol_##record, protocol_read_##record, (required)>,                                   \
+            runCommand<protocol_##record, protocol_read_##record, handler>, NULL                                       \
+    }
+#define BULK_COMMAND(message, record, required, handler)                                                              \
+    {                                                                                                                  \
+        #message, sizeof(#message) - 1, command_thread::bulk, false,                                                  \
+            validateCommand<protocol_##record, protocol_read_##record, (required)>, NULL,                             \
+            streamCommand<protocol_##record, protocol_read_##record, handler>                                          \
+    }
+
+    // clang-format off
+    constexpr command_handler commands[] = {
+        COMMAND(play,           main,            false, none,             0, handlePlay),
+        COMMAND(pause,          main,            false, none,             0, handlePause),
+        COMMAND(playpause,      main,            false, none,             0, handlePlayPause),
+        COMMAND(stop,           main,            false, none,             0, handleStop),
+        COMMAND(next,           main,            false, none,             0, handleNext),
+        COMMAND(previous,       main,            false, none,             0, handlePrevious),
+        COMMAND(playbackstatus, socket,          true,  none,             0, handlePlaybackStatus),
+        COMMAND(metadata,       socket,          true,  metadata_args,    0, handleMetadata),
+        COMMAND(position,       socket,          true,  none,             0, handlePosition),
+        COMMAND(seek,           main,            false, seek_args,        PROTOCOL_BIT(seek_args, offset), handleSeek),
+        COMMAND(setposition,    main,            false, setposition_args, PROTOCOL_BIT(setposition_args, track_id) |
+                                                                          PROTOCOL_BIT(setposition_args, offset), handleSetPosition),
+        BULK_COMMAND(search,                             search_args,      PROTOCOL_BIT(search_args, query) |
+                                                                          PROTOCOL_BIT(search_args, offset) |
+                                                                          PROTOCOL_BIT(search_args, limit) |
+                                                                          PROTOCOL_BIT(search_args, serial), handleSearch),
+    };
+    // clang-format on
+#undef BULK_COMMAND
+#undef COMMAND
+
+    constexpr size_t COMMAND_COUNT = sizeof(commands) / sizeof(*commands);
+
+    // Commands are found through a perfect hash of their name: the seed below is searched for at compile time so that
+    // every command lands in its own slot, and a lookup costs one hash and one memcmp however many commands there are.
+    constexpr size_t COMMAND_SLOT_COUNT = 32;
+    constexpr uint32_t COMMAND_SEED_LIMIT = 4096;
+
+    constexpr size_t commandSlot(char const *name, size_t length, uint32_t seed)
+    {
+        // FNV-1a, offset by the seed; the high bits are better mixed than the low ones
+        uint32_t hash = 2166136261u + seed;
+        for (size_t i = 0; i < length; i++)
+            hash = (hash ^ (uint8_t)name[i]) * 16777619u;
+        return (hash >> 16) % COMMAND_SLOT_COUNT;
+    }
+
+    struct command_table
+    {
+        uint32_t seed;
+        int8_t slots[COMMAND_SLOT_COUNT];
+    };
+
+    constexpr command_table buildCommandTable()
+    {
+        command_table table = {};
+        for (table.seed = 0; table.seed < COMMAND_SEED_LIMIT; table.seed++)
+        {
+            bool collided = false;
+            for (size_t i = 0; i < COMMAND_SLOT_COUNT; i++)
+                table.slots[i] = -1;
+            for (size_t i = 0; i < COMMAND_COUNT && !collided; i++)
+            {
+                size_t slot = commandSlot(commands[i].name, commands[i].length, table.seed);
+                collided = table.slots[slot] != -1;
+                table.slots[slot] = (int8_t)i;
+            }
+            if (!collided)
+                break;
+        }
+        return table;
+    }
+
+    constexpr command_table commandTable = buildCommandTable();
+    static_assert(commandTable.seed < COMMAND_SEED_LIMIT, "No perfect hash for the command names; raise COMMAND_SLOT_COUNT");
+
+    command_handler const *findCommand(char const *name, size_t length)
+    {
+        int8_t index = commandTable.slots[commandSlot(name, length, commandTable.seed)];
+        if (index < 0 || commands[index].length != length || memcmp(commands[index].name, name, length))
+            return NULL;
+        return &commands[index];
+    }
+} // namespace
+
+bulk_command::bulk_command(stream_function stream, ubjson_ctx const &message) : stream(stream), message(message), owned(true)
+{
+}
+
+bulk_command::bulk_command(bulk_command &&other) : stream(other.stream), message(other.message), owned(other.owned)
+{
+    other.owned = false;
+}
+
+bulk_command::~bulk_command()
+{
+    if (owned)
+        ubjson_ctx_free(&message);
+}
+
+void bulk_command::run(player_backend &player, frame_sink const &send)
+{
+    stream(&message, player, send);
+}
+
+struct queued_command
+{
+    command_handler const *command;
+    // Owned; the decoded parameters point into it
+    ubjson_ctx message;
+};
+
+namespace
+{
+    void runQueued(std::vector<queued_command> &queued, player_backend &player)
+    {
+        for (queued_command &pending : queued)
+            pending.command->run(&pending.message, player, NULL);
+    }
+
+    void freeQueued(std::vector<queued_command> &queued)
+    {
+        for (queued_command &pending : queued)
+            ubjson_ctx_free(&pending.message);
+        queued.clear();
+    }
+} // namespace
+
+command_batch::command_batch(player_backend &player, ubjson_writer &replyWriter)
+    : player(player), replyWriter(replyWriter), count(0)
+{
+    ubjson_writer_reset(&replyWriter);
+}
+
+command_batch::~command_batch()
+{
+    freeQueued(queued);
+}
+
+void command_batch::add(ubjson_ctx *message)
+{
+    protocol_string name = protocol_read_tag(message, PROTOCOL_TAG_COMMAND);
+    command_handler const *command = name.data ? findCommand(name.data, name.length) : NULL;
+    if (!command)
+    {
+        LOG("Received unknown command '%.*s'!", (int)name.length, name.data ? name.data : "");
+        ubjson_ctx_free(message);
+        return;
+    }
+
+    if (!command->validate(message))
+    {
+        LOG("Missing parameters for command '%s'!", command->name);
+        ubjson_ctx_free(message);
+        return;
+    }
+
+    count++;
+    if (command->thread == command_thread::main)
+    {
+        queued.push_back({ command, *message });
+        return;
+    }
+    if (command->thread == command_thread::bulk)
+    {
+        bulk.emplace_back(command->stream, *message);
+        return;
+    }
+
+    // Written straight after the previous reply
+    ubjson_writer *reply = command->replies ? &replyWriter : NULL;
+    if (command->thread == command_thread::mainSynchronous)
+    {
+        // Takes whatever is queued along, so commands still run in order and the batch still costs one hop
+        player.call([&] {
+            runQueued(queued, player);
+            command->run(message, player, reply);
+        });
+        freeQueued(queued);
+    }
+    else
+    {
+        command->run(message, player, reply);
+    }
+    ubjson_ctx_free(message);
+}
+
+void command_batch::addReply(char const *frame, size_t length)
+{
+    ubjson_writer_raw(&replyWriter, frame, length);
+}
+
+std::vector<bulk_command> command_batch::takeBulk()
+{
+    std::vector<bulk_command> taken = std::move(bulk);
+    bulk.clear();
+    return taken;
+}
+
+void command_batch::flush()
+{
+    if (queued.empty())
+        return;
+
+    // Freed once the task has run, or with it if it never does
+    std::shared_ptr<std::vector<queued_command>> pending(new std::vector<queued_command>(std::move(queued)),
+                                                         [](std::vector<queued_command> *commands) {
+                                                             freeQueued(*commands);
+                                                             delete commands;
+                                                         });
+    queued.clear();
+    player_backend *target = &player;
+    player.post([pending, target] { runQueued(*pending, *target); });
+}
@@ -0,0 +1,77 @@
+// Copyright (c) 2023 Ally Sommers
+// This code is licensed under the BSD 3-Clause License. A copy of this license
+// is included in the repository.
+
+#pragma once
+
+#include "player.hpp"
+#include "protocol.h"
+#include "ubjson/ubjson.h"
+
+#include <functional>
+#include <stddef.h>
+#include <vector>
+
+struct queued_command;
+
+// Takes a rendered frame to send to foobard.
+using frame_sink = std::function<void(char const *frame, size_t length)>;
+
+// A command from the bulk lane, taken out of a batch to run behind the socket thread (see command_server). Owns its
+// message.
+class bulk_command {
+    public:
+    using stream_function = void (*)(ubjson_ctx const *message, player_backend &player, frame_sink const &send);
+
+    bulk_command(stream_function stream, ubjson_ctx const &message);
+    bulk_command(bulk_command &&other);
+    bulk_command(bulk_command const &) = delete;
+    ~bulk_command();
+
+    // Runs the command, handing each chunk of its results to `send` as soon as it's rendered.
+    void run(player_backend &player, frame_sink const &send);
+
+    private:
+    stream_function stream;
+    ubjson_ctx message;
+    bool owned;
+};
+
+// The commands read from the socket in one go. Those which run on the socket thread run as they're added; those for
+// the player's thread are queued and all run in a single post() by flush(), in the order they came. Replies (and
+// anything else added with addReply()) are written one after another into one buffer so they can go out in a single
+// send. Bulk commands are only collected, for the caller to take with takeBulk().
+class command_batch {
+    public:
+    // Replies are written straight into `replyWriter`, which is reset first.
+    command_batch(player_backend &player, ubjson_writer &replyWriter);
+    // Frees any commands which were never flushed.
+    ~command_batch();
+
+    // Runs or queues the command in the parsed `message`, taking ownership of it. Unknown commands and ones missing
+    // a required parameter are logged and dropped.
+    void add(ubjson_ctx *message);
+    // Appends a rendered frame to the replies.
+    void addReply(char const *frame, size_t length);
+    // Hands the queued commands to the player's thread.
+    void flush();
+    // Moves out the bulk commands added so far.
+    std::vector<bulk_command> takeBulk();
+
+    // Commands added so far, run or queued.
+    size_t size() const
+    {
+        return count;
+    }
+    ubjson_writer const &replies() const
+    {
+        return replyWriter;
+    }
+
+    private:
+    player_backend &player;
+    ubjson_writer &replyWriter;
+    std::vector<queued_command> queued;
+    std::vector<bulk_command> bulk;
+    size_t count;
+};
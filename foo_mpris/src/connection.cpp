@@ -0,0 +1,184 @@
+// Copyright (c) 2023 Ally Sommers
+// This code is licensed under the BSD 3-Clause License. A copy of this license
+// is included in the repository.
+
+#include "connection.hpp"
+
+#include <cstring>
+
+#ifdef _WIN32
+#include <afunix.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define INVALID_SOCKET (-1)
+#define closesocket ::close
+#endif
+
+namespace
+{
+    bool wouldBlock()
+    {
+#ifdef _WIN32
+        return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+        return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+    }
+
+    // Blocks until `sock` can take more data, or for a second at most so a wedged peer can't hang the sender.
+    bool waitWritable(SOCKET sock)
+    {
+#ifdef _WIN32
+        fd_set writable;
+        FD_ZERO(&writable);
+        FD_SET(sock, &writable);
+        timeval timeout = { 1, 0 };
+        return select(0, NULL, &writable, NULL, &timeout) > 0;
+#else
+        pollfd fds = { sock, POLLOUT, 0 };
+        return poll(&fds, 1, 1000) > 0;
+#endif
+    }
+} // namespace
+
+connection::connection() : sock(INVALID_SOCKET)
+{
+#ifdef _WIN32
+    socketEvent = WSACreateEvent();
+    shutdownEvent = CreateEventA(NULL, TRUE, FALSE, NULL);
+#else
+    if (pipe(shutdownPipe))
+        shutdownPipe[0] = shutdownPipe[1] = -1;
+#endif
+}
+
+connection::~connection()
+{
+    close();
+#ifdef _WIN32
+    WSACloseEvent(socketEvent);
+    CloseHandle(shutdownEvent);
+#else
+    ::close(shutdownPipe[0]);
+    ::close(shutdownPipe[1]);
+#endif
+}
+
+bool connection::open(char const *path)
+{
+    close();
+
+    sockaddr_un address = { AF_UNIX };
+    if (strlen(path) >= sizeof(address.sun_path))
+        return false;
+    strcpy(address.sun_path, path);
+
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == INVALID_SOCKET)
+        return false;
+
+    if (connect(sock, (sockaddr *)&address, sizeof(address)))
+    {
+        close();
+        return false;
+    }
+
+    // Reads never block; wait() is where the thread sleeps
+#ifdef _WIN32
+    WSAEventSelect(sock, socketEvent, FD_READ | FD_CLOSE);
+#else
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+#endif
+    return true;
+}
+
+void connection::close()
+{
+    if (sock == INVALID_SOCKET)
+        return;
+    closesocket(sock);
+    sock = INVALID_SOCKET;
+}
+
+bool connection::wait()
+{
+#ifdef _WIN32
+    HANDLE events[] = { shutdownEvent, socketEvent };
+    if (WaitForMultipleObjects(2, events, FALSE, INFINITE) != WAIT_OBJECT_0 + 1)
+        return false;
+
+    // Resets the event; the caller reads until there's nothing left, which re-arms FD_READ
+    WSANETWORKEVENTS networkEvents;
+    WSAEnumNetworkEvents(sock, socketEvent, &networkEvents);
+    return true;
+#else
+    pollfd fds[] = {
+        { shutdownPipe[0], POLLIN, 0 },
+        { sock, POLLIN, 0 },
+    };
+    while (poll(fds, 2, -1) < 0)
+    {
+        if (errno != EINTR)
+            return false;
+    }
+    return !fds[0].revents;
+#endif
+}
+
+bool connection::sleep(unsigned milliseconds)
+{
+#ifdef _WIN32
+    return WaitForSingleObject(shutdownEvent, milliseconds) == WAIT_TIMEOUT;
+#else
+    pollfd fds = { shutdownPipe[0], POLLIN, 0 };
+    return poll(&fds, 1, (int)milliseconds) == 0;
+#endif
+}
+
+long connection::receive(char *buf, size_t len)
+{
+    long received = recv(sock, buf, (int)len, 0);
+    if (received < 0)
+        return wouldBlock() ? -1 : 0;
+    return received;
+}
+
+bool connection::send(char const *buf, size_t len)
+{
+#ifdef _WIN32
+    int const flags = 0;
+#else
+    int const flags = MSG_NOSIGNAL;
+#endif
+
+    while (len)
+    {
+        long sent = ::send(sock, buf, (int)len, flags);
+        if (sent < 0)
+        {
+            if (!wouldBlock() || !waitWritable(sock))
+                return false;
+            continue;
+        }
+        buf += sent;
+        len -= sent;
+    }
+    return true;
+}
+
+void connection::shutdown()
+{
+#ifdef _WIN32
+    SetEvent(shutdownEvent);
+#else
+    char byte = 0;
+    if (write(shutdownPipe[1], &byte, 1) < 0)
+        return;
+#endif
+}
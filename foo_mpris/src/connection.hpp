@@ -0,0 +1,49 @@
+// Copyright (c) 2023 Ally Sommers
+// This code is licensed under the BSD 3-Clause License. A copy of this license
+// is included in the repository.
+
+#pragma once
+
+#include <stddef.h>
+
+#ifdef _WIN32
+#include <WinSock2.h>
+#else
+typedef int SOCKET;
+#endif
+
+// The stream connection to foobard: one thread connects, waits and reads, any thread sends, and shutdown() wakes the
+// reader for good. Wraps WinSock on Windows and plain POSIX sockets elsewhere, so the I/O loop built on it isn't
+// tied to Windows.
+class connection {
+    public:
+    connection();
+    ~connection();
+
+    // Connects to the Unix socket at `path`, dropping any previous connection.
+    bool open(char const *path);
+    void close();
+
+    // Blocks until there may be something to receive (data or a hang-up). Returns false once shutdown() is called.
+    bool wait();
+    // Blocks for `milliseconds`. Returns false early once shutdown() is called.
+    bool sleep(unsigned milliseconds);
+    // Returns the number of bytes read, 0 if the connection is gone, or -1 if there was nothing to read yet.
+    long receive(char *buf, size_t len);
+    // Sends all of `buf`, waiting for room if need be. Not thread-safe on its own; MPRIS::sendPacket serialises it.
+    bool send(char const *buf, size_t len);
+
+    // Can be called from any thread.
+    void shutdown();
+
+    private:
+    SOCKET sock;
+#ifdef _WIN32
+    // Signalled by WinSock for FD_READ and FD_CLOSE
+    HANDLE socketEvent;
+    HANDLE shutdownEvent;
+#else
+    // shutdown() writes to the second descriptor; wait() and sleep() poll the first
+    int shutdownPipe[2];
+#endif
+};
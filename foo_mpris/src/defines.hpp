@@ -4,10 +4,14 @@
 
 #pragma once
 
-#define LOG(fmt, ...)                                       \
-    do                                                      \
-    {                                                       \
-        console::printf("[foo_mpris] " fmt, ##__VA_ARGS__); \
+// Prints a line to the log: the foobar2000 console in the component (see main.cpp), stderr in the benchmark, which
+// links the protocol core without foobar2000.
+void logMessage(char const *fmt, ...);
+
+#define LOG(fmt, ...)                                  \
+    do                                                 \
+    {                                                  \
+        logMessage("[foo_mpris] " fmt, ##__VA_ARGS__); \
     } while (0)
 
 constexpr double USEC_PER_SEC = 1000000.0;
@@ -0,0 +1,157 @@
+// Copyright (c) 2023 Ally Sommers
+// This code is licensed under the BSD 3-Clause License. A copy of this license
+// is included in the repository.
+
+#include "dynamicinfo.hpp"
+
+#include "metadata.hpp"
+#include "preferences.hpp"
+#include "socket.hpp"
+#include "state.hpp"
+#include "trackid.hpp"
+#include "ubjson/ubjson.h"
+
+#include <chrono>
+#include <vector>
+
+namespace
+{
+    // The fields a stream can change. Bitrate is left out on purpose: it changes every second on VBR streams and
+    // nobody needs a PropertiesChanged for it.
+    constexpr int32_t dynamicFields[] = {
+        METADATA_FIELD_TITLE,        METADATA_FIELD_ARTIST, METADATA_FIELD_ALBUM,   METADATA_FIELD_DATE,
+        METADATA_FIELD_ALBUM_ARTIST, METADATA_FIELD_GENRE,  METADATA_FIELD_COMMENT,
+    };
+
+    constexpr size_t DYNAMIC_FIELD_COUNT = sizeof(dynamicFields) / sizeof(*dynamicFields);
+
+    struct dynamic_state
+    {
+        metadb_handle_ptr track;
+        pfc::string8 trackId;
+        // Each field as foobard last saw it, rendered; compared byte for byte to find what changed
+        std::vector<char> sent[DYNAMIC_FIELD_COUNT];
+        // The latest dynamic info merged over the track's, waiting to be flushed
+        std::shared_ptr<file_info_impl> pending;
+        // The merged info as of the last update sent
+        std::shared_ptr<file_info const> published;
+        std::chrono::steady_clock::time_point lastFlush;
+        bool flushScheduled = false;
+    };
+
+    dynamic_state dynamic;
+
+    std::vector<char> renderField(file_info const &info, int32_t field)
+    {
+        ubjson_writer writer;
+        ubjson_writer_init(&writer, NULL, 0);
+        addInfoMetadata(&writer, dynamic.track, info, "", field);
+
+        std::vector<char> rendered(writer.buf, writer.buf + writer.len);
+        ubjson_writer_free(&writer);
+        return rendered;
+    }
+
+    void flush()
+    {
+        if (!dynamic.pending)
+            return;
+
+        std::shared_ptr<file_info const> info = std::move(dynamic.pending);
+        dynamic.lastFlush = std::chrono::steady_clock::now();
+
+        int32_t changed = 0;
+        for (size_t i = 0; i < DYNAMIC_FIELD_COUNT; i++)
+        {
+            std::vector<char> rendered = renderField(*info, dynamicFields[i]);
+            if (rendered != dynamic.sent[i])
+            {
+                changed |= dynamicFields[i];
+                dynamic.sent[i] = std::move(rendered);
+            }
+        }
+        if (!changed)
+            return;
+
+        // The snapshot first, so a "metadata" command sent in answer to the update already sees it
+        dynamic.published = std::move(info);
+        publishPlaybackState();
+
+        if (!MPRIS::server.isConnected())
+            return;
+
+        ubjson_writer writer;
+        ubjson_writer_init(&writer, NULL, 0);
+        ubjson_writer_begin_object(&writer);
+        protocol_write_cstring(&writer, PROTOCOL_TAG_EVENT, "update");
+        addInfoMetadata(&writer, dynamic.track, *dynamic.published, dynamic.trackId.c_str(), changed);
+        ubjson_writer_end_object(&writer);
+        if (!writer.failed)
+            MPRIS::sendPacket(writer.buf, writer.len);
+        ubjson_writer_free(&writer);
+    }
+} // namespace
+
+void onDynamicInfo(file_info const &info)
+{
+    metadb_handle_ptr track;
+    if (!playback_control::get()->get_now_playing(track))
+        return;
+
+    metadb_info_container::ptr container = track->get_info_ref();
+    if (track != dynamic.track)
+    {
+        resetDynamicInfo();
+        dynamic.track = track;
+        getTrackId(track, dynamic.trackId);
+        // foobard was sent the track's own tags with "promote"
+        for (size_t i = 0; i < DYNAMIC_FIELD_COUNT; i++)
+            dynamic.sent[i] = renderField(container->info(), dynamicFields[i]);
+    }
+
+    // Merged over the previous dynamic info rather than the track's, as a report can carry only some of the fields
+    file_info const &base = dynamic.pending     ? *dynamic.pending
+                            : dynamic.published ? *dynamic.published
+                                                : container->info();
+    auto merged = std::make_shared<file_info_impl>(base);
+    size_t count = info.meta_get_count();
+    for (size_t i = 0; i < count; i++)
+        merged->copy_meta_single(info, i);
+    dynamic.pending = std::move(merged);
+
+    if (dynamic.flushScheduled)
+        return;
+
+    std::chrono::duration<double> interval = std::chrono::milliseconds(cfgDynamicInfoInterval.get());
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - dynamic.lastFlush;
+    if (elapsed >= interval)
+    {
+        flush();
+        return;
+    }
+
+    // Whatever arrives in the meantime replaces `pending`, so a burst goes out as a single update
+    dynamic.flushScheduled = true;
+    fb2k::callLater((interval - elapsed).count(), [] {
+        dynamic.flushScheduled = false;
+        flush();
+    });
+}
+
+void resetDynamicInfo()
+{
+    // A scheduled flush is left to run and finds nothing pending
+    dynamic.track.release();
+    dynamic.trackId.reset();
+    for (std::vector<char> &field : dynamic.sent)
+        field.clear();
+    dynamic.pending.reset();
+    dynamic.published.reset();
+}
+
+std::shared_ptr<file_info const> getDynamicInfo(metadb_handle_ptr const &track)
+{
+    if (track != dynamic.track)
+        return nullptr;
+    return dynamic.published;
+}
@@ -0,0 +1,19 @@
+// Copyright (c) 2023 Ally Sommers
+// This code is licensed under the BSD 3-Clause License. A copy of this license
+// is included in the repository.
+
+#pragma once
+
+#include <helpers/foobar2000+atl.h>
+#include <memory>
+
+// Streams such as internet radio change their title mid-track, which foobar2000 reports as dynamic info. Each
+// report is merged over the playing track's info and the fields which changed are sent to foobard as an "update"
+// event, at most once per cfgDynamicInfoInterval. All of these are main thread only.
+
+// Takes the dynamic info from either of play_callback's dynamic info callbacks.
+void onDynamicInfo(file_info const &info);
+// Forgets the dynamic info of the previous track; called when the track changes or playback stops.
+void resetDynamicInfo();
+// The info last sent for `track` with its dynamic info applied, or null if none was.
+std::shared_ptr<file_info const> getDynamicInfo(metadb_handle_ptr const &track);
@@ -0,0 +1,127 @@
+// Copyright (c) 2023 Ally Sommers
+// This code is licensed under the BSD 3-Clause License. A copy of this license
+// is included in the repository.
+
+#include "foobar2000_player.hpp"
+
+#include "defines.hpp"
+#include "metadata.hpp"
+#include "search.hpp"
+#include "state.hpp"
+#include "titleformat.hpp"
+#include "trackid.hpp"
+
+#include <cstring>
+#include <inttypes.h>
+
+void foobar2000_player::post(std::function<void()> task)
+{
+    fb2k::inMainThread(std::move(task));
+}
+
+void foobar2000_player::call(std::function<void()> const &task)
+{
+    fb2k::inMainThreadSynchronous(task, abort);
+}
+
+void foobar2000_player::play()
+{
+    playback_control::get()->play_or_unpause();
+}
+
+void foobar2000_player::pause()
+{
+    playback_control::get()->pause(true);
+}
+
+void foobar2000_player::playPause()
+{
+    playback_control::get()->play_or_pause();
+}
+
+void foobar2000_player::stop()
+{
+    playback_control::get()->stop();
+}
+
+void foobar2000_player::next()
+{
+    playback_control::get()->next();
+}
+
+void foobar2000_player::previous()
+{
+    playback_control::get()->previous();
+}
+
+void foobar2000_player::seek(int64_t offset)
+{
+    LOG("Seeking by %" PRId64, offset);
+    playback_control::get()->playback_seek_delta((double)offset / USEC_PER_SEC);
+}
+
+void foobar2000_player::setPosition(std::string_view trackId, int64_t position)
+{
+    metadb_handle_ptr p_track;
+    pfc::string p_out {};
+
+    if (!playback_control::get()->get_now_playing(p_track))
+        return;
+    getTrackId(p_track, p_out);
+    if (trackId != std::string_view(p_out.c_str(), p_out.length()))
+    {
+        LOG("Tried to seek in non-current track ('%.*s' != '%s')", (int)trackId.size(), trackId.data(), p_out.c_str());
+        return;
+    }
+
+    LOG("Seeking to %" PRId64, position);
+    playback_control::get()->playback_seek((double)position / USEC_PER_SEC);
+}
+
+char const *foobar2000_player::status()
+{
+    return getPlaybackState()->status;
+}
+
+int64_t foobar2000_player::position()
+{
+    return (int64_t)(getPlaybackState()->currentPosition() * USEC_PER_SEC);
+}
+
+bool foobar2000_player::metadata(ubjson_writer *writer, int32_t fields)
+{
+    auto state = getPlaybackState();
+    if (!state->track.is_valid())
+        return false;
+
+    if (state->info)
+        addInfoMetadata(writer, state->track, *state->info, state->trackId.c_str(), fields);
+    else
+        addMetadata(writer, state->track, state->trackId.c_str(), fields);
+    return true;
+}
+
+int64_t foobar2000_player::search(std::string_view query, size_t offset, size_t limit, search_page &page)
+{
+    titleformat_object::ptr searchTitleFormat = getTitleFormat("[%artist% - ]%title%");
+
+    // The search filter takes a C string
+    metadb_handle_list results;
+    if (!searchLibrary(std::string(query).c_str(), results, abort))
+        return -1;
+
+    size_t first = pfc::min_t(offset, results.get_count());
+    size_t last = first + pfc::min_t(limit, results.get_count() - first);
+
+    pfc::string8 id;
+    pfc::string8 title;
+    for (size_t i = first; i < last; i++)
+    {
+        getTrackId(results[i], id);
+        results[i]->format_title(NULL, title, searchTitleFormat, NULL);
+        page.ids.emplace_back(id.c_str());
+        page.titles.emplace_back(title.c_str());
+    }
+
+    return (int64_t)results.get_count();
+}
@@ -0,0 +1,34 @@
+// Copyright (c) 2023 Ally Sommers
+// This code is licensed under the BSD 3-Clause License. A copy of this license
+// is included in the repository.
+
+#pragma once
+
+#include "player.hpp"
+
+#include <helpers/foobar2000+atl.h>
+
+// The player_backend of the component: controls foobar2000 on its main thread and answers reads from the published
+// playback_state snapshot.
+class foobar2000_player: public player_backend {
+    public:
+    void post(std::function<void()> task) override;
+    void call(std::function<void()> const &task) override;
+
+    void play() override;
+    void pause() override;
+    void playPause() override;
+    void stop() override;
+    void next() override;
+    void previous() override;
+    void seek(int64_t offset) override;
+    void setPosition(std::string_view trackId, int64_t position) override;
+
+    char const *status() override;
+    int64_t position() override;
+    bool metadata(ubjson_writer *writer, int32_t fields) override;
+    int64_t search(std::string_view query, size_t offset, size_t limit, search_page &page) override;
+
+    private:
+    abort_callback_impl abort;
+};
@@ -2,11 +2,17 @@
 // This code is licensed under the BSD 3-Clause License. A copy of this license
 // is included in the repository.
 
+#include "capture.hpp"
+#include "defines.hpp"
+#include "preferences.hpp"
 #include "socket.hpp"
+#include "state.hpp"
+#include "visualisation.hpp"
 
 #include <WinSock2.h>
 #include <Windows.h>
 #include <afunix.h>
+#include <cstdarg>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
@@ -16,15 +22,18 @@
 DECLARE_COMPONENT_VERSION("foo_mpris", "0.0.1", "");
 VALIDATE_COMPONENT_FILENAME("foo_mpris.dll");
 
-#define LOG(fmt, ...)                                       \
-    do                                                      \
-    {                                                       \
-        console::printf("[foo_mpris] " fmt, ##__VA_ARGS__); \
-    } while (0)
 #define MPRIS_FLAG "/mpris" // will have a ':' between the flag and the subcommand
 
 static FILE *outputFile;
 
+void logMessage(char const *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    console::printfv(fmt, args);
+    va_end(args);
+}
+
 class mpris_commandline_handler: public commandline_handler {
     result on_token(const char *token) override
     {
@@ -38,6 +47,7 @@ class mpris_commandline_handler: public commandline_handler {
 static commandline_handler_factory_t<mpris_commandline_handler> commandline_factory;
 
 MPRIS *mpris;
+pcm_capture *capture;
 
 class mpris_initquit: public initquit {
     virtual void FB2KAPI on_init()
@@ -48,14 +58,22 @@ class mpris_initquit: public initquit {
 
         mpris = new MPRIS {};
         MPRIS::initStatic();
-        fb2k::inMainThread([] { play_callback_manager::get()->register_callback(mpris, MPRIS::flags(), true); });
+        fb2k::inMainThread([] {
+            play_callback_manager::get()->register_callback(mpris, MPRIS::flags(), true);
+            publishPlaybackState();
+            if (cfgCapturePcm.get())
+                capture = pcm_capture::create();
+        });
 
-        CreateThread(NULL, 0, MPRIS::connectToServer, NULL, 0, NULL);
+        CreateThread(NULL, 0, MPRIS::serve, NULL, 0, NULL);
+        CreateThread(NULL, 0, streamVisualisation, NULL, 0, NULL);
     }
 
     virtual void FB2KAPI on_quit()
     {
-        MPRIS::shouldExit = true;
+        MPRIS::shutdown();
+        if (capture)
+            playback_stream_capture::get()->remove_callback(capture);
         LOG("quitting...");
     }
 };
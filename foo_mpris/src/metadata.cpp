@@ -0,0 +1,157 @@
+// Copyright (c) 2023 Ally Sommers
+// This code is licensed under the BSD 3-Clause License. A copy of this license
+// is included in the repository.
+
+#include "metadata.hpp"
+
+#include "defines.hpp"
+#include "titleformat.hpp"
+
+#include <cstdlib>
+#include <cstring>
+
+namespace
+{
+#define TRACK_KEY(member) protocol_key_track(PROTOCOL_INDEX(track, member))
+
+    // Multi- and single-value meta fields, indexed by their position in this table.
+    struct meta_field
+    {
+        char const *meta_name;
+        char const *key;
+        int32_t field;
+        bool multi_value;
+    };
+
+    // clang-format off
+    meta_field const metaFields[] = {
+        { "album",        TRACK_KEY(album),         METADATA_FIELD_ALBUM,        false },
+        { "artist",       TRACK_KEY(artist),        METADATA_FIELD_ARTIST,       true  },
+        { "date",         TRACK_KEY(date),          METADATA_FIELD_DATE,         false },
+        { "title",        TRACK_KEY(title),         METADATA_FIELD_TITLE,        false },
+        { "tracknumber",  TRACK_KEY(track_number),  METADATA_FIELD_TRACK_NUMBER, false },
+        { "album artist", TRACK_KEY(album_artist),  METADATA_FIELD_ALBUM_ARTIST, true  },
+        { "genre",        TRACK_KEY(genre),         METADATA_FIELD_GENRE,        true  },
+        { "composer",     TRACK_KEY(composer),      METADATA_FIELD_COMPOSER,     true  },
+        { "discnumber",   TRACK_KEY(disc_number),   METADATA_FIELD_DISC_NUMBER,  false },
+        { "comment",      TRACK_KEY(comment),       METADATA_FIELD_COMMENT,      true  },
+        { "bpm",          TRACK_KEY(audio_bpm),     METADATA_FIELD_AUDIO_BPM,    false },
+    };
+    // clang-format on
+
+    constexpr size_t META_FIELD_COUNT = sizeof(metaFields) / sizeof(*metaFields);
+
+    void addString(ubjson_writer *writer, file_info const &info, size_t index, char const *key)
+    {
+        protocol_write_cstring(writer, key, index == pfc_infinite ? "" : info.meta_enum_value(index, 0));
+    }
+
+    void addInt(ubjson_writer *writer, file_info const &info, size_t index, char const *key)
+    {
+        protocol_write_INT32(writer, key, index == pfc_infinite ? 0 : atoi(info.meta_enum_value(index, 0)));
+    }
+
+    void addStringArray(ubjson_writer *writer, file_info const &info, size_t index, char const *key)
+    {
+        ubjson_writer_key(writer, key);
+        ubjson_writer_begin_array(writer);
+        if (index != pfc_infinite)
+        {
+            size_t count = info.meta_enum_value_count(index);
+            for (size_t i = 0; i < count; i++)
+                ubjson_writer_string(writer, info.meta_enum_value(index, i));
+        }
+        ubjson_writer_end_array(writer);
+    }
+
+    // foo_playcount keeps its statistics outside of file_info, so they take one titleformat evaluation.
+    void addStats(ubjson_writer *writer, metadb_handle_ptr const &track, int32_t fields)
+    {
+        titleformat_object::ptr statsFormat = getTitleFormat("$if2(%play_count%,0)|%last_played%|%rating%");
+
+        pfc::string8 out;
+        track->format_title(NULL, out, statsFormat, NULL);
+
+        char const *useCount = out.c_str();
+        char *lastPlayed = strchr((char *)useCount, '|');
+        char *rating = lastPlayed ? strchr(lastPlayed + 1, '|') : NULL;
+        if (!lastPlayed || !rating)
+            return;
+        *lastPlayed++ = '\0';
+        *rating++ = '\0';
+
+        if (fields & METADATA_FIELD_USE_COUNT)
+            protocol_write_INT32(writer, TRACK_KEY(use_count), atoi(useCount));
+
+        if (fields & METADATA_FIELD_LAST_USED)
+        {
+            // "YYYY-MM-DD hh:mm:ss" -> ISO 8601; anything else means the track was never played
+            if (strlen(lastPlayed) == 19 && lastPlayed[10] == ' ')
+                lastPlayed[10] = 'T';
+            else
+                lastPlayed[0] = '\0';
+            protocol_write_cstring(writer, TRACK_KEY(last_used), lastPlayed);
+        }
+
+        if (fields & METADATA_FIELD_USER_RATING)
+            protocol_write_FLOAT64(writer, TRACK_KEY(user_rating), atoi(rating) / 5.0);
+    }
+} // namespace
+
+void addMetadata(ubjson_writer *writer, metadb_handle_ptr const &track, char const *id, int32_t fields)
+{
+    metadb_info_container::ptr container = track->get_info_ref();
+    addInfoMetadata(writer, track, container->info(), id, fields);
+}
+
+void addInfoMetadata(ubjson_writer *writer, metadb_handle_ptr const &track, file_info const &info, char const *id,
+                     int32_t fields)
+{
+    size_t metaIndex[META_FIELD_COUNT];
+    for (size_t i = 0; i < META_FIELD_COUNT; i++)
+        metaIndex[i] = pfc_infinite;
+
+    size_t metaCount = info.meta_get_count();
+    for (size_t i = 0; i < metaCount; i++)
+    {
+        char const *name = info.meta_enum_name(i);
+        for (size_t j = 0; j < META_FIELD_COUNT; j++)
+        {
+            if ((fields & metaFields[j].field) && metaIndex[j] == pfc_infinite && !pfc::stricmp_ascii(name, metaFields[j].meta_name))
+            {
+                metaIndex[j] = i;
+                break;
+            }
+        }
+    }
+
+    protocol_write_cstring(writer, TRACK_KEY(id), id);
+    if (fields & METADATA_FIELD_LENGTH)
+        protocol_write_INT64(writer, TRACK_KEY(length), (int64_t)(info.get_length() * USEC_PER_SEC));
+    if (fields & METADATA_FIELD_ART_URL)
+        // now_playing_album_art_notify_manager_v2::get()->current_v2().paths->get_path(0)
+        protocol_write_cstring(writer, TRACK_KEY(art_url), "");
+
+    for (size_t i = 0; i < META_FIELD_COUNT; i++)
+    {
+        meta_field const &meta = metaFields[i];
+        if (!(fields & meta.field))
+            continue;
+
+        if (meta.multi_value)
+            addStringArray(writer, info, metaIndex[i], meta.key);
+        else if (meta.field & (METADATA_FIELD_TRACK_NUMBER | METADATA_FIELD_DISC_NUMBER | METADATA_FIELD_AUDIO_BPM))
+            addInt(writer, info, metaIndex[i], meta.key);
+        else if (meta.field == METADATA_FIELD_TITLE && metaIndex[i] == pfc_infinite)
+            protocol_write_cstring(writer, meta.key, pfc::string_filename(track->get_path()).c_str());
+        else
+            addString(writer, info, metaIndex[i], meta.key);
+    }
+
+    if (fields & METADATA_FIELD_URL)
+        protocol_write_cstring(writer, TRACK_KEY(url), track->get_path());
+    if (fields & METADATA_FIELD_BITRATE)
+        protocol_write_INT32(writer, TRACK_KEY(bitrate), (int32_t)info.info_get_bitrate());
+    if (fields & METADATA_FIELDS_STATS)
+        addStats(writer, track, fields);
+}
@@ -0,0 +1,18 @@
+// Copyright (c) 2023 Ally Sommers
+// This code is licensed under the BSD 3-Clause License. A copy of this license
+// is included in the repository.
+
+#pragma once
+
+#include "protocol.h"
+#include "ubjson/ubjson.h"
+
+#include <helpers/foobar2000+atl.h>
+
+// Writes the requested fields of `track` as keys and values into the object `writer` is in. Everything but the
+// playback statistics is read from a single pass over the track's file_info.
+void addMetadata(ubjson_writer *writer, metadb_handle_ptr const &track, char const *id, int32_t fields);
+// Same, with the tags and technical info taken from `info` instead, such as the track's info with a stream's dynamic
+// info applied. The path and playback statistics still come from `track`.
+void addInfoMetadata(ubjson_writer *writer, metadb_handle_ptr const &track, file_info const &info, char const *id,
+                     int32_t fields);
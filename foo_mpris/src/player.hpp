@@ -0,0 +1,57 @@
+// Copyright (c) 2023 Ally Sommers
+// This code is licensed under the BSD 3-Clause License. A copy of this license
+// is included in the repository.
+
+#pragma once
+
+#include "ubjson/ubjson.h"
+
+#include <functional>
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// One page of search results, in matching order.
+struct search_page
+{
+    std::vector<std::string> ids;
+    std::vector<std::string> titles;
+};
+
+// Everything the protocol core needs from the player. foobar2000_player is the real one; anything else (like the
+// mock player the benchmark uses) lets the core run without foobar2000.
+//
+// The core calls the methods answering a command from the socket thread, except those of commands which need the
+// player's own thread: it hands those to post() or call().
+class player_backend {
+    public:
+    virtual ~player_backend() {}
+
+    // Runs `task` on the player's thread without waiting for it.
+    virtual void post(std::function<void()> task) = 0;
+    // Runs `task` on the player's thread and waits for it to finish.
+    virtual void call(std::function<void()> const &task) = 0;
+
+    virtual void play() = 0;
+    virtual void pause() = 0;
+    virtual void playPause() = 0;
+    virtual void stop() = 0;
+    virtual void next() = 0;
+    virtual void previous() = 0;
+    // Relative to the current position, in microseconds.
+    virtual void seek(int64_t offset) = 0;
+    // Ignored unless `trackId` is the current track.
+    virtual void setPosition(std::string_view trackId, int64_t position) = 0;
+
+    // "Playing", "Paused" or "Stopped"
+    virtual char const *status() = 0;
+    // In microseconds.
+    virtual int64_t position() = 0;
+    // Writes the requested metadata_field keys of the current track into the object `writer` is in. Returns false
+    // without writing anything if there is no current track.
+    virtual bool metadata(ubjson_writer *writer, int32_t fields) = 0;
+    // Fills `page` with up to `limit` matches starting at `offset`. Returns the total number of matches, or -1 if the
+    // query is invalid.
+    virtual int64_t search(std::string_view query, size_t offset, size_t limit, search_page &page) = 0;
+};
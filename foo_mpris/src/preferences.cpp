@@ -0,0 +1,29 @@
+// Copyright (c) 2023 Ally Sommers
+// This code is licensed under the BSD 3-Clause License. A copy of this license
+// is included in the repository.
+
+#include "preferences.hpp"
+
+#include "visualisation.h"
+
+namespace
+{
+    // clang-format off
+    constexpr GUID guidBranch         = { 0x92b172f1, 0x0160, 0x4068, { 0x89, 0x3d, 0xc5, 0xa2, 0xf6, 0xd4, 0x8c, 0xe5 } };
+    constexpr GUID guidVisFrameRate   = { 0x51c109bb, 0xf62a, 0x4cb3, { 0x9b, 0xed, 0xe1, 0x1f, 0xe2, 0x79, 0x40, 0x78 } };
+    constexpr GUID guidVisMode        = { 0x95dc4eee, 0xfee9, 0x4f6e, { 0xa2, 0x74, 0x3a, 0xa5, 0xa9, 0x46, 0x62, 0xe0 } };
+    constexpr GUID guidVisBins        = { 0xcd5e2399, 0x2eaf, 0x45f5, { 0x96, 0xeb, 0xaf, 0xb8, 0xdc, 0xbe, 0x97, 0x68 } };
+    constexpr GUID guidCapturePcm     = { 0xf4cfa197, 0x77bb, 0x4a03, { 0x9a, 0x4f, 0x13, 0xa2, 0xde, 0x1a, 0x33, 0x09 } };
+    constexpr GUID guidDynamicInfo    = { 0xfac6af71, 0x763b, 0x483e, { 0xa5, 0x1e, 0xa9, 0x32, 0xf0, 0xd7, 0x7b, 0x23 } };
+    // clang-format on
+
+    advconfig_branch_factory cfgBranch("MPRIS", guidBranch, advconfig_branch::guid_branch_tools, 0);
+} // namespace
+
+// clang-format off
+advconfig_integer_factory cfgVisFrameRate("Visualisation frames per second (0 disables)", guidVisFrameRate, guidBranch, 0, 30, 0, 120);
+advconfig_integer_factory cfgVisMode("Visualisation mode (0 = spectrum, 1 = peaks)", guidVisMode, guidBranch, 1, VIS_FRAME_SPECTRUM, VIS_FRAME_SPECTRUM, VIS_FRAME_PEAKS);
+advconfig_integer_factory cfgVisBins("Visualisation values per channel", guidVisBins, guidBranch, 2, 64, 1, VIS_MAX_BINS);
+advconfig_checkbox_factory cfgCapturePcm("Share played audio with Linux (applies after restart)", guidCapturePcm, guidBranch, 3, false);
+advconfig_integer_factory cfgDynamicInfoInterval("Minimum interval between stream title updates (ms)", guidDynamicInfo, guidBranch, 4, 1000, 0, 60000);
+// clang-format on
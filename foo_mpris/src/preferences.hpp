@@ -0,0 +1,14 @@
+// Copyright (c) 2023 Ally Sommers
+// This code is licensed under the BSD 3-Clause License. A copy of this license
+// is included in the repository.
+
+#pragma once
+
+#include <helpers/foobar2000+atl.h>
+
+// Entries under Preferences > Advanced > Tools > MPRIS.
+extern advconfig_integer_factory cfgVisFrameRate;
+extern advconfig_integer_factory cfgVisMode;
+extern advconfig_integer_factory cfgVisBins;
+extern advconfig_checkbox_factory cfgCapturePcm;
+extern advconfig_integer_factory cfgDynamicInfoInterval;
@@ -0,0 +1,134 @@
+// Copyright (c) 2023 Ally Sommers
+// This code is licensed under the BSD 3-Clause License. A copy of this license
+// is included in the repository.
+
+#include "search.hpp"
+
+#include <cctype>
+#include <cstring>
+#include <list>
+#include <mutex>
+
+namespace
+{
+    struct cached_search
+    {
+        pfc::string8 query;
+        metadb_handle_list results;
+    };
+
+    std::mutex cacheMutex;
+    std::list<cached_search> cache;
+
+    // Without operators or quoting, foobar2000 treats a query as keywords which must all appear in a track; appending
+    // to such a query can only narrow its results. Operators are the all-uppercase words (AND, HAS, SORT BY...).
+    bool isKeywordQuery(char const *query)
+    {
+        if (strpbrk(query, "()\"'%$[]=<>!|"))
+            return false;
+
+        bool upper = true;
+        size_t length = 0;
+        for (char const *c = query;; c++)
+        {
+            if (*c == ' ' || *c == '\0')
+            {
+                if (upper && length > 1)
+                    return false;
+                if (*c == '\0')
+                    return true;
+                upper = true;
+                length = 0;
+                continue;
+            }
+
+            upper = upper && isupper((unsigned char)*c);
+            length++;
+        }
+    }
+
+    class search_library_callback: public library_callback {
+        void on_items_added(metadb_handle_list_cref items) override
+        {
+            clear();
+        }
+        void on_items_removed(metadb_handle_list_cref items) override
+        {
+            clear();
+        }
+        void on_items_modified(metadb_handle_list_cref items) override
+        {
+            clear();
+        }
+
+        static void clear()
+        {
+            std::lock_guard<std::mutex> lock(cacheMutex);
+            cache.clear();
+        }
+    };
+
+    library_callback_factory_t<search_library_callback> libraryCallbackFactory;
+} // namespace
+
+bool searchLibrary(char const *query, metadb_handle_list &out, abort_callback &abort)
+{
+    bool refine = false;
+    metadb_handle_list candidates;
+
+    {
+        std::lock_guard<std::mutex> lock(cacheMutex);
+
+        size_t refineLength = 0;
+        for (auto it = cache.begin(); it != cache.end(); ++it)
+        {
+            if (!strcmp(it->query.c_str(), query))
+            {
+                out = it->results;
+                cache.splice(cache.begin(), cache, it);
+                return true;
+            }
+
+            size_t length = it->query.length();
+            if (length > refineLength && !strncmp(it->query.c_str(), query, length) && isKeywordQuery(it->query.c_str()) &&
+                isKeywordQuery(query))
+            {
+                candidates = it->results;
+                refineLength = length;
+                refine = true;
+            }
+        }
+    }
+
+    try
+    {
+        search_filter_v2::ptr filter =
+            search_filter_manager_v2::get()->create_ex(query, completion_notify::ptr(), search_filter_manager_v2::KFlagSuppressNotify);
+
+        search_index_manager::ptr indexManager;
+        if (!refine && search_index_manager::tryGet(indexManager))
+        {
+            fb2k::arrayRef results = indexManager->get_library_index()->search(filter, nullptr, 0, abort);
+            out.remove_all();
+            out.add_items(results->as_list_of<metadb_handle>());
+        }
+        else
+        {
+            if (!refine)
+                fb2k::inMainThreadSynchronous([&] { library_manager::get()->get_all_items(candidates); }, abort);
+            filter->test_multi_here(candidates, abort);
+            out = candidates;
+        }
+    }
+    catch (std::exception const &)
+    {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    cache.push_front({ query, out });
+    if (cache.size() > SEARCH_CACHE_SIZE)
+        cache.pop_back();
+
+    return true;
+}
@@ -0,0 +1,16 @@
+// Copyright (c) 2023 Ally Sommers
+// This code is licensed under the BSD 3-Clause License. A copy of this license
+// is included in the repository.
+
+#pragma once
+
+#include <helpers/foobar2000+atl.h>
+
+// Number of queries whose results are kept, most recently used first.
+constexpr size_t SEARCH_CACHE_SIZE = 8;
+
+// Runs a Media Library search, writing the matching tracks to `out`. Repeating a recent query returns its cached
+// results, and a plain keyword query which extends a recent one (as when the user keeps typing) only filters that
+// query's results instead of the whole library. Returns false if the query is invalid.
+// Can be called from any thread; the cache is dropped whenever the library changes.
+bool searchLibrary(char const *query, metadb_handle_list &out, abort_callback &abort);
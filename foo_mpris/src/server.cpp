@@ -0,0 +1,210 @@
+// Copyright (c) 2023 Ally Sommers
+// This code is licensed under the BSD 3-Clause License. A copy of this license
+// is included in the repository.
+
+#include "server.hpp"
+
+#include "defines.hpp"
+#include "protocol.h"
+
+#include <cstring>
+#include <thread>
+#include <vector>
+
+command_server::command_server(player_backend &player)
+    : player(player), inbox(INBOX_SIZE), inboxLength(0), generation(0), connected(false), stopping(false), wakeupCount(0)
+{
+    ubjson_reader_init(&inboxReader);
+    ubjson_writer_init(&replyWriter, NULL, 0);
+}
+
+command_server::~command_server()
+{
+    ubjson_reader_free(&inboxReader);
+    ubjson_writer_free(&replyWriter);
+}
+
+void command_server::serve(char const *path)
+{
+    unsigned delay = RECONNECT_DELAY_MIN;
+    std::thread bulkThread(&command_server::runBulk, this);
+
+    while (!stopping)
+    {
+        if (!link.open(path))
+        {
+            // foobard isn't running; back off so an idle player doesn't keep retrying every second
+            if (!link.sleep(delay))
+                break;
+            delay = delay * 2 < RECONNECT_DELAY_MAX ? delay * 2 : RECONNECT_DELAY_MAX;
+            continue;
+        }
+
+        delay = RECONNECT_DELAY_MIN;
+        {
+            std::lock_guard<std::mutex> lock(sendMutex);
+            generation++;
+            connected = true;
+        }
+        send(PROTOCOL_HELLO_FRAME, sizeof(PROTOCOL_HELLO_FRAME) - 1);
+        LOG("Connected to socket");
+
+        receiveCommands();
+
+        connected = false;
+        {
+            std::lock_guard<std::mutex> lock(bulkMutex);
+            bulkQueue.clear();
+        }
+        std::lock_guard<std::mutex> lock(sendMutex);
+        link.close();
+    }
+
+    // `stopping` is already set, so taking the lock is enough for the bulk thread to see it
+    {
+        std::lock_guard<std::mutex> lock(bulkMutex);
+    }
+    bulkReady.notify_all();
+    bulkThread.join();
+}
+
+void command_server::shutdown()
+{
+    stopping = true;
+    link.shutdown();
+}
+
+void command_server::send(char const *buf, size_t len)
+{
+    std::lock_guard<std::mutex> lock(sendMutex);
+    if (connected)
+        link.send(buf, len);
+}
+
+void command_server::sendFrom(uint64_t fromGeneration, char const *buf, size_t len)
+{
+    std::lock_guard<std::mutex> lock(sendMutex);
+    if (connected && generation == fromGeneration)
+        link.send(buf, len);
+}
+
+// Framed like foobard's inbox: the reader reads only the bytes just received, and finds where each command ends.
+// Malformed input can't be framed past, so it's dropped along with the rest of the inbox.
+void command_server::handleInbox(size_t received, command_batch &batch)
+{
+    ubjson_reader_feed(&inboxReader, inbox.data() + inboxLength, received);
+    inboxLength += received;
+
+    // Where the next command starts
+    size_t start = 0;
+    while (true)
+    {
+        ubjson_event event = ubjson_reader_next(&inboxReader);
+        if (event == UBJSON_EVENT_NEED_MORE)
+            break;
+        if (event == UBJSON_EVENT_ERROR)
+        {
+            LOG("Failed to parse received packet!");
+            inboxLength = 0;
+            ubjson_reader_free(&inboxReader);
+            return;
+        }
+        if (inboxReader.depth || (event != UBJSON_EVENT_END_OBJECT && event != UBJSON_EVENT_END_ARRAY))
+            continue;
+
+        size_t end = inboxReader.buf + inboxReader.index - inbox.data();
+        handleCommand(inbox.data() + start, end - start, batch);
+        start = end;
+    }
+
+    // The reader has read all of what's left, and carries on from there with the next bytes received
+    memmove(inbox.data(), inbox.data() + start, inboxLength - start);
+    inboxLength -= start;
+}
+
+void command_server::handleCommand(char const *frame, size_t length, command_batch &batch)
+{
+    if (length == sizeof(PROTOCOL_PING_FRAME) - 1 && !memcmp(frame, PROTOCOL_PING_FRAME, length))
+    {
+        batch.addReply(PROTOCOL_PING_FRAME, length);
+        return;
+    }
+
+    ubjson_ctx ctx;
+    ubjson_ctx_init(&ctx, frame, length);
+    if (!ubjson_ctx_parse(&ctx))
+    {
+        LOG("Failed to parse received packet!");
+        ubjson_ctx_free(&ctx);
+        return;
+    }
+    batch.add(&ctx);
+}
+
+// The thread only wakes when there's something to read. Everything readable by then is drained into one batch, so
+// a burst of commands costs one hop to the player's thread and one send for all the replies.
+void command_server::receiveCommands()
+{
+    // Nothing of the last connection's stream carries over
+    inboxLength = 0;
+    ubjson_reader_free(&inboxReader);
+
+    while (link.wait())
+    {
+        wakeupCount++;
+        command_batch batch(player, replyWriter);
+        long received = -1;
+        while (batch.size() < COMMAND_BATCH_MAX)
+        {
+            // The reader only holds on to a token split between receives, which it has copied, so moving the inbox
+            // is safe
+            if (inboxLength == inbox.size())
+                inbox.resize(inbox.size() * 2);
+            received = link.receive(inbox.data() + inboxLength, inbox.size() - inboxLength);
+            if (received <= 0)
+                break;
+            handleInbox(received, batch);
+        }
+
+        batch.flush();
+        if (batch.replies().len)
+            send(batch.replies().buf, batch.replies().len);
+
+        std::vector<bulk_command> bulk = batch.takeBulk();
+        if (!bulk.empty())
+        {
+            std::lock_guard<std::mutex> lock(bulkMutex);
+            for (bulk_command &command : bulk)
+                bulkQueue.push_back({ generation, std::move(command) });
+            bulkReady.notify_one();
+        }
+
+        if (!received)
+            return;
+    }
+}
+
+// Runs bulk commands one at a time. Each chunk takes the send lock on its own, so the socket thread's replies
+// interleave with it.
+void command_server::runBulk()
+{
+    std::unique_lock<std::mutex> lock(bulkMutex);
+
+    while (true)
+    {
+        bulkReady.wait(lock, [this] { return stopping || !bulkQueue.empty(); });
+        if (stopping)
+            return;
+
+        bulk_job job = std::move(bulkQueue.front());
+        bulkQueue.pop_front();
+        lock.unlock();
+
+        uint64_t jobGeneration = job.generation;
+        job.command.run(player, [this, jobGeneration](char const *frame, size_t length) {
+            sendFrom(jobGeneration, frame, length);
+        });
+
+        lock.lock();
+    }
+}
@@ -0,0 +1,93 @@
+// Copyright (c) 2023 Ally Sommers
+// This code is licensed under the BSD 3-Clause License. A copy of this license
+// is included in the repository.
+
+#pragma once
+
+#include "commands.hpp"
+#include "connection.hpp"
+#include "player.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <stdint.h>
+#include <vector>
+
+// Receive buffer size to start with; a single command never comes close, but the buffer grows if one doesn't fit.
+constexpr size_t INBOX_SIZE = 65536;
+// Commands taken into one batch at most before it's flushed, so a flood still gets answered as it goes.
+constexpr size_t COMMAND_BATCH_MAX = 256;
+// Delays between attempts to reach foobard, in milliseconds, doubling each time.
+constexpr unsigned RECONNECT_DELAY_MIN = 250;
+constexpr unsigned RECONNECT_DELAY_MAX = 8000;
+
+// foo_mpris's end of the protocol, independent of foobar2000: keeps a connection to foobard, runs the commands it
+// sends against a player_backend and sends back the replies.
+//
+// Commands come in two lanes. The socket thread answers transport controls and state queries as soon as they're
+// read, while bulk commands queue up for a thread of their own, which sends their results a chunk at a time; a reply
+// from the socket thread can go out between any two chunks, so a long search never holds up a play or a pause.
+class command_server {
+    public:
+    explicit command_server(player_backend &player);
+    ~command_server();
+
+    // Connects to foobard at `path`, runs its commands and reconnects after it goes away, until shutdown(). Blocks, so
+    // it gets a thread of its own.
+    void serve(char const *path);
+    // Makes serve() return. Any thread.
+    void shutdown();
+
+    // Sends `buf` as-is if connected. Any thread.
+    void send(char const *buf, size_t len);
+    bool isConnected() const
+    {
+        return connected;
+    }
+    // How many times the socket thread has woken up to read, which an idle connection shouldn't make it do. Any
+    // thread.
+    uint64_t wakeups() const
+    {
+        return wakeupCount;
+    }
+
+    // Takes the `received` bytes just read into the end of the inbox, and parses every command now complete into
+    // `batch`, answering pings in it as they come. A command which hasn't all arrived yet stays in the inbox.
+    void handleInbox(size_t received, command_batch &batch);
+
+    private:
+    struct bulk_job
+    {
+        // The connection the command came in on; its results are dropped once that one is gone
+        uint64_t generation;
+        bulk_command command;
+    };
+
+    void receiveCommands();
+    void handleCommand(char const *frame, size_t length, command_batch &batch);
+    void runBulk();
+    void sendFrom(uint64_t fromGeneration, char const *buf, size_t len);
+
+    player_backend &player;
+    connection link;
+    // Bytes received which haven't been parsed yet. A command can arrive split across receives, like a reply to
+    // foobard can, and what has come of it waits here for the rest. Only the socket thread touches the inbox.
+    std::vector<char> inbox;
+    size_t inboxLength;
+    // Finds where each command in the inbox ends, reading each byte once as it comes in
+    ubjson_reader inboxReader;
+    // Each batch's replies are written here by the socket thread; the buffer is kept from one batch to the next
+    ubjson_writer replyWriter;
+    // Guards sending, and `generation`'s changes
+    std::mutex sendMutex;
+    uint64_t generation;
+    std::atomic<bool> connected;
+    std::atomic<bool> stopping;
+    std::atomic<uint64_t> wakeupCount;
+
+    std::mutex bulkMutex;
+    std::condition_variable bulkReady;
+    std::deque<bulk_job> bulkQueue;
+};
@@ -2,9 +2,14 @@
 // This code is licensed under the BSD 3-Clause License. A copy of this license
 // is included in the repository.
 
+#include "foobar2000_player.hpp"
+#include "server.hpp"
+
 #include <WinSock2.h>
 #include <afunix.h>
+#include <atomic>
 #include <helpers/foobar2000+atl.h>
+#include <mutex>
 
 #define SOCKET_LOCK(a, b)                                                \
     do                                                                   \
@@ -17,9 +22,10 @@
 
 class MPRIS: public play_callback {
     public:
-    static SOCKET sock;
+    static foobar2000_player player;
+    static command_server server;
     static sockaddr_un sockAddress;
-    static bool shouldExit;
+    static std::atomic<bool> shouldExit;
 
     MPRIS();
     ~MPRIS();
@@ -41,6 +47,12 @@ class MPRIS: public play_callback {
     void on_volume_change(float p_new_val);
 
     static void initStatic();
-    static DWORD __stdcall connectToServer(LPVOID ptr);
-    static DWORD __stdcall watchSocket(LPVOID ptr);
+    static pfc::string8 siblingPath(char const *name);
+    static void sendPacket(char const *buf, size_t len);
+    static void sendEvent(char const *event, metadb_handle_ptr const &track, int32_t fields);
+    static bool getNextTrack(metadb_handle_ptr &out);
+    // The socket thread: connects to foobard, runs its commands and reconnects after it goes away, until shutdown().
+    static DWORD __stdcall serve(LPVOID ptr);
+    // Stops the socket thread; the other threads watch shouldExit.
+    static void shutdown();
 };
@@ -0,0 +1,46 @@
+// Copyright (c) 2023 Ally Sommers
+// This code is licensed under the BSD 3-Clause License. A copy of this license
+// is included in the repository.
+
+#include "state.hpp"
+
+#include "dynamicinfo.hpp"
+#include "trackid.hpp"
+
+namespace
+{
+    // Only ever accessed through std::atomic_load and std::atomic_store.
+    std::shared_ptr<playback_state const> currentState = std::make_shared<playback_state const>();
+} // namespace
+
+double playback_state::currentPosition() const
+{
+    if (strcmp(status, "Playing"))
+        return position;
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - positionTime;
+    return position + elapsed.count();
+}
+
+void publishPlaybackState()
+{
+    auto state = std::make_shared<playback_state>();
+    auto playback = playback_control::get();
+
+    if (playback->is_playing())
+        state->status = playback->is_paused() ? "Paused" : "Playing";
+    if (playback->get_now_playing(state->track))
+    {
+        getTrackId(state->track, state->trackId);
+        state->info = getDynamicInfo(state->track);
+    }
+    state->position = playback->playback_get_position();
+    state->positionTime = std::chrono::steady_clock::now();
+
+    std::atomic_store(&currentState, std::shared_ptr<playback_state const>(std::move(state)));
+}
+
+std::shared_ptr<playback_state const> getPlaybackState()
+{
+    return std::atomic_load(&currentState);
+}
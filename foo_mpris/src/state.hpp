@@ -0,0 +1,35 @@
+// Copyright (c) 2023 Ally Sommers
+// This code is licensed under the BSD 3-Clause License. A copy of this license
+// is included in the repository.
+
+#pragma once
+
+#include <chrono>
+#include <helpers/foobar2000+atl.h>
+#include <memory>
+
+// What the socket thread needs to answer "playbackstatus", "position" and "metadata". MPRIS's play_callback methods
+// capture it on the main thread; a published snapshot is never modified, so readers can keep using theirs while a
+// newer one replaces it.
+struct playback_state
+{
+    // "Playing", "Paused" or "Stopped"
+    char const *status = "Stopped";
+    // Empty when nothing is playing
+    metadb_handle_ptr track;
+    pfc::string8 trackId;
+    // The track's info with a stream's dynamic info applied; null when there's none, and the track's own is used
+    std::shared_ptr<file_info const> info;
+    // Seconds into the track at `positionTime`
+    double position = 0;
+    std::chrono::steady_clock::time_point positionTime;
+
+    // The position now, extrapolated from the last callback while playing.
+    double currentPosition() const;
+};
+
+// Captures the state from playback_control and publishes it. Main thread only.
+void publishPlaybackState();
+
+// The latest published snapshot. Callable from any thread; only swaps a pointer, never waits for the main thread.
+std::shared_ptr<playback_state const> getPlaybackState();
@@ -0,0 +1,29 @@
+// Copyright (c) 2023 Ally Sommers
+// This code is licensed under the BSD 3-Clause License. A copy of this license
+// is included in the repository.
+
+#include "titleformat.hpp"
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace
+{
+    std::mutex cacheMutex;
+    std::unordered_map<std::string, titleformat_object::ptr> cache;
+} // namespace
+
+titleformat_object::ptr getTitleFormat(char const *script)
+{
+    std::lock_guard<std::mutex> lock(cacheMutex);
+
+    auto it = cache.find(script);
+    if (it != cache.end())
+        return it->second;
+
+    titleformat_object::ptr format;
+    titleformat_compiler::get()->compile_safe(format, script);
+    cache.emplace(script, format);
+    return format;
+}
@@ -0,0 +1,11 @@
+// Copyright (c) 2023 Ally Sommers
+// This code is licensed under the BSD 3-Clause License. A copy of this license
+// is included in the repository.
+
+#pragma once
+
+#include <helpers/foobar2000+atl.h>
+
+// Returns `script` compiled, compiling it only the first time any thread asks for it. Compiled scripts are kept for
+// the lifetime of the component, so only pass a fixed set of scripts (not ones built from user input).
+titleformat_object::ptr getTitleFormat(char const *script);
@@ -0,0 +1,59 @@
+// Copyright (c) 2023 Ally Sommers
+// This code is licensed under the BSD 3-Clause License. A copy of this license
+// is included in the repository.
+
+#include "trackid.hpp"
+
+#include <cstdio>
+#include <inttypes.h>
+#include <mutex>
+#include <unordered_map>
+
+namespace
+{
+    // Entries hold a reference to their handle, so the cache is dropped wholesale once it gets this big.
+    constexpr size_t MAX_CACHED_IDS = 4096;
+
+    std::mutex cacheMutex;
+    std::unordered_map<metadb_handle *, std::pair<metadb_handle_ptr, uint64_t>> cache;
+
+    uint64_t hashLocation(playable_location const &location)
+    {
+        // FNV-1a over the path and subsong index...
+        uint64_t hash = 0xcbf29ce484222325;
+        for (char const *c = location.get_path(); *c; c++)
+            hash = (hash ^ (uint8_t)*c) * 0x100000001b3;
+
+        uint32_t subsong = location.get_subsong_index();
+        for (int i = 0; i < 4; i++)
+            hash = (hash ^ ((subsong >> (i * 8)) & 0xff)) * 0x100000001b3;
+
+        // ...then the splitmix64 finalizer, since FNV mixes the last few bytes poorly and paths mostly differ there
+        hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9;
+        hash = (hash ^ (hash >> 27)) * 0x94d049bb133111eb;
+        return hash ^ (hash >> 31);
+    }
+} // namespace
+
+uint64_t getTrackHash(metadb_handle_ptr const &track)
+{
+    std::lock_guard<std::mutex> lock(cacheMutex);
+
+    auto it = cache.find(track.get_ptr());
+    if (it != cache.end())
+        return it->second.second;
+
+    if (cache.size() >= MAX_CACHED_IDS)
+        cache.clear();
+
+    uint64_t hash = hashLocation(track->get_location());
+    cache.emplace(track.get_ptr(), std::make_pair(track, hash));
+    return hash;
+}
+
+void getTrackId(metadb_handle_ptr const &track, pfc::string_base &out)
+{
+    char id[sizeof(TRACK_ID_PREFIX) + 16];
+    snprintf(id, sizeof(id), TRACK_ID_PREFIX "%016" PRIx64, getTrackHash(track));
+    out = id;
+}
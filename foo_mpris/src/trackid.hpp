@@ -0,0 +1,17 @@
+// Copyright (c) 2023 Ally Sommers
+// This code is licensed under the BSD 3-Clause License. A copy of this license
+// is included in the repository.
+
+#pragma once
+
+#include <helpers/foobar2000+atl.h>
+#include <stdint.h>
+
+#define TRACK_ID_PREFIX "/org/foobar2000/track/"
+
+// Stable identity of a track: a 64-bit hash of its location (path and subsong index), so it's the same across
+// sessions and doesn't depend on the format providing any particular info. Lookups are memoised per metadb_handle.
+uint64_t getTrackHash(metadb_handle_ptr const &track);
+
+// Writes the MPRIS track id of `track`, a D-Bus object path ending in the hash in hex, to `out`.
+void getTrackId(metadb_handle_ptr const &track, pfc::string_base &out);
@@ -0,0 +1,232 @@
+// Copyright (c) 2023 Ally Sommers
+// This code is licensed under the BSD 3-Clause License. A copy of this license
+// is included in the repository.
+
+#include "visualisation.hpp"
+
+#include "defines.hpp"
+#include "preferences.hpp"
+#include "socket.hpp"
+#include "visualisation.h"
+
+#include <WinSock2.h>
+#include <afunix.h>
+#include <cmath>
+#include <cstring>
+#include <helpers/foobar2000+atl.h>
+#include <stdint.h>
+#include <vector>
+
+namespace
+{
+    SOCKET connectVisualisation(sockaddr_un const &address)
+    {
+        SOCKET sock = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (sock == INVALID_SOCKET)
+            return INVALID_SOCKET;
+        if (connect(sock, (sockaddr const *)&address, sizeof(address)))
+        {
+            closesocket(sock);
+            return INVALID_SOCKET;
+        }
+
+        u_long nonBlocking = 1;
+        ioctlsocket(sock, FIONBIO, &nonBlocking);
+        return sock;
+    }
+
+    // Sends as much of `buf` as the socket takes without blocking. Returns the number of bytes sent, or -1 once the
+    // connection is gone.
+    int sendSome(SOCKET sock, char const *buf, size_t len)
+    {
+        int sent = send(sock, buf, (int)len, 0);
+        if (sent == SOCKET_ERROR)
+            return WSAGetLastError() == WSAEWOULDBLOCK ? 0 : -1;
+        return sent;
+    }
+
+    // Each bin holds the loudest FFT bucket mapping onto it, so a handful of bins still shows narrow peaks.
+    bool readSpectrum(visualisation_stream_v3::ptr const &stream, double time, uint32_t bins, audio_chunk_impl &chunk,
+                      vis_frame_header &header, std::vector<float> &data)
+    {
+        unsigned fftSize = 64;
+        while (fftSize / 2 < bins)
+            fftSize *= 2;
+        if (!stream->get_spectrum_absolute(chunk, time, fftSize))
+            return false;
+
+        size_t count = chunk.get_sample_count();
+        unsigned channels = pfc::min_t<unsigned>(chunk.get_channels(), VIS_MAX_CHANNELS);
+        audio_sample const *samples = chunk.get_data();
+
+        data.assign((size_t)channels * bins, 0.0f);
+        for (size_t i = 0; i < count; i++)
+        {
+            size_t bin = i * bins / count;
+            for (unsigned c = 0; c < channels; c++)
+            {
+                float value = (float)samples[i * chunk.get_channels() + c];
+                if (value > data[bin * channels + c])
+                    data[bin * channels + c] = value;
+            }
+        }
+
+        header.kind = VIS_FRAME_SPECTRUM;
+        header.channels = (uint16_t)channels;
+        header.sample_rate = chunk.get_srate();
+        return true;
+    }
+
+    bool readPeaks(visualisation_stream_v3::ptr const &stream, double time, double interval, uint32_t bins,
+                   audio_chunk_impl &chunk, vis_frame_header &header, std::vector<float> &data)
+    {
+        if (!stream->get_chunk_absolute(chunk, time - interval, interval))
+            return false;
+
+        size_t count = chunk.get_sample_count();
+        unsigned channels = pfc::min_t<unsigned>(chunk.get_channels(), VIS_MAX_CHANNELS);
+        audio_sample const *samples = chunk.get_data();
+        if (!count)
+            return false;
+
+        data.assign((size_t)channels * bins, 0.0f);
+        for (size_t i = 0; i < count; i++)
+        {
+            size_t bin = i * bins / count;
+            for (unsigned c = 0; c < channels; c++)
+            {
+                float value = fabsf((float)samples[i * chunk.get_channels() + c]);
+                if (value > data[bin * channels + c])
+                    data[bin * channels + c] = value;
+            }
+        }
+
+        header.kind = VIS_FRAME_PEAKS;
+        header.channels = (uint16_t)channels;
+        header.sample_rate = chunk.get_srate();
+        return true;
+    }
+} // namespace
+
+DWORD __stdcall streamVisualisation(LPVOID ptr)
+{
+    sockaddr_un address = { AF_UNIX };
+    pfc::string8 path = MPRIS::siblingPath(VIS_SOCKET_NAME);
+    if (path.length() >= sizeof(address.sun_path))
+    {
+        LOG("Visualisation socket path \"%s\" is too long", path.c_str());
+        return 0;
+    }
+    strcpy(address.sun_path, path.c_str());
+
+    abort_callback_impl abortCallback {};
+    visualisation_stream_v3::ptr stream;
+    SOCKET sock = INVALID_SOCKET;
+
+    audio_chunk_impl chunk;
+    std::vector<float> data;
+    std::vector<char> frame;
+    // Whatever is left of the last frame after a short send; it has to go out before anything else to keep the
+    // stream framed.
+    size_t pendingOffset = 0;
+    // Between attempts to create the stream, doubling like the socket thread's reconnect delay
+    unsigned streamDelay = RECONNECT_DELAY_MIN;
+
+    while (!MPRIS::shouldExit)
+    {
+        uint64_t frameRate = cfgVisFrameRate.get();
+        if (!frameRate)
+        {
+            // Dropping the stream tells foobar2000 it can stop analysing the audio
+            stream.release();
+            if (sock != INVALID_SOCKET)
+                closesocket(sock);
+            sock = INVALID_SOCKET;
+            Sleep(1000);
+            continue;
+        }
+
+        if (sock == INVALID_SOCKET)
+        {
+            sock = connectVisualisation(address);
+            frame.clear();
+            pendingOffset = 0;
+            if (sock == INVALID_SOCKET)
+            {
+                Sleep(1000);
+                continue;
+            }
+        }
+
+        if (stream.is_empty())
+        {
+            try
+            {
+                fb2k::inMainThreadSynchronous(
+                    [&] { visualisation_manager::get()->create_stream(stream, visualisation_manager::KStreamFlagNewFFT); },
+                    abortCallback);
+            }
+            catch (std::exception const &e)
+            {
+                // Logged once for a run of failures, which are retried for as long as they last
+                if (streamDelay == RECONNECT_DELAY_MIN)
+                    LOG("Failed to open a visualisation stream: %s", e.what());
+                Sleep(streamDelay);
+                streamDelay = streamDelay * 2 < RECONNECT_DELAY_MAX ? streamDelay * 2 : RECONNECT_DELAY_MAX;
+                continue;
+            }
+            streamDelay = RECONNECT_DELAY_MIN;
+        }
+
+        double interval = 1.0 / (double)frameRate;
+        Sleep((DWORD)(1000 / frameRate));
+
+        if (pendingOffset < frame.size())
+        {
+            int sent = sendSome(sock, frame.data() + pendingOffset, frame.size() - pendingOffset);
+            if (sent < 0)
+            {
+                closesocket(sock);
+                sock = INVALID_SOCKET;
+                continue;
+            }
+            pendingOffset += sent;
+            // foobard still hasn't caught up, so this interval's frame is skipped
+            if (pendingOffset < frame.size())
+                continue;
+        }
+
+        double time;
+        if (!stream->get_absolute_time(time))
+            continue;
+
+        uint32_t bins = (uint32_t)cfgVisBins.get();
+        vis_frame_header header = { VIS_FRAME_MAGIC };
+        header.bins = bins;
+        header.time = time;
+        bool valid = cfgVisMode.get() == VIS_FRAME_PEAKS ? readPeaks(stream, time, interval, bins, chunk, header, data)
+                                                      : readSpectrum(stream, time, bins, chunk, header, data);
+        if (!valid || !header.channels)
+            continue;
+
+        frame.resize(sizeof(header) + data.size() * sizeof(float));
+        memcpy(frame.data(), &header, sizeof(header));
+        memcpy(frame.data() + sizeof(header), data.data(), data.size() * sizeof(float));
+
+        int sent = sendSome(sock, frame.data(), frame.size());
+        if (sent < 0)
+        {
+            closesocket(sock);
+            sock = INVALID_SOCKET;
+            continue;
+        }
+        // A frame which didn't go out at all is simply dropped; only a partly sent one has to be finished
+        pendingOffset = sent;
+        if (!pendingOffset)
+            frame.clear();
+    }
+
+    if (sock != INVALID_SOCKET)
+        closesocket(sock);
+    return 0;
+}
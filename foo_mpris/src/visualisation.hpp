@@ -0,0 +1,11 @@
+// Copyright (c) 2023 Ally Sommers
+// This code is licensed under the BSD 3-Clause License. A copy of this license
+// is included in the repository.
+
+#pragma once
+
+#include <WinSock2.h>
+
+// Reads spectrum or peak frames from a visualisation_stream at the frame rate set in Advanced Preferences and pushes
+// them to foobard over their own socket. Frames which can't be sent right away are dropped, never queued.
+DWORD __stdcall streamVisualisation(LPVOID ptr);
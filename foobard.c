@@ -2,20 +2,29 @@
 // This code is licensed under the BSD 3-Clause License. A copy of this license
 // is included in the repository.
 
+#include "protocol.h"
 #include "ubjson/ubjson.h"
+#include "visualisation.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
+#include <poll.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <systemd/sd-bus.h>
+#include <time.h>
 #include <unistd.h>
 
 #define ok(cond, str, ...)                                     \
@@ -25,19 +34,34 @@
             printf(("L# %d > " str), __LINE__, ##__VA_ARGS__); \
     } while (0)
 
-#define SEND_SIMPLE_PACKET(command)                              \
-    do                                                           \
-    {                                                            \
-        struct ubjson_ctx ctx;                                   \
-        ubjson_ctx_init(&ctx, NULL, 0);                          \
-        ubjson_ctx_create_object(&ctx);                          \
-        ubjson_ctx_add_kv_pair_string(&ctx, "command", command); \
-        ubjson_ctx_render_creation(&ctx);                        \
-        send(peer, ctx.render_buf, ctx.render_index, 0);         \
-        ubjson_ctx_free(&ctx);                                   \
+#define COMMAND_BUFFER_SIZE 256
+
+// Encodes a command with its protocol_encode_* function and sends it to foo_mpris, setting `sent` to whether all of
+// it went. Commands are written straight into a buffer on the stack, which only a long search query outgrows.
+#define SEND_MESSAGE_CHECKED(sent, message, fields)                                              \
+    do                                                                                           \
+    {                                                                                            \
+        char buf[COMMAND_BUFFER_SIZE];                                                           \
+        struct ubjson_writer writer;                                                             \
+        ubjson_writer_init(&writer, buf, sizeof(buf));                                           \
+        protocol_encode_##message(&writer, fields);                                              \
+        (sent) = !writer.failed && send(peer, writer.buf, writer.len, 0) == (ssize_t)writer.len; \
+        ubjson_writer_free(&writer);                                                             \
+    } while (0)
+
+// The same, for commands which needn't know: a connection which has gone is found by the next ping.
+#define SEND_MESSAGE(message, fields)                        \
+    do                                                       \
+    {                                                        \
+        bool message_sent;                                   \
+        SEND_MESSAGE_CHECKED(message_sent, message, fields); \
+        (void)message_sent;                                  \
     } while (0)
 
 int peer;
+sd_bus *bus;
+
+struct ubjson_ctx *receive_reply(void);
 
 int foobar2000_PROP_FALSE(sd_bus *bus,
                           const char *path,
@@ -124,73 +148,59 @@ static const sd_bus_vtable foobar2000_vtable[] = {
 
 int foobar2000_player_Next(sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
 {
-    SEND_SIMPLE_PACKET("next");
+    SEND_MESSAGE(next, NULL);
     return sd_bus_reply_method_return(m, "");
 }
 
 int foobar2000_player_Previous(sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
 {
-    SEND_SIMPLE_PACKET("previous");
+    SEND_MESSAGE(previous, NULL);
     return sd_bus_reply_method_return(m, "");
 }
 
 int foobar2000_player_Pause(sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
 {
-    SEND_SIMPLE_PACKET("pause");
+    SEND_MESSAGE(pause, NULL);
     return sd_bus_reply_method_return(m, "");
 }
 
 int foobar2000_player_PlayPause(sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
 {
-    SEND_SIMPLE_PACKET("playpause");
+    SEND_MESSAGE(playpause, NULL);
     return sd_bus_reply_method_return(m, "");
 }
 
 int foobar2000_player_Stop(sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
 {
-    SEND_SIMPLE_PACKET("stop");
+    SEND_MESSAGE(stop, NULL);
     return sd_bus_reply_method_return(m, "");
 }
 
 int foobar2000_player_Play(sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
 {
-    SEND_SIMPLE_PACKET("play");
+    SEND_MESSAGE(play, NULL);
     return sd_bus_reply_method_return(m, "");
 }
 
 int foobar2000_player_Seek(sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
 {
-    int64_t offset;
-    sd_bus_message_read_basic(m, 'x', &offset);
+    struct protocol_seek_args args = { 0 };
+    sd_bus_message_read_basic(m, 'x', &args.offset);
 
-    struct ubjson_ctx ctx;
-    ubjson_ctx_init(&ctx, NULL, 0);
-    ubjson_ctx_create_object(&ctx);
-    ubjson_ctx_add_kv_pair_string(&ctx, "command", "seek");
-    ubjson_ctx_add_kv_pair_int64(&ctx, "offset", offset);
-    ubjson_ctx_render_creation(&ctx);
-    send(peer, ctx.render_buf, ctx.render_index, 0);
-    ubjson_ctx_free(&ctx);
+    SEND_MESSAGE(seek, &args);
 
     return sd_bus_reply_method_return(m, "");
 }
 
 int foobar2000_player_SetPosition(sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
 {
-    char *track_id;
-    int64_t offset;
+    struct protocol_setposition_args args = { 0 };
+    char const *track_id = NULL;
     sd_bus_message_read_basic(m, 'o', &track_id);
-    sd_bus_message_read_basic(m, 'x', &offset);
+    sd_bus_message_read_basic(m, 'x', &args.offset);
+    args.track_id = protocol_string_of(track_id);
 
-    struct ubjson_ctx ctx;
-    ubjson_ctx_init(&ctx, NULL, 0);
-    ubjson_ctx_create_object(&ctx);
-    ubjson_ctx_add_kv_pair_string(&ctx, "command", "setposition");
-    ubjson_ctx_add_kv_pair_string(&ctx, "track_id", track_id);
-    ubjson_ctx_add_kv_pair_int64(&ctx, "offset", offset);
-    ubjson_ctx_render_creation(&ctx);
-    send(peer, ctx.render_buf, ctx.render_index, 0);
-    ubjson_ctx_free(&ctx);
+    SEND_MESSAGE(setposition, &args);
 
     return sd_bus_reply_method_return(m, "");
 }
@@ -211,34 +221,20 @@ int foobar2000_PlaybackStatus(sd_bus *bus,
                               void *userdata,
                               sd_bus_error *ret_error)
 {
-    SEND_SIMPLE_PACKET("playbackstatus");
-
-    char buf[256] = { 0 };
-    size_t recv_size = recv(peer, buf, sizeof(buf), 0);
+    SEND_MESSAGE(playbackstatus, NULL);
 
     char *message = "Stopped";
-    char *key = NULL;
-    char *status = NULL;
-
-    struct ubjson_ctx ctx;
-    ubjson_ctx_init(&ctx, buf, recv_size);
-    if (!ubjson_ctx_parse(&ctx))
-        goto cleanup;
-
-    ubjson_ctx_read_kv_pair(&ctx, &key, &status, UBJSON_TYPE_STRING);
 
-    if (strcmp(key, "status"))
-        goto cleanup;
-
-    if (!strcmp(status, "Paused"))
-        message = "Paused";
-    if (!strcmp(status, "Playing"))
-        message = "Playing";
+    struct ubjson_ctx *ctx = receive_reply();
+    struct protocol_playback_status status;
+    if (ctx && protocol_read_playback_status(ctx, &status) && PROTOCOL_HAS(&status, playback_status, status))
+    {
+        if (protocol_string_equals(status.status, "Paused"))
+            message = "Paused";
+        if (protocol_string_equals(status.status, "Playing"))
+            message = "Playing";
+    }
 
-cleanup:
-    free(key);
-    free(status);
-    ubjson_ctx_free(&ctx);
     return sd_bus_message_append_basic(reply, 's', message);
 }
 
@@ -253,127 +249,485 @@ int foobar2000_Rate(sd_bus *bus,
     return sd_bus_message_append_basic(reply, 'd', &(double) { 1.0 });
 }
 
-int foobar2000_Metadata(sd_bus *bus,
-                        const char *path,
-                        const char *interface,
-                        const char *property,
-                        sd_bus_message *reply,
-                        void *userdata,
-                        sd_bus_error *ret_error)
+// A decoded track record, together with the message its strings point into.
+struct cached_track
+{
+    struct ubjson_ctx ctx;
+    struct protocol_track track;
+    // What track.url points to once converted by wine_path_to_uri
+    char *uri;
+};
+
+// Maps track record fields onto their D-Bus names. A D-Bus type of 'a' is an array of strings.
+static const struct metadata_key
+{
+    char const *dbus_key;
+    char dbus_type;
+    int32_t field;
+    size_t offset;
+} metadata_keys[] = {
+    // clang-format off
+    { "mpris:trackid",      'o', METADATA_FIELD_ID,           offsetof(struct protocol_track, id)           },
+    { "mpris:length",       'x', METADATA_FIELD_LENGTH,       offsetof(struct protocol_track, length)       },
+    { "mpris:artUrl",       's', METADATA_FIELD_ART_URL,      offsetof(struct protocol_track, art_url)      },
+    { "xesam:album",        's', METADATA_FIELD_ALBUM,        offsetof(struct protocol_track, album)        },
+    { "xesam:artist",       'a', METADATA_FIELD_ARTIST,       offsetof(struct protocol_track, artist)       },
+    { "xesam:date",         's', METADATA_FIELD_DATE,         offsetof(struct protocol_track, date)         },
+    { "xesam:title",        's', METADATA_FIELD_TITLE,        offsetof(struct protocol_track, title)        },
+    { "xesam:trackNumber",  'i', METADATA_FIELD_TRACK_NUMBER, offsetof(struct protocol_track, track_number) },
+    { "xesam:albumArtist",  'a', METADATA_FIELD_ALBUM_ARTIST, offsetof(struct protocol_track, album_artist) },
+    { "xesam:genre",        'a', METADATA_FIELD_GENRE,        offsetof(struct protocol_track, genre)        },
+    { "xesam:composer",     'a', METADATA_FIELD_COMPOSER,     offsetof(struct protocol_track, composer)     },
+    { "xesam:discNumber",   'i', METADATA_FIELD_DISC_NUMBER,  offsetof(struct protocol_track, disc_number)  },
+    { "xesam:comment",      'a', METADATA_FIELD_COMMENT,      offsetof(struct protocol_track, comment)      },
+    { "xesam:url",          's', METADATA_FIELD_URL,          offsetof(struct protocol_track, url)          },
+    { "foobar2000:bitrate", 'i', METADATA_FIELD_BITRATE,      offsetof(struct protocol_track, bitrate)      },
+    { "xesam:useCount",     'i', METADATA_FIELD_USE_COUNT,    offsetof(struct protocol_track, use_count)    },
+    { "xesam:lastUsed",     's', METADATA_FIELD_LAST_USED,    offsetof(struct protocol_track, last_used)    },
+    { "xesam:audioBPM",     'i', METADATA_FIELD_AUDIO_BPM,    offsetof(struct protocol_track, audio_bpm)    },
+    { "xesam:userRating",   'd', METADATA_FIELD_USER_RATING,  offsetof(struct protocol_track, user_rating)  },
+    // clang-format on
+};
+
+#define METADATA_KEY_COUNT (sizeof(metadata_keys) / sizeof(*metadata_keys))
+
+// foo_mpris reports Windows paths; Wine maps Z: onto the Unix root. Every byte but the separators and those RFC 3986
+// leaves unreserved is percent-encoded, so spaces, '#', '%', '?' and UTF-8 make a valid URI.
+char *wine_path_to_uri(char const *path)
 {
-    SEND_SIMPLE_PACKET("metadata");
+    static char const hex[] = "0123456789ABCDEF";
+
+    if (!strncmp(path, "file://", 7))
+        path += 7;
+    if (strncasecmp(path, "Z:\\", 3))
+        return strdup("");
+
+    path += 2;
+    char *uri = malloc(strlen("file://") + strlen(path) * 3 + 1);
+    strcpy(uri, "file://");
+    char *out = uri + strlen(uri);
+    for (; *path; path++)
+    {
+        unsigned char c = *path == '\\' ? '/' : *path;
+        if ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '-' || c == '.' ||
+            c == '_' || c == '~' || c == '/')
+        {
+            *out++ = c;
+            continue;
+        }
+        *out++ = '%';
+        *out++ = hex[c >> 4];
+        *out++ = hex[c & 0xF];
+    }
+    *out = '\0';
 
-    char buf[4096] = { 0 };
-    size_t recv_size = recv(peer, buf, sizeof(buf), 0);
+    return uri;
+}
 
-    char *key = NULL;
+void cached_track_free(struct cached_track *cache)
+{
+    ubjson_ctx_free(&cache->ctx);
+    free(cache->uri);
+    memset(cache, 0, sizeof(*cache));
+}
 
-    char *id = NULL;
-    int64_t length;
-    char *art_url = NULL;
+// Decodes a track record, taking over `ctx` (which is left empty) so the decoded strings stay valid. They're
+// terminated first, as they're handed to D-Bus as C strings. Fails if the record has no id.
+bool cached_track_take(struct cached_track *cache, struct ubjson_ctx *ctx)
+{
+    cached_track_free(cache);
+    cache->ctx = *ctx;
+    ubjson_ctx_init(ctx, NULL, 0);
 
-    char *album = NULL;
-    char **artist = NULL;
-    size_t artist_count = 0;
+    if (!ubjson_ctx_terminate(&cache->ctx) || !protocol_read_track(&cache->ctx, &cache->track) ||
+        !PROTOCOL_HAS(&cache->track, track, id))
+    {
+        cached_track_free(cache);
+        return false;
+    }
 
-    char *date = NULL;
-    char *title = NULL;
-    int32_t track_number;
+    if (PROTOCOL_HAS(&cache->track, track, url))
+    {
+        cache->uri = wine_path_to_uri(cache->track.url.data);
+        cache->track.url = protocol_string_of(cache->uri);
+    }
 
-    struct ubjson_ctx ctx;
-    ubjson_ctx_init(&ctx, buf, recv_size);
-    if (!ubjson_ctx_parse(&ctx))
-        goto cleanup;
-
-#define KEY_CHECK(str)                                                       \
-    do                                                                       \
-    {                                                                        \
-        if (strcmp(key, str))                                                \
-        {                                                                    \
-            printf("%s != %s\n", key, str);                                  \
-            free(key);                                                       \
-            sd_bus_message_open_container(reply, 'a', "{sv}");               \
-            sd_bus_message_append(reply, "{sv}", "mpris:trackid", "o", "/"); \
-            sd_bus_message_close_container(reply);                           \
-            goto cleanup;                                                    \
-        }                                                                    \
-        free(key);                                                           \
-    } while (0);
-
-    ubjson_ctx_read_kv_pair(&ctx, &key, &id, UBJSON_TYPE_STRING);
-    KEY_CHECK("id");
-    ubjson_ctx_next_value(&ctx);
-
-    ubjson_ctx_read_kv_pair(&ctx, &key, &length, UBJSON_TYPE_INT64);
-    KEY_CHECK("length");
-    ubjson_ctx_next_value(&ctx);
-
-    ubjson_ctx_read_kv_pair(&ctx, &key, &art_url, UBJSON_TYPE_STRING);
-    KEY_CHECK("artUrl");
-    ubjson_ctx_next_value(&ctx);
-
-    ubjson_ctx_read_kv_pair(&ctx, &key, &album, UBJSON_TYPE_STRING);
-    KEY_CHECK("album");
-    ubjson_ctx_next_value(&ctx);
-
-    ubjson_ctx_read_kv_pair(&ctx, &key, &artist_count, UBJSON_TYPE_ARRAY);
-    KEY_CHECK("artist");
-    artist = malloc(sizeof(char *) * artist_count);
-    ubjson_ctx_enter_collection(&ctx);
-    for (size_t i = 0; i < artist_count; i++)
-    {
-        ubjson_ctx_read(&ctx, &artist[i], UBJSON_TYPE_STRING);
-        ubjson_ctx_next_value(&ctx);
-    };
-    ubjson_ctx_exit_collection(&ctx);
-    ubjson_ctx_next_value(&ctx);
+    return true;
+}
 
-    ubjson_ctx_read_kv_pair(&ctx, &key, &date, UBJSON_TYPE_STRING);
-    KEY_CHECK("date");
-    ubjson_ctx_next_value(&ctx);
+// Applies an "update" event, which carries only the fields that changed, to the cached track with the same id. The
+// merged record is rendered and parsed again so every string still lives in the cache's own ctx.
+bool cached_track_update(struct cached_track *cache, struct ubjson_ctx const *ctx)
+{
+    struct protocol_track update;
+    struct protocol_track merged;
+    if (!cache->track.present || !protocol_read_track(ctx, &update) || !PROTOCOL_HAS(&update, track, id) ||
+        !protocol_string_same(update.id, cache->track.id) || !protocol_read_track(&cache->ctx, &merged))
+        return false;
+
+    // Re-read rather than copied from cache->track, whose url has already been converted to a URI
+    for (size_t i = 0; i < METADATA_KEY_COUNT; i++)
+    {
+        struct metadata_key const *entry = &metadata_keys[i];
+        if (!(update.present & entry->field))
+            continue;
+
+        size_t size;
+        switch (entry->dbus_type)
+        {
+        case 'x':
+            size = sizeof(int64_t);
+            break;
+        case 'i':
+            size = sizeof(int32_t);
+            break;
+        case 'd':
+            size = sizeof(double);
+            break;
+        case 'a':
+            size = sizeof(struct protocol_strings);
+            break;
+        default:
+            size = sizeof(struct protocol_string);
+            break;
+        }
+        memcpy((char *)&merged + entry->offset, (char const *)&update + entry->offset, size);
+    }
+    merged.present |= update.present;
+
+    // Written into allocated memory, which the parsed message then takes over
+    struct ubjson_writer writer;
+    ubjson_writer_init(&writer, NULL, 0);
+    ubjson_writer_begin_object(&writer);
+    protocol_write_present_track(&writer, &merged);
+    ubjson_writer_end_object(&writer);
+    if (writer.failed)
+    {
+        ubjson_writer_free(&writer);
+        return false;
+    }
 
-    ubjson_ctx_read_kv_pair(&ctx, &key, &title, UBJSON_TYPE_STRING);
-    KEY_CHECK("title");
-    ubjson_ctx_next_value(&ctx);
+    struct ubjson_ctx parsed;
+    ubjson_ctx_init_in_place(&parsed, writer.buf, writer.len, true);
+    if (!ubjson_ctx_parse(&parsed))
+    {
+        ubjson_ctx_free(&parsed);
+        return false;
+    }
 
-    ubjson_ctx_read_kv_pair(&ctx, &key, &track_number, UBJSON_TYPE_INT32);
-    KEY_CHECK("track_number");
-#undef KEY_CHECK
+    return cached_track_take(cache, &parsed);
+}
 
+// The track's strings have to be terminated, as a cached_track's are.
+void metadata_append(sd_bus_message *reply, struct protocol_track const *track)
+{
     sd_bus_message_open_container(reply, 'a', "{sv}");
 
-    sd_bus_message_append(reply, "{sv}", "mpris:trackid", "o", id);
-    sd_bus_message_append(reply, "{sv}", "mpris:length", "x", length);
-    sd_bus_message_append(reply, "{sv}", "mpris:artUrl", "s", art_url);
-    sd_bus_message_append(reply, "{sv}", "mpris:album", "s", album);
-
-    sd_bus_message_open_container(reply, 'e', "sv");
-    sd_bus_message_append_basic(reply, 's', "xesam:artist");
-    sd_bus_message_open_container(reply, 'v', "as");
-    sd_bus_message_open_container(reply, 'a', "s");
-    for (size_t i = 0; i < artist_count; i++)
-        sd_bus_message_append_basic(reply, 's', artist[i]);
-    sd_bus_message_close_container(reply);
-    sd_bus_message_close_container(reply);
-    sd_bus_message_close_container(reply);
+    for (size_t i = 0; i < METADATA_KEY_COUNT; i++)
+    {
+        struct metadata_key const *entry = &metadata_keys[i];
+        if (!(track->present & entry->field))
+            continue;
 
-    sd_bus_message_append(reply, "{sv}", "xesam:date", "s", date);
-    sd_bus_message_append(reply, "{sv}", "xesam:title", "s", title);
-    sd_bus_message_append(reply, "{sv}", "xesam:trackNumber", "i", track_number);
+        void const *member = (char const *)track + entry->offset;
+        switch (entry->dbus_type)
+        {
+        case 'o':
+            sd_bus_message_append(reply, "{sv}", entry->dbus_key, "o", ((struct protocol_string const *)member)->data);
+            break;
+        case 's':
+            sd_bus_message_append(reply, "{sv}", entry->dbus_key, "s", ((struct protocol_string const *)member)->data);
+            break;
+        case 'x':
+            sd_bus_message_append(reply, "{sv}", entry->dbus_key, "x", *(int64_t const *)member);
+            break;
+        case 'i':
+            sd_bus_message_append(reply, "{sv}", entry->dbus_key, "i", *(int32_t const *)member);
+            break;
+        case 'd':
+            sd_bus_message_append(reply, "{sv}", entry->dbus_key, "d", *(double const *)member);
+            break;
+        case 'a':
+        {
+            struct protocol_strings const *list = member;
+            sd_bus_message_open_container(reply, 'e', "sv");
+            sd_bus_message_append_basic(reply, 's', entry->dbus_key);
+            sd_bus_message_open_container(reply, 'v', "as");
+            sd_bus_message_open_container(reply, 'a', "s");
+            for (size_t j = 0; j < list->count; j++)
+                sd_bus_message_append_basic(reply, 's', protocol_strings_get(list, j).data);
+            sd_bus_message_close_container(reply);
+            sd_bus_message_close_container(reply);
+            sd_bus_message_close_container(reply);
+            break;
+        }
+        }
+    }
 
     sd_bus_message_close_container(reply);
+}
+
+// Metadata of the playing track, served to D-Bus without a round trip while valid (present != 0), and of the track
+// foo_mpris expects to play next.
+struct cached_track current_metadata;
+struct cached_track prefetched_metadata;
+
+// Events can arrive while a property getter waits for its reply, so PropertiesChanged is emitted from the main loop.
+bool metadata_changed;
+
+// Search calls waiting on their results, which foo_mpris streams back as search_chunk events while the main loop
+// carries on serving other calls. A slot is free while `call` is NULL. A search whose last chunk never comes (lost
+// along with a connection, say) is failed once its deadline passes, so it can't hold its slot forever.
+#define PENDING_SEARCH_MAX 8
+// Seconds a search may take, a little under D-Bus' own method call timeout
+#define PENDING_SEARCH_TIMEOUT 20
+
+struct pending_search
+{
+    int64_t serial;
+    char *query;
+    sd_bus_message *call;
+    // Built up as chunks arrive; NULL until the first one
+    sd_bus_message *reply;
+    // CLOCK_MONOTONIC seconds
+    time_t deadline;
+};
+
+struct pending_search pending_searches[PENDING_SEARCH_MAX];
+int64_t search_serial;
+
+void pending_search_free(struct pending_search *search)
+{
+    sd_bus_message_unref(search->reply);
+    sd_bus_message_unref(search->call);
+    free(search->query);
+    memset(search, 0, sizeof(*search));
+}
+
+// Adds a chunk of results to its search, answering the call once the last one is in. The results go to D-Bus as C
+// strings, so the chunk is terminated first.
+void search_receive_chunk(struct ubjson_ctx *ctx)
+{
+    struct protocol_search_results results;
+    if (!ubjson_ctx_terminate(ctx) || !protocol_read_search_results(ctx, &results) ||
+        !PROTOCOL_HAS(&results, search_results, serial))
+        return;
+
+    struct pending_search *search = NULL;
+    for (size_t i = 0; i < PENDING_SEARCH_MAX && !search; i++)
+    {
+        if (pending_searches[i].call && pending_searches[i].serial == results.serial)
+            search = &pending_searches[i];
+    }
+    if (!search)
+        return;
+
+    // Any chunk can carry a failure, which drops whatever results came before it
+    if (!PROTOCOL_HAS(&results, search_results, total) || results.total < 0)
+    {
+        if (PROTOCOL_HAS(&results, search_results, total) && results.total == PROTOCOL_SEARCH_INVALID)
+            sd_bus_reply_method_errorf(search->call, SD_BUS_ERROR_INVALID_ARGS, "Invalid search query '%s'", search->query);
+        else
+            sd_bus_reply_method_errorf(search->call, SD_BUS_ERROR_FAILED, "Search for '%s' failed", search->query);
+        pending_search_free(search);
+        return;
+    }
+
+    int ret = 0;
+    if (!search->reply)
+    {
+        ret = sd_bus_message_new_method_return(search->call, &search->reply);
+        if (ret >= 0)
+            ret = sd_bus_message_append(search->reply, "u", (uint32_t)results.total);
+        if (ret >= 0)
+            ret = sd_bus_message_open_container(search->reply, 'a', "(os)");
+    }
+
+    size_t count = results.ids.count < results.titles.count ? results.ids.count : results.titles.count;
+    for (size_t i = 0; i < count && ret >= 0; i++)
+    {
+        ret = sd_bus_message_append(search->reply, "(os)", protocol_strings_get(&results.ids, i).data,
+                                    protocol_strings_get(&results.titles, i).data);
+    }
+
+    if (ret >= 0 && !results.done)
+        return;
+
+    if (ret >= 0)
+        ret = sd_bus_message_close_container(search->reply);
+    if (ret >= 0)
+        ret = sd_bus_send(NULL, search->reply, NULL);
+    if (ret < 0)
+        sd_bus_reply_method_errorf(search->call, SD_BUS_ERROR_FAILED, "Failed to build search reply: %s", strerror(-ret));
+    pending_search_free(search);
+}
+
+// Fails the searches whose deadline has passed by `now`.
+void pending_searches_expire(struct timespec now)
+{
+    for (size_t i = 0; i < PENDING_SEARCH_MAX; i++)
+    {
+        struct pending_search *search = &pending_searches[i];
+        if (!search->call || now.tv_sec < search->deadline)
+            continue;
+
+        sd_bus_reply_method_errorf(search->call, SD_BUS_ERROR_TIMEOUT, "Search for '%s' timed out", search->query);
+        pending_search_free(search);
+    }
+}
+
+// Handles a message foo_mpris pushed on its own; returns false if `ctx` holds anything else.
+bool handle_event(struct ubjson_ctx *ctx)
+{
+    struct protocol_track track;
+
+    switch (protocol_read_message(ctx))
+    {
+    case PROTOCOL_MESSAGE_promote:
+        protocol_read_track(ctx, &track);
+        if (PROTOCOL_HAS(&track, track, id) && prefetched_metadata.track.present &&
+            protocol_string_same(track.id, prefetched_metadata.track.id))
+        {
+            cached_track_free(&current_metadata);
+            current_metadata = prefetched_metadata;
+            memset(&prefetched_metadata, 0, sizeof(prefetched_metadata));
+        }
+        else
+            cached_track_free(&current_metadata);
+        metadata_changed = true;
+        return true;
+    case PROTOCOL_MESSAGE_prefetch:
+        cached_track_take(&prefetched_metadata, ctx);
+        return true;
+    case PROTOCOL_MESSAGE_invalidate:
+        cached_track_free(&current_metadata);
+        metadata_changed = true;
+        return true;
+    case PROTOCOL_MESSAGE_update:
+        // A burst of updates still ends in one PropertiesChanged, from the main loop. If the cache can't take the
+        // update it's dropped, and the next Metadata read asks foo_mpris again.
+        if (!cached_track_update(&current_metadata, ctx))
+            cached_track_free(&current_metadata);
+        metadata_changed = true;
+        return true;
+    case PROTOCOL_MESSAGE_search_chunk:
+        search_receive_chunk(ctx);
+        return true;
+    default:
+        return false;
+    }
+}
 
-cleanup:
-    free(id);
-    free(art_url);
-    free(album);
-    for (size_t i = 0; i < artist_count; i++)
-        free(artist[i]);
-    free(artist);
-    free(date);
-    free(title);
-    ubjson_ctx_free(&ctx);
+// Bytes received from foo_mpris which haven't been parsed yet; a single recv() can return several messages once
+// events are pushed alongside replies, and a message can just as well arrive split across several. It starts out
+// INBOX_SIZE bytes and doubles for a message which doesn't fit, like a big page of search results.
+#define INBOX_SIZE 65536
+char *inbox;
+size_t inbox_size;
+size_t inbox_len;
+// Finds where the first message in the inbox ends, reading each chunk only once as it comes in.
+struct ubjson_reader inbox_reader;
+// The message last parsed from the inbox. It's reset rather than freed for the next one, so it keeps its memory; a
+// handler which holds on to a message takes the ctx over, as cached_track_take() does.
+struct ubjson_ctx inbox_ctx;
+
+// Makes room for more of a message which fills the inbox. The reader has already read (and copied what it needs of)
+// everything in it, so it can move.
+bool inbox_grow(void)
+{
+    size_t size = inbox_size ? 2 * inbox_size : INBOX_SIZE;
+    char *grown = size > inbox_size ? realloc(inbox, size) : NULL;
+    if (!grown)
+        return false;
+    inbox = grown;
+    inbox_size = size;
+    return true;
+}
+
+// Parses the next message from the inbox, receiving until one is complete. It stays valid until the next call. On
+// failure a partial message stays in the inbox for the next call.
+struct ubjson_ctx *next_message(bool block)
+{
+    enum ubjson_event event;
+    do
+    {
+        event = ubjson_reader_next(&inbox_reader);
+        if (event == UBJSON_EVENT_NEED_MORE && inbox_len == inbox_size && !inbox_grow())
+            event = UBJSON_EVENT_ERROR;
+        if (event == UBJSON_EVENT_ERROR)
+        {
+            // Nothing after this can be framed reliably, so the connection is dropped, and made again by the main loop
+            inbox_len = 0;
+            ubjson_reader_free(&inbox_reader);
+            shutdown(peer, SHUT_RDWR);
+            return NULL;
+        }
+        if (event == UBJSON_EVENT_NEED_MORE)
+        {
+            ssize_t received = recv(peer, inbox + inbox_len, inbox_size - inbox_len, block ? 0 : MSG_DONTWAIT);
+            if (received <= 0)
+                return NULL;
+            ubjson_reader_feed(&inbox_reader, inbox + inbox_len, received);
+            inbox_len += received;
+        }
+    } while (inbox_reader.depth || (event != UBJSON_EVENT_END_OBJECT && event != UBJSON_EVENT_END_ARRAY));
+
+    size_t used = inbox_reader.buf + inbox_reader.index - inbox;
+    ubjson_ctx_reset(&inbox_ctx, inbox, used);
+    bool result = ubjson_ctx_parse(&inbox_ctx);
+    memmove(inbox, inbox + used, inbox_len - used);
+    inbox_len -= used;
+    ubjson_reader_feed(&inbox_reader, inbox, inbox_len);
+
+    return result ? &inbox_ctx : NULL;
+}
+
+// Receives the reply to the command just sent, handling any events which arrive before it. The reply is valid until
+// the next message is received.
+struct ubjson_ctx *receive_reply(void)
+{
+    struct ubjson_ctx *ctx;
+    while ((ctx = next_message(true)))
+    {
+        if (!handle_event(ctx))
+            return ctx;
+    }
+    return NULL;
+}
+
+// Handles whatever events have arrived without blocking; anything which isn't an event is stale and dropped.
+void receive_events(void)
+{
+    struct ubjson_ctx *ctx;
+    while ((ctx = next_message(false)))
+        handle_event(ctx);
+}
+
+int foobar2000_Metadata(sd_bus *bus,
+                        const char *path,
+                        const char *interface,
+                        const char *property,
+                        sd_bus_message *reply,
+                        void *userdata,
+                        sd_bus_error *ret_error)
+{
+    if (current_metadata.track.present)
+    {
+        metadata_append(reply, &current_metadata.track);
+        return 0;
+    }
+
+    SEND_MESSAGE(metadata, &(struct protocol_metadata_args) { .fields = METADATA_FIELDS_ALL });
+
+    struct ubjson_ctx *ctx = receive_reply();
+    if (!ctx || !cached_track_take(&current_metadata, ctx))
+    {
+        struct protocol_track track = { .present = METADATA_FIELD_ID, .id = { "/", 1 } };
+        metadata_append(reply, &track);
+        return 0;
+    }
 
+    metadata_append(reply, &current_metadata.track);
     return 0;
 }
 
@@ -396,30 +750,15 @@ int foobar2000_Position(sd_bus *bus,
                         void *userdata,
                         sd_bus_error *ret_error)
 {
-    SEND_SIMPLE_PACKET("position");
-
-    char buf[256] = { 0 };
-    size_t recv_size = recv(peer, buf, sizeof(buf), 0);
+    SEND_MESSAGE(position, NULL);
 
     int64_t position = 0;
-    char *key = NULL;
-    int64_t received_position = 0;
-
-    struct ubjson_ctx ctx;
-    ubjson_ctx_init(&ctx, buf, recv_size);
-    if (!ubjson_ctx_parse(&ctx))
-        goto cleanup;
-
-    ubjson_ctx_read_kv_pair(&ctx, &key, &received_position, UBJSON_TYPE_INT64);
 
-    if (strcmp(key, "position"))
-        goto cleanup;
+    struct ubjson_ctx *ctx = receive_reply();
+    struct protocol_playback_position received;
+    if (ctx && protocol_read_playback_position(ctx, &received) && PROTOCOL_HAS(&received, playback_position, position))
+        position = received.position;
 
-    position = received_position;
-
-cleanup:
-    free(key);
-    ubjson_ctx_free(&ctx);
     return sd_bus_message_append_basic(reply, 'x', &position);
 }
 
@@ -490,6 +829,214 @@ static const sd_bus_vtable foobar2000_player_vtable[] = {
 };
 // clang-format on
 
+int foobar2000_search_Search(sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
+{
+    struct protocol_search_args args = { .present = PROTOCOL_BIT(search_args, query) |
+                                                    PROTOCOL_BIT(search_args, offset) |
+                                                    PROTOCOL_BIT(search_args, limit) |
+                                                    PROTOCOL_BIT(search_args, serial) };
+    char const *query;
+    uint32_t offset;
+    uint32_t limit;
+    int ret = sd_bus_message_read(m, "suu", &query, &offset, &limit);
+    if (ret < 0)
+        return ret;
+    args.query = protocol_string_of(query);
+    args.offset = offset;
+    args.limit = limit;
+
+    struct pending_search *search = NULL;
+    for (size_t i = 0; i < PENDING_SEARCH_MAX && !search; i++)
+    {
+        if (!pending_searches[i].call)
+            search = &pending_searches[i];
+    }
+    if (!search)
+        return sd_bus_reply_method_errorf(m, SD_BUS_ERROR_LIMITS_EXCEEDED, "Too many searches in progress");
+
+    // Answered by search_receive_chunk() once the results are in, so a big page doesn't hold up other calls
+    args.serial = ++search_serial;
+    bool sent;
+    SEND_MESSAGE_CHECKED(sent, search, &args);
+    if (!sent)
+        return sd_bus_reply_method_errorf(m, SD_BUS_ERROR_IO_ERROR, "Failed to send search to foobar2000");
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    search->serial = args.serial;
+    search->query = strdup(query);
+    search->call = sd_bus_message_ref(m);
+    search->deadline = now.tv_sec + PENDING_SEARCH_TIMEOUT;
+    return 1;
+}
+
+// clang-format off
+static const sd_bus_vtable foobar2000_search_vtable[] = {
+    SD_BUS_VTABLE_START(0),
+    SD_BUS_METHOD("Search", "suu", "ua(os)", foobar2000_search_Search, SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_VTABLE_END
+};
+// clang-format on
+
+// Visualisation frames arrive on their own socket so they never queue up behind (or in front of) command replies, and
+// are published to a shared-memory ring which any number of local clients can map. See visualisation.h.
+struct vis_ring *vis_ring;
+int vis_ring_fd = -1;
+int vis_ring_listener = -1;
+int vis_listener = -1;
+int vis_peer = -1;
+char vis_inbox[2 * VIS_FRAME_MAX_SIZE];
+size_t vis_inbox_len;
+
+int vis_listen(char const *path)
+{
+    struct sockaddr_un addr = { AF_UNIX };
+    strcpy(addr.sun_path, path);
+    unlink(path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0)
+        return -1;
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, 4))
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Creates the ring and both sockets. Failing here only disables visualisation.
+bool vis_setup(void)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "/foobard-vis-%d", (int)getpid());
+
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0)
+        return false;
+    // Clients get a read-only descriptor, so only foobard can ever write to the ring
+    vis_ring_fd = shm_open(name, O_RDONLY, 0);
+    shm_unlink(name);
+
+    if (vis_ring_fd < 0 || ftruncate(fd, VIS_RING_SIZE))
+        goto fail;
+    vis_ring = mmap(NULL, VIS_RING_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (vis_ring == MAP_FAILED)
+        goto fail;
+    close(fd);
+
+    vis_ring->slot_count = VIS_RING_SLOT_COUNT;
+    vis_ring->slot_size = VIS_RING_SLOT_SIZE;
+    __atomic_store_n(&vis_ring->magic, VIS_FRAME_MAGIC, __ATOMIC_RELEASE);
+
+    vis_listener = vis_listen("/tmp/" VIS_SOCKET_NAME);
+    vis_ring_listener = vis_listen(VIS_RING_SOCKET_PATH);
+    return vis_listener >= 0 && vis_ring_listener >= 0;
+
+fail:
+    close(fd);
+    if (vis_ring_fd >= 0)
+        close(vis_ring_fd);
+    vis_ring = NULL;
+    vis_ring_fd = -1;
+    return false;
+}
+
+// Overwrites the oldest slot; readers are never waited for.
+void vis_ring_publish(struct vis_frame_header const *header, char const *data, size_t size)
+{
+    uint64_t n = vis_ring->write_sequence;
+    struct vis_ring_slot *slot = (void *)((char *)(vis_ring + 1) + (n % VIS_RING_SLOT_COUNT) * VIS_RING_SLOT_SIZE);
+
+    __atomic_store_n(&slot->sequence, 2 * n + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(&slot->header, header, sizeof(*header));
+    memcpy(slot + 1, data, size);
+    __atomic_store_n(&slot->sequence, 2 * (n + 1), __ATOMIC_RELEASE);
+    __atomic_store_n(&vis_ring->write_sequence, n + 1, __ATOMIC_RELEASE);
+}
+
+void vis_accept(void)
+{
+    int fd = accept(vis_listener, NULL, NULL);
+    if (fd < 0)
+        return;
+
+    if (vis_peer >= 0)
+        close(vis_peer);
+    vis_peer = fd;
+    vis_inbox_len = 0;
+}
+
+// Publishes every complete frame received so far; a partial frame stays in the inbox until the rest arrives.
+void vis_receive_frames(void)
+{
+    ssize_t received = recv(vis_peer, vis_inbox + vis_inbox_len, sizeof(vis_inbox) - vis_inbox_len, MSG_DONTWAIT);
+    if (received == 0 || (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+    {
+        close(vis_peer);
+        vis_peer = -1;
+        return;
+    }
+    if (received > 0)
+        vis_inbox_len += received;
+
+    size_t used = 0;
+    while (vis_inbox_len - used >= sizeof(struct vis_frame_header))
+    {
+        struct vis_frame_header header;
+        memcpy(&header, vis_inbox + used, sizeof(header));
+
+        // Garbage would otherwise stall the stream forever, so skip ahead to the next thing that looks like a frame
+        if (header.magic != VIS_FRAME_MAGIC || !header.channels || header.channels > VIS_MAX_CHANNELS ||
+            header.bins > VIS_MAX_BINS)
+        {
+            used++;
+            continue;
+        }
+
+        size_t size = (size_t)header.channels * header.bins * sizeof(float);
+        if (vis_inbox_len - used < sizeof(header) + size)
+            break;
+
+        vis_ring_publish(&header, vis_inbox + used + sizeof(header), size);
+        used += sizeof(header) + size;
+    }
+
+    memmove(vis_inbox, vis_inbox + used, vis_inbox_len - used);
+    vis_inbox_len -= used;
+}
+
+// Answers a ring client with the ring's descriptor and hangs up; the mapping is all it needs from then on.
+void vis_share_ring(void)
+{
+    int client = accept(vis_ring_listener, NULL, NULL);
+    if (client < 0)
+        return;
+
+    union
+    {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control = { 0 };
+    struct iovec iov = { &(char) { 0 }, 1 };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &vis_ring_fd, sizeof(int));
+
+    sendmsg(client, &msg, 0);
+    close(client);
+}
+
 void *sd_bus_loop(void *vp_bus)
 {
     int ret;
@@ -508,13 +1055,29 @@ int main(void)
 {
     int sock;
     struct sockaddr_un addr = { AF_UNIX, "/tmp/foo_mpris.sock" }, client;
-    struct sd_bus *bus;
     int ret;
 
     sigaction(SIGPIPE, &(struct sigaction) { { SIG_IGN } }, NULL);
 
+    if (!vis_setup())
+        fprintf(stderr, "Failed to set up visualisation: %s\n", strerror(errno));
+    ubjson_reader_init(&inbox_reader);
+    ubjson_ctx_init(&inbox_ctx, NULL, 0);
+
 restart:
     bus = NULL;
+    // Back to its first size, should a big message have grown it
+    free(inbox);
+    inbox = NULL;
+    inbox_size = 0;
+    inbox_len = 0;
+    ubjson_reader_free(&inbox_reader);
+    ubjson_ctx_reset(&inbox_ctx, NULL, 0);
+    cached_track_free(&current_metadata);
+    cached_track_free(&prefetched_metadata);
+    // Their bus is gone along with the connection to foo_mpris
+    for (size_t i = 0; i < PENDING_SEARCH_MAX; i++)
+        pending_search_free(&pending_searches[i]);
 
     ret = sd_bus_open_user(&bus);
     if (ret < 0)
@@ -537,6 +1100,13 @@ restart:
         return 1;
     }
 
+    ret = sd_bus_add_object_vtable(bus, NULL, "/org/mpris/MediaPlayer2", "org.foobar2000.Search", foobar2000_search_vtable, NULL);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Failed to add search interface: %s\n", strerror(-ret));
+        return 1;
+    }
+
     ret = sd_bus_request_name(bus, "org.mpris.MediaPlayer2.foobar2000", 0);
     if (ret < 0)
     {
@@ -558,36 +1128,74 @@ restart:
 
     setsockopt(peer, SOL_SOCKET, SO_RCVTIMEO, &(struct timeval) { 1, 0 }, sizeof(struct timeval));
 
-    char buf[19] = { 0 };
-    ret = recv(peer, buf, sizeof(buf), 0);
-    if (memcmp(buf, "{i\x07commandSi\x05hello}", ret))
+    char buf[sizeof(PROTOCOL_HELLO_FRAME)] = { 0 };
+    ret = recv(peer, buf, sizeof(buf) - 1, 0);
+    if (ret != sizeof(PROTOCOL_HELLO_FRAME) - 1 || memcmp(buf, PROTOCOL_HELLO_FRAME, ret))
     {
         printf("Received incorrect hello frame '%s', exiting...\n", buf);
         return 1;
     }
 
+    struct timespec last_ping = { 0 };
     while (true)
     {
-        char ping[9];
-        ret = send(peer, "{i\x04pingN}", 9, 0);
-        if (ret <= 0)
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec > last_ping.tv_sec)
         {
-            sd_bus_flush_close_unref(bus);
-            goto restart;
-        }
-
-        ret = recv(peer, ping, sizeof(ping), 0);
-        if (ret <= 0 || memcmp(ping, "{i\x04pingN}", 9))
-        {
-            sd_bus_flush_close_unref(bus);
-            goto restart;
+            last_ping = now;
+
+            ret = send(peer, PROTOCOL_PING_FRAME, sizeof(PROTOCOL_PING_FRAME) - 1, 0);
+            if (ret <= 0)
+            {
+                sd_bus_flush_close_unref(bus);
+                goto restart;
+            }
+
+            struct ubjson_ctx *ctx = receive_reply();
+            if (!ctx || !ubjson_ctx_get(ctx, "ping", NULL, UBJSON_TYPE_NOOP))
+            {
+                sd_bus_flush_close_unref(bus);
+                goto restart;
+            }
         }
 
         ret = sd_bus_process(bus, NULL);
         while (ret > 0)
             ret = sd_bus_process(bus, NULL);
 
-        ret = sd_bus_wait(bus, 1000000); // 1-second wait
+        pending_searches_expire(now);
+
+        if (metadata_changed)
+        {
+            metadata_changed = false;
+            sd_bus_emit_properties_changed(bus, "/org/mpris/MediaPlayer2", "org.mpris.MediaPlayer2.Player", "Metadata", NULL);
+        }
+
+        // Wake up for D-Bus traffic, events pushed by foo_mpris, visualisation frames, or the next ping
+        struct pollfd fds[5] = {
+            { sd_bus_get_fd(bus), sd_bus_get_events(bus) },
+            { peer, POLLIN },
+            { vis_peer, POLLIN },
+            { vis_listener, POLLIN },
+            { vis_ring_listener, POLLIN },
+        };
+        poll(fds, 5, 1000);
+
+        if (fds[2].revents)
+            vis_receive_frames();
+        if (fds[3].revents & POLLIN)
+            vis_accept();
+        if (fds[4].revents & POLLIN)
+            vis_share_ring();
+
+        if (fds[1].revents & (POLLHUP | POLLERR))
+        {
+            sd_bus_flush_close_unref(bus);
+            goto restart;
+        }
+        if (fds[1].revents & POLLIN)
+            receive_events();
     }
 
     sd_bus_flush_close_unref(bus);
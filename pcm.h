@@ -0,0 +1,70 @@
+// Copyright (c) 2023 Ally Sommers
+// This code is licensed under the BSD 3-Clause License. A copy of this license
+// is included in the repository.
+
+#ifndef PCM_H
+#define PCM_H
+
+// Like protocol.h this header doesn't include anything itself; include <stdint.h> (or anything that pulls it in)
+// first.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// foo_mpris creates this file next to its socket (/tmp under Wine) when PCM capture is enabled. Consumers map it
+// read-only; nothing about the capture goes through either socket.
+#define PCM_RING_FILE_NAME "foo_mpris_pcm"
+
+#define PCM_RING_MAGIC 0x4d435046 // "FPCM"
+// In samples, i.e. floats; about 10 seconds of 48 kHz stereo.
+#define PCM_RING_SAMPLE_CAPACITY (1 << 20)
+#define PCM_RING_BLOCK_CAPACITY 1024
+
+// One audio_chunk as foobar2000 played it. Its channels * frames float samples start at sample `position` of the
+// stream, which is at index position % PCM_RING_SAMPLE_CAPACITY of the sample ring and may wrap around its end.
+struct pcm_block
+{
+    uint64_t position;
+    uint32_t frames;
+    uint32_t sample_rate;
+    uint32_t channels;
+    // foobar2000's channel config, which uses the WAVEFORMATEXTENSIBLE speaker bits.
+    uint32_t channel_config;
+    // When the chunk was captured, in nanoseconds since the Unix epoch.
+    int64_t timestamp;
+};
+
+// The file starts with this header, followed by PCM_RING_BLOCK_CAPACITY pcm_blocks, followed by
+// PCM_RING_SAMPLE_CAPACITY floats. foo_mpris is the only writer. Positions and counts only ever grow; all of them
+// are 64-bit and must be loaded atomically with acquire ordering.
+//
+// For every chunk the writer first raises `reserve_position` past the samples it is about to overwrite, then copies
+// the samples and the block, raises `write_position` and finally `block_count`, so block n is at index
+// n % PCM_RING_BLOCK_CAPACITY once `block_count` > n.
+//
+// Overrun policy: the writer never waits for readers, since it runs on foobar2000's main thread. Readers copy block
+// n and its samples, issue an acquire fence, and then check that block_count - n < PCM_RING_BLOCK_CAPACITY and
+// reserve_position - block.position <= PCM_RING_SAMPLE_CAPACITY. If either fails the reader has been overrun: the
+// data is gone, and it should resume at the newest block, treating the skip as a dropout.
+struct pcm_ring
+{
+    uint32_t magic;
+    uint32_t sample_capacity;
+    uint32_t block_capacity;
+    uint32_t reserved;
+    uint64_t reserve_position;
+    uint64_t write_position;
+    uint64_t block_count;
+    uint64_t reserved2;
+};
+
+#define PCM_RING_SIZE                                                                                                 \
+    (sizeof(struct pcm_ring) + PCM_RING_BLOCK_CAPACITY * sizeof(struct pcm_block) +                                  \
+     PCM_RING_SAMPLE_CAPACITY * sizeof(float))
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
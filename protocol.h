@@ -0,0 +1,511 @@
+// Copyright (c) 2023 Ally Sommers
+// This code is licensed under the BSD 3-Clause License. A copy of this license
+// is included in the repository.
+
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+// ubjson.h sets the feature test macros, so it has to come before any system header.
+#include "ubjson/ubjson.h"
+
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Everything foobard and foo_mpris say to each other is described once, below, and both sides use the structs and
+// functions generated from it, so they can't disagree about a key or a type.
+//
+// A record is a set of fields. PROTOCOL_FIELDS_<record>(F, record) expands F(record, member, "key", TYPE) for each
+// of them, and every record generates:
+//
+//   struct protocol_<record>     the fields, plus a `present` bitmask filled in when decoding (see PROTOCOL_HAS)
+//   protocol_write_<record>()    writes every field as a key and value into the object a ubjson_writer is in
+//   protocol_write_present_<record>()  the same, but only the fields whose bits are set in `present`
+//   protocol_encode_<record>()   writes a whole object holding just the fields; used for replies
+//   protocol_read_<record>()     decodes a parsed object, ignoring unknown keys and keys of the wrong type
+//   protocol_key_<record>()      the key of a field, by PROTOCOL_INDEX
+//
+// Decoding doesn't allocate or copy: keys are matched by length and then bytes, and STRING and STRINGS members are
+// (pointer, length) views into the parsed message, so they live exactly as long as its ubjson_ctx. They aren't
+// terminated, unless ubjson_ctx_terminate() was called on the message before it was decoded, for whoever needs to hand
+// them on as C strings.
+
+// Types a field can have. STRINGS is an array of strings.
+#define PROTOCOL_CTYPE_STRING struct protocol_string
+#define PROTOCOL_CTYPE_INT32 int32_t
+#define PROTOCOL_CTYPE_INT64 int64_t
+#define PROTOCOL_CTYPE_FLOAT64 double
+#define PROTOCOL_CTYPE_STRINGS struct protocol_strings
+
+// A STRING member. `data` is NULL when the field wasn't set.
+struct protocol_string
+{
+    char const *data;
+    size_t length;
+};
+
+// When encoding, set `items`; a decoded list has `values` instead. Read either with protocol_strings_get().
+struct protocol_strings
+{
+    size_t count;
+    char const *const *items;
+    struct ubjson_value const *values;
+};
+
+// clang-format off
+#define PROTOCOL_FIELDS_none(F, r)
+
+#define PROTOCOL_FIELDS_metadata_args(F, r) \
+    F(r, fields, "fields", INT32)
+
+#define PROTOCOL_FIELDS_seek_args(F, r) \
+    F(r, offset, "offset", INT64)
+
+#define PROTOCOL_FIELDS_setposition_args(F, r) \
+    F(r, track_id, "track_id", STRING)         \
+    F(r, offset,   "offset",   INT64)
+
+// `serial` is chosen by foobard and echoed in every search_chunk of the results.
+#define PROTOCOL_FIELDS_search_args(F, r) \
+    F(r, query,  "query",  STRING)        \
+    F(r, offset, "offset", INT64)         \
+    F(r, limit,  "limit",  INT64)         \
+    F(r, serial, "serial", INT64)
+
+#define PROTOCOL_FIELDS_playback_status(F, r) \
+    F(r, status, "status", STRING)
+
+#define PROTOCOL_FIELDS_playback_position(F, r) \
+    F(r, position, "position", INT64)
+
+// Field indices double as the metadata_field bits below, so the order is part of the protocol.
+#define PROTOCOL_FIELDS_track(F, r)                   \
+    F(r, id,           "id",           STRING)        \
+    F(r, length,       "length",       INT64)         \
+    F(r, art_url,      "artUrl",       STRING)        \
+    F(r, album,        "album",        STRING)        \
+    F(r, artist,       "artist",       STRINGS)       \
+    F(r, date,         "date",         STRING)        \
+    F(r, title,        "title",        STRING)        \
+    F(r, track_number, "track_number", INT32)         \
+    F(r, album_artist, "albumArtist",  STRINGS)       \
+    F(r, genre,        "genre",        STRINGS)       \
+    F(r, composer,     "composer",     STRINGS)       \
+    F(r, disc_number,  "discNumber",   INT32)         \
+    F(r, comment,      "comment",      STRINGS)       \
+    F(r, url,          "url",          STRING)        \
+    F(r, bitrate,      "bitrate",      INT32)         \
+    F(r, use_count,    "useCount",     INT32)         \
+    F(r, last_used,    "lastUsed",     STRING)        \
+    F(r, audio_bpm,    "audioBPM",     INT32)         \
+    F(r, user_rating,  "userRating",   FLOAT64)
+
+// One slice of the requested page, in order. `done` is 1 on the last chunk. `total` is PROTOCOL_SEARCH_INVALID for an
+// invalid query, or PROTOCOL_SEARCH_FAILED on a last chunk sent in place of results which couldn't be encoded; the
+// search has failed either way, whatever chunks came before.
+#define PROTOCOL_FIELDS_search_results(F, r) \
+    F(r, serial, "serial", INT64)            \
+    F(r, total,  "total",  INT64)            \
+    F(r, ids,    "ids",    STRINGS)          \
+    F(r, titles, "titles", STRINGS)          \
+    F(r, done,   "done",   INT32)
+
+#define PROTOCOL_RECORDS(R)  \
+    R(none)                  \
+    R(metadata_args)         \
+    R(seek_args)             \
+    R(setposition_args)      \
+    R(search_args)           \
+    R(playback_status)       \
+    R(playback_position)     \
+    R(track)                 \
+    R(search_results)
+
+// Commands go from foobard to foo_mpris as {"command": "<message>", ...}, events the other way as
+// {"event": "<message>", ...}. Each carries the fields of one record; M(KIND, message, record). Commands answer with
+// an object holding the fields of their reply record, if they have one:
+//
+//   playbackstatus -> playback_status, metadata -> track, position -> playback_position
+//
+// Bulk commands don't reply in line. Their results come back as search_chunk events, sent between the replies to
+// other commands so a big page can't hold up a play or a position query; search is the only one so far.
+//
+// update carries only the fields of the playing track which changed mid-track (a stream's title, say), with its id.
+#define PROTOCOL_MESSAGES(M)                            \
+    M(COMMAND, play,           none)                   \
+    M(COMMAND, pause,          none)                   \
+    M(COMMAND, playpause,      none)                   \
+    M(COMMAND, stop,           none)                   \
+    M(COMMAND, next,           none)                   \
+    M(COMMAND, previous,       none)                   \
+    M(COMMAND, playbackstatus, none)                   \
+    M(COMMAND, metadata,       metadata_args)          \
+    M(COMMAND, position,       none)                   \
+    M(COMMAND, seek,           seek_args)              \
+    M(COMMAND, setposition,    setposition_args)       \
+    M(COMMAND, search,         search_args)            \
+    M(EVENT,   promote,        track)                  \
+    M(EVENT,   prefetch,       track)                  \
+    M(EVENT,   invalidate,     none)                   \
+    M(EVENT,   update,         track)                  \
+    M(EVENT,   search_chunk,   search_results)
+// clang-format on
+
+// The handshake and keepalive are fixed frames which are compared byte for byte. foo_mpris sends the hello once
+// connected; foobard pings every second and foo_mpris echoes the ping.
+#define PROTOCOL_HELLO_FRAME "{i\x07" "commandSi\x05" "hello}"
+#define PROTOCOL_PING_FRAME "{i\x04" "pingN}"
+
+#define PROTOCOL_INDEX(record, member) PROTOCOL_INDEX_##record##_##member
+#define PROTOCOL_BIT(record, member) (1u << PROTOCOL_INDEX(record, member))
+#define PROTOCOL_HAS(in, record, member) (((in)->present & PROTOCOL_BIT(record, member)) != 0)
+
+// A STRING member holding the C string `str`, for encoding.
+static inline struct protocol_string protocol_string_of(char const *str)
+{
+    struct protocol_string string = { str, str ? strlen(str) : 0 };
+    return string;
+}
+
+// Whether `string` was set, to the bytes of `str`.
+static inline bool protocol_string_equals(struct protocol_string string, char const *str)
+{
+    size_t length = strlen(str);
+    return string.data && string.length == length && !memcmp(string.data, str, length);
+}
+
+// Whether `a` and `b` hold the same bytes.
+static inline bool protocol_string_same(struct protocol_string a, struct protocol_string b)
+{
+    return a.length == b.length && (!a.length || !memcmp(a.data, b.data, a.length));
+}
+
+static inline struct protocol_string protocol_strings_get(struct protocol_strings const *list, size_t index)
+{
+    if (list->items)
+        return protocol_string_of(list->items[index]);
+    struct protocol_string string = { "", 0 };
+    if (list->values[index].type == UBJSON_TYPE_STRING)
+    {
+        string.data = list->values[index].v.string;
+        string.length = list->values[index].length;
+    }
+    return string;
+}
+
+static inline void protocol_write_STRING(struct ubjson_writer *writer, char const *key, struct protocol_string value)
+{
+    ubjson_writer_key(writer, key);
+    ubjson_writer_string_length(writer, value.data ? value.data : "", value.data ? value.length : 0);
+}
+
+// Writes a key and a C string, for fields written by hand rather than from a record.
+static inline void protocol_write_cstring(struct ubjson_writer *writer, char const *key, char const *value)
+{
+    protocol_write_STRING(writer, key, protocol_string_of(value));
+}
+
+static inline void protocol_write_INT32(struct ubjson_writer *writer, char const *key, int32_t value)
+{
+    ubjson_writer_key(writer, key);
+    ubjson_writer_int(writer, value);
+}
+
+static inline void protocol_write_INT64(struct ubjson_writer *writer, char const *key, int64_t value)
+{
+    ubjson_writer_key(writer, key);
+    ubjson_writer_int(writer, value);
+}
+
+static inline void protocol_write_FLOAT64(struct ubjson_writer *writer, char const *key, double value)
+{
+    ubjson_writer_key(writer, key);
+    ubjson_writer_float64(writer, value);
+}
+
+static inline void protocol_write_STRINGS(struct ubjson_writer *writer, char const *key, struct protocol_strings value)
+{
+    ubjson_writer_key(writer, key);
+    ubjson_writer_begin_array(writer);
+    for (size_t i = 0; i < value.count; i++)
+    {
+        struct protocol_string item = protocol_strings_get(&value, i);
+        ubjson_writer_string_length(writer, item.data ? item.data : "", item.data ? item.length : 0);
+    }
+    ubjson_writer_end_array(writer);
+}
+
+// Integers are accepted at any width the value fits in; the writer picks the smallest, but nothing requires it.
+static inline bool protocol_read_integer(struct ubjson_value const *value, int64_t *out)
+{
+    switch (value->type)
+    {
+    case UBJSON_TYPE_INT8:
+        *out = value->v.int8;
+        return true;
+    case UBJSON_TYPE_UINT8:
+        *out = value->v.uint8;
+        return true;
+    case UBJSON_TYPE_INT16:
+        *out = value->v.int16;
+        return true;
+    case UBJSON_TYPE_INT32:
+        *out = value->v.int32;
+        return true;
+    case UBJSON_TYPE_INT64:
+        *out = value->v.int64;
+        return true;
+    default:
+        return false;
+    }
+}
+
+static inline bool protocol_read_STRING(struct ubjson_value const *value, struct protocol_string *out)
+{
+    if (value->type != UBJSON_TYPE_STRING)
+        return false;
+    out->data = value->v.string;
+    out->length = value->length;
+    return true;
+}
+
+static inline bool protocol_read_INT32(struct ubjson_value const *value, int32_t *out)
+{
+    int64_t integer;
+    if (!protocol_read_integer(value, &integer) || integer < INT32_MIN || integer > INT32_MAX)
+        return false;
+    *out = (int32_t)integer;
+    return true;
+}
+
+static inline bool protocol_read_INT64(struct ubjson_value const *value, int64_t *out)
+{
+    return protocol_read_integer(value, out);
+}
+
+static inline bool protocol_read_FLOAT64(struct ubjson_value const *value, double *out)
+{
+    int64_t integer;
+    if (value->type == UBJSON_TYPE_FLOAT64)
+        *out = value->v.float64;
+    else if (value->type == UBJSON_TYPE_FLOAT32)
+        *out = value->v.float32;
+    else if (protocol_read_integer(value, &integer))
+        *out = (double)integer;
+    else
+        return false;
+    return true;
+}
+
+static inline bool protocol_read_STRINGS(struct ubjson_value const *value, struct protocol_strings *out)
+{
+    if (value->type != UBJSON_TYPE_ARRAY)
+        return false;
+    out->count = value->v.array.count;
+    out->items = NULL;
+    out->values = value->v.array.values;
+    return true;
+}
+
+#define PROTOCOL_GENERATE_MEMBER(r, member, key, type) PROTOCOL_CTYPE_##type member;
+#define PROTOCOL_GENERATE_INDEX(r, member, key, type) PROTOCOL_INDEX(r, member),
+#define PROTOCOL_GENERATE_KEY(r, member, key, type) key,
+#define PROTOCOL_GENERATE_WRITE(r, member, key, type) protocol_write_##type(writer, key, in->member);
+#define PROTOCOL_GENERATE_WRITE_PRESENT(r, member, key, type) \
+    if (in->present & PROTOCOL_BIT(r, member))                 \
+        protocol_write_##type(writer, key, in->member);
+#define PROTOCOL_GENERATE_READ(r, member, key, type)                            \
+    if (length == sizeof(key) - 1 && !memcmp(name, key, sizeof(key) - 1))     \
+    {                                                                          \
+        if (protocol_read_##type(value, &out->member))                         \
+            out->present |= PROTOCOL_BIT(r, member);                           \
+        continue;                                                              \
+    }
+
+#define PROTOCOL_GENERATE_RECORD(r)                                                             \
+    struct protocol_##r                                                                         \
+    {                                                                                           \
+        uint32_t present;                                                                       \
+        PROTOCOL_FIELDS_##r(PROTOCOL_GENERATE_MEMBER, r)                                        \
+    };                                                                                          \
+                                                                                                \
+    enum                                                                                        \
+    {                                                                                           \
+        PROTOCOL_FIELDS_##r(PROTOCOL_GENERATE_INDEX, r) PROTOCOL_FIELD_COUNT_##r                \
+    };                                                                                          \
+                                                                                                \
+    static inline char const *protocol_key_##r(int index)                                       \
+    {                                                                                           \
+        static char const *const keys[] = { PROTOCOL_FIELDS_##r(PROTOCOL_GENERATE_KEY, r) "" }; \
+        return keys[index];                                                                     \
+    }                                                                                           \
+                                                                                                \
+    static inline void protocol_write_##r(struct ubjson_writer *writer, struct protocol_##r const *in) \
+    {                                                                                           \
+        (void)writer;                                                                           \
+        (void)in;                                                                               \
+        PROTOCOL_FIELDS_##r(PROTOCOL_GENERATE_WRITE, r)                                         \
+    }                                                                                           \
+                                                                                                \
+    static inline void protocol_write_present_##r(struct ubjson_writer *writer, struct protocol_##r const *in) \
+    {                                                                                           \
+        (void)writer;                                                                           \
+        (void)in;                                                                               \
+        PROTOCOL_FIELDS_##r(PROTOCOL_GENERATE_WRITE_PRESENT, r)                                 \
+    }                                                                                           \
+                                                                                                \
+    static inline void protocol_encode_##r(struct ubjson_writer *writer, struct protocol_##r const *in) \
+    {                                                                                           \
+        ubjson_writer_begin_object(writer);                                                     \
+        protocol_write_##r(writer, in);                                                         \
+        ubjson_writer_end_object(writer);                                                       \
+    }                                                                                           \
+                                                                                                \
+    static inline bool protocol_read_##r(struct ubjson_ctx const *ctx, struct protocol_##r *out) \
+    {                                                                                           \
+        memset(out, 0, sizeof(*out));                                                           \
+        if (ctx->root.type != UBJSON_TYPE_OBJECT)                                               \
+            return false;                                                                       \
+                                                                                                \
+        struct ubjson_object const *object = &ctx->root.collection.object;                      \
+        for (size_t i = 0; i < object->count; i++)                                              \
+        {                                                                                       \
+            char const *name = object->kv_pairs[i].key;                                         \
+            size_t length = object->kv_pairs[i].key_length;                                     \
+            struct ubjson_value const *value = &object->kv_pairs[i].value;                      \
+            (void)name;                                                                         \
+            (void)length;                                                                       \
+            (void)value;                                                                        \
+            PROTOCOL_FIELDS_##r(PROTOCOL_GENERATE_READ, r)                                      \
+        }                                                                                       \
+        return true;                                                                            \
+    }
+
+PROTOCOL_RECORDS(PROTOCOL_GENERATE_RECORD)
+
+// Bits of the "fields" parameter of the "metadata" command. foo_mpris only
+// includes the requested keys in its reply; "id" is always sent.
+enum metadata_field
+{
+    METADATA_FIELD_ID = PROTOCOL_BIT(track, id),
+    METADATA_FIELD_LENGTH = PROTOCOL_BIT(track, length),
+    METADATA_FIELD_ART_URL = PROTOCOL_BIT(track, art_url),
+    METADATA_FIELD_ALBUM = PROTOCOL_BIT(track, album),
+    METADATA_FIELD_ARTIST = PROTOCOL_BIT(track, artist),
+    METADATA_FIELD_DATE = PROTOCOL_BIT(track, date),
+    METADATA_FIELD_TITLE = PROTOCOL_BIT(track, title),
+    METADATA_FIELD_TRACK_NUMBER = PROTOCOL_BIT(track, track_number),
+    METADATA_FIELD_ALBUM_ARTIST = PROTOCOL_BIT(track, album_artist),
+    METADATA_FIELD_GENRE = PROTOCOL_BIT(track, genre),
+    METADATA_FIELD_COMPOSER = PROTOCOL_BIT(track, composer),
+    METADATA_FIELD_DISC_NUMBER = PROTOCOL_BIT(track, disc_number),
+    METADATA_FIELD_COMMENT = PROTOCOL_BIT(track, comment),
+    METADATA_FIELD_URL = PROTOCOL_BIT(track, url),
+    METADATA_FIELD_BITRATE = PROTOCOL_BIT(track, bitrate),
+    METADATA_FIELD_USE_COUNT = PROTOCOL_BIT(track, use_count),
+    METADATA_FIELD_LAST_USED = PROTOCOL_BIT(track, last_used),
+    METADATA_FIELD_AUDIO_BPM = PROTOCOL_BIT(track, audio_bpm),
+    METADATA_FIELD_USER_RATING = PROTOCOL_BIT(track, user_rating),
+};
+
+// Used when a "metadata" command has no "fields" parameter.
+#define METADATA_FIELDS_DEFAULT                                                                                               \
+    (METADATA_FIELD_ID | METADATA_FIELD_LENGTH | METADATA_FIELD_ART_URL | METADATA_FIELD_ALBUM | METADATA_FIELD_ARTIST |     \
+     METADATA_FIELD_DATE | METADATA_FIELD_TITLE | METADATA_FIELD_TRACK_NUMBER)
+#define METADATA_FIELDS_ALL ((1 << PROTOCOL_FIELD_COUNT_track) - 1)
+
+// Fields which can't be read from the track's file_info and need a titleformat pass.
+#define METADATA_FIELDS_STATS (METADATA_FIELD_USE_COUNT | METADATA_FIELD_LAST_USED | METADATA_FIELD_USER_RATING)
+
+#define PROTOCOL_SEARCH_INVALID (-1)
+#define PROTOCOL_SEARCH_FAILED (-2)
+
+#define PROTOCOL_TAG_COMMAND "command"
+#define PROTOCOL_TAG_EVENT "event"
+
+enum protocol_message
+{
+    PROTOCOL_MESSAGE_INVALID,
+#define PROTOCOL_GENERATE_MESSAGE_ENUM(kind, m, r) PROTOCOL_MESSAGE_##m,
+    PROTOCOL_MESSAGES(PROTOCOL_GENERATE_MESSAGE_ENUM)
+#undef PROTOCOL_GENERATE_MESSAGE_ENUM
+};
+
+#define PROTOCOL_GENERATE_MESSAGE(kind, m, r)                                                   \
+    static inline void protocol_encode_##m(struct ubjson_writer *writer, struct protocol_##r const *in) \
+    {                                                                                           \
+        ubjson_writer_begin_object(writer);                                                     \
+        protocol_write_cstring(writer, PROTOCOL_TAG_##kind, #m);                                \
+        protocol_write_##r(writer, in);                                                         \
+        ubjson_writer_end_object(writer);                                                       \
+    }
+
+PROTOCOL_MESSAGES(PROTOCOL_GENERATE_MESSAGE)
+
+// The value of the "command" or "event" key (`tag`) of a message, whose `data` is NULL if it has none.
+static inline struct protocol_string protocol_read_tag(struct ubjson_ctx const *ctx, char const *tag)
+{
+    struct protocol_string value = { NULL, 0 };
+    if (ctx->root.type != UBJSON_TYPE_OBJECT)
+        return value;
+
+    struct ubjson_object const *object = &ctx->root.collection.object;
+    size_t length = strlen(tag);
+    for (size_t i = 0; i < object->count; i++)
+    {
+        if (object->kv_pairs[i].value.type == UBJSON_TYPE_STRING && object->kv_pairs[i].key_length == length &&
+            !memcmp(object->kv_pairs[i].key, tag, length))
+        {
+            value.data = object->kv_pairs[i].value.v.string;
+            value.length = object->kv_pairs[i].value.length;
+            break;
+        }
+    }
+
+    return value;
+}
+
+#define PROTOCOL_GENERATE_MATCH(kind, m, r)                                                            \
+    if (tag_length == sizeof(PROTOCOL_TAG_##kind) - 1 && !memcmp(name, PROTOCOL_TAG_##kind, tag_length) && \
+        length == sizeof(#m) - 1 && !memcmp(value, #m, sizeof(#m) - 1))                                \
+        return PROTOCOL_MESSAGE_##m;
+
+// Identifies a command or event by its "command" or "event" key; the record is then read with protocol_read_*.
+static inline enum protocol_message protocol_read_message(struct ubjson_ctx const *ctx)
+{
+    if (ctx->root.type != UBJSON_TYPE_OBJECT)
+        return PROTOCOL_MESSAGE_INVALID;
+
+    struct ubjson_object const *object = &ctx->root.collection.object;
+    for (size_t i = 0; i < object->count; i++)
+    {
+        if (object->kv_pairs[i].value.type != UBJSON_TYPE_STRING)
+            continue;
+
+        char const *name = object->kv_pairs[i].key;
+        size_t tag_length = object->kv_pairs[i].key_length;
+        char const *value = object->kv_pairs[i].value.v.string;
+        size_t length = object->kv_pairs[i].value.length;
+        PROTOCOL_MESSAGES(PROTOCOL_GENERATE_MATCH)
+    }
+
+    return PROTOCOL_MESSAGE_INVALID;
+}
+
+#undef PROTOCOL_GENERATE_MATCH
+#undef PROTOCOL_GENERATE_MESSAGE
+#undef PROTOCOL_GENERATE_RECORD
+#undef PROTOCOL_GENERATE_READ
+#undef PROTOCOL_GENERATE_WRITE_PRESENT
+#undef PROTOCOL_GENERATE_WRITE
+#undef PROTOCOL_GENERATE_KEY
+#undef PROTOCOL_GENERATE_INDEX
+#undef PROTOCOL_GENERATE_MEMBER
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
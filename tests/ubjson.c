@@ -0,0 +1,481 @@
+// Copyright (c) 2023 Ally Sommers
+// This code is licensed under the BSD 3-Clause License. A copy of this license
+// is included in the repository.
+
+// Checks libubjson against documents whose encoding is known byte for byte. Exits non-zero if anything fails.
+
+#include "protocol.h"
+#include "ubjson/ubjson.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int failures;
+
+#define CHECK(condition)                                                   \
+    do                                                                     \
+    {                                                                      \
+        if (!(condition))                                                  \
+        {                                                                  \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #condition); \
+            failures++;                                                    \
+        }                                                                  \
+    } while (0)
+
+// A counted collection has no closing marker, so one at the root ends on the last byte of the buffer.
+static void test_counted_root(void)
+{
+    static char const array[] = "[#U\x01U\x05";
+    struct ubjson_ctx ctx;
+    u8 value = 0;
+    ubjson_ctx_init(&ctx, array, sizeof(array) - 1);
+    bool parsed = ubjson_ctx_parse(&ctx);
+    CHECK(parsed);
+    CHECK(ctx.src_index == sizeof(array) - 1);
+    CHECK(parsed && ubjson_ctx_read(&ctx, &value, UBJSON_TYPE_UINT8) && value == 5);
+    ubjson_ctx_free(&ctx);
+
+    static char const object[] = "{#i\x01i\x01xU\x05";
+    char *key = NULL;
+    value = 0;
+    ubjson_ctx_init(&ctx, object, sizeof(object) - 1);
+    parsed = ubjson_ctx_parse(&ctx);
+    CHECK(parsed);
+    CHECK(ctx.src_index == sizeof(object) - 1);
+    CHECK(parsed && ubjson_ctx_read_kv_pair(&ctx, &key, &value, UBJSON_TYPE_UINT8) && !strcmp(key, "x") && value == 5);
+    ubjson_ctx_release(&ctx, key);
+    ubjson_ctx_free(&ctx);
+
+    // One byte short of either
+    ubjson_ctx_init(&ctx, array, sizeof(array) - 2);
+    CHECK(!ubjson_ctx_parse(&ctx));
+    ubjson_ctx_free(&ctx);
+    ubjson_ctx_init(&ctx, object, sizeof(object) - 2);
+    CHECK(!ubjson_ctx_parse(&ctx));
+    ubjson_ctx_free(&ctx);
+}
+
+// A buffer of exactly the measured size is rendered into as it is, and what's rendered parses back.
+static void test_render_exact(void)
+{
+    struct ubjson_ctx ctx;
+    ubjson_ctx_init(&ctx, NULL, 0);
+    ubjson_ctx_create_object(&ctx);
+    ubjson_ctx_add_kv_pair_string(&ctx, "status", "Playing");
+    ubjson_ctx_add_kv_pair_int32(&ctx, "n", 7);
+
+    size_t size = ubjson_ctx_measure_creation(&ctx);
+    char buf[64];
+    CHECK(size <= sizeof(buf));
+    ubjson_ctx_render_into(&ctx, buf, size);
+    CHECK(ubjson_ctx_render_creation(&ctx));
+    CHECK(ctx.render_borrowed && ctx.render_buf == buf && ctx.render_index == size);
+
+    struct ubjson_ctx parsed;
+    i32 n = 0;
+    ubjson_ctx_init(&parsed, buf, size);
+    CHECK(ubjson_ctx_parse(&parsed) && parsed.src_index == size);
+    CHECK(ubjson_ctx_get(&parsed, "n", &n, UBJSON_TYPE_INT32) && n == 7);
+    ubjson_ctx_free(&parsed);
+    ubjson_ctx_free(&ctx);
+}
+
+// Parsed strings are views into a borrowed buffer, which is left as it was, until they're copied out terminated.
+static void test_string_views(void)
+{
+    static char const message[] = "{i\x07" "commandSi\x04play}";
+    char buf[sizeof(message) - 1];
+    memcpy(buf, message, sizeof(buf));
+
+    struct ubjson_ctx ctx;
+    ubjson_ctx_init_in_place(&ctx, buf, sizeof(buf), false);
+    bool parsed = ubjson_ctx_parse(&ctx);
+    CHECK(parsed);
+    CHECK(!memcmp(buf, message, sizeof(buf)));
+    struct ubjson_value *value = parsed ? ubjson_ctx_find(&ctx, "command") : NULL;
+    CHECK(value && value->type == UBJSON_TYPE_STRING && value->length == 4 && !memcmp(value->v.string, "play", 4));
+    CHECK(protocol_read_message(&ctx) == PROTOCOL_MESSAGE_play);
+    CHECK(protocol_string_equals(protocol_read_tag(&ctx, PROTOCOL_TAG_COMMAND), "play"));
+
+    CHECK(ubjson_ctx_terminate(&ctx));
+    struct protocol_string command = protocol_read_tag(&ctx, PROTOCOL_TAG_COMMAND);
+    CHECK(command.data && !strcmp(command.data, "play"));
+    CHECK(parsed && !strcmp(ctx.root.collection.object.kv_pairs[0].key, "command"));
+    CHECK(!memcmp(buf, message, sizeof(buf)));
+    ubjson_ctx_free(&ctx);
+}
+
+// Whether `ctx`'s "abc" is the typed array of int32 1, 2.
+static bool test_typed_is_1_2(struct ubjson_ctx *ctx)
+{
+    struct ubjson_value *value = ubjson_ctx_find(ctx, "abc");
+    if (!value || value->type != UBJSON_TYPE_TYPED_ARRAY || value->v.typed_array.count != 2)
+        return false;
+    i32 elements[2];
+    memcpy(elements, value->v.typed_array.data, sizeof(elements));
+    return elements[0] == 1 && elements[1] == 2;
+}
+
+// A typed array is swapped without writing to a borrowed buffer, wherever it lies, and one swapped where it lies in
+// the ctx's own buffer isn't swapped back by parsing it again.
+static void test_typed_swap_source(void)
+{
+    static char const message[] = "{i\x03" "abc[$l#i\x02\0\0\0\x01\0\0\0\x02}";
+    size_t size = sizeof(message) - 1;
+    union
+    {
+        char bytes[64];
+        u64 align;
+    } buf;
+
+    for (size_t offset = 0; offset < 8; offset++)
+    {
+        memcpy(buf.bytes + offset, message, size);
+        for (int pass = 0; pass < 2; pass++)
+        {
+            struct ubjson_ctx ctx;
+            ubjson_ctx_init_in_place(&ctx, buf.bytes + offset, size, false);
+            CHECK(ubjson_ctx_parse(&ctx) && test_typed_is_1_2(&ctx));
+            ubjson_ctx_free(&ctx);
+            CHECK(!memcmp(buf.bytes + offset, message, size));
+        }
+    }
+
+    // The elements are 12 bytes in, so aligned in a copy of the message
+    struct ubjson_ctx ctx;
+    ubjson_ctx_init(&ctx, message, size);
+    CHECK(ubjson_ctx_parse(&ctx) && test_typed_is_1_2(&ctx));
+    CHECK(!ubjson_ctx_find(&ctx, "abc")->v.typed_array.owned);
+    ctx.src_index = 0;
+    CHECK(ubjson_ctx_parse(&ctx) && test_typed_is_1_2(&ctx));
+    ubjson_ctx_free(&ctx);
+}
+
+// Lets through `user`'s count of allocations and fails the rest.
+static void *test_bounded_alloc(void *user, size_t size)
+{
+    size_t *left = user;
+    if (!*left)
+        return NULL;
+    --*left;
+    return malloc(size);
+}
+
+static void *test_bounded_realloc(void *user, void *ptr, size_t old_size, size_t size)
+{
+    size_t *left = user;
+    if (!*left)
+        return NULL;
+    --*left;
+    return realloc(ptr, size);
+}
+
+static void test_bounded_free(void *user, void *ptr)
+{
+    free(ptr);
+}
+
+// Running out of memory for a cursor fails the call rather than writing through NULL.
+static void test_cursor_alloc_fails(void)
+{
+    size_t left = 0;
+    struct ubjson_allocator allocator = { test_bounded_alloc, test_bounded_realloc, test_bounded_free, &left };
+    struct ubjson_ctx ctx;
+    ubjson_ctx_init_allocator(&ctx, &allocator, NULL, 0);
+    CHECK(!ubjson_ctx_create_object(&ctx));
+    ubjson_ctx_free(&ctx);
+
+    // The copy of the source and the array's values are allocated, then its cursor isn't
+    static char const array[] = "[#U\x01U\x05";
+    left = 2;
+    ubjson_ctx_init_allocator(&ctx, &allocator, array, sizeof(array) - 1);
+    CHECK(!ubjson_ctx_parse(&ctx));
+    ubjson_ctx_free(&ctx);
+}
+
+// A string split between chunks which can't be kept fails the reader rather than writing through NULL.
+static void test_reader_pending_fails(void)
+{
+    static char const chunk[] = "[Si\x05" "ab";
+    size_t left = 0;
+    struct ubjson_reader reader;
+    ubjson_reader_init(&reader);
+    reader.allocator = (struct ubjson_allocator){ test_bounded_alloc, test_bounded_realloc, test_bounded_free, &left };
+    ubjson_reader_feed(&reader, chunk, sizeof(chunk) - 1);
+    CHECK(ubjson_reader_next(&reader) == UBJSON_EVENT_BEGIN_ARRAY);
+    CHECK(ubjson_reader_next(&reader) == UBJSON_EVENT_ERROR);
+    CHECK(ubjson_reader_next(&reader) == UBJSON_EVENT_ERROR);
+    ubjson_reader_free(&reader);
+}
+
+// Describes the events the reader sends for `stream`, fed `first` bytes and then `step` at a time. Each document's end
+// is given with where it was found, which is how foobard and command_server frame messages.
+static void test_reader_events(char const *stream, size_t size, size_t first, size_t step, char *out, size_t capacity)
+{
+    struct ubjson_reader reader;
+    ubjson_reader_init(&reader);
+    size_t used = 0;
+    size_t fed = 0;
+    out[0] = '\0';
+    while (fed < size)
+    {
+        size_t chunk = fed ? step : first;
+        chunk = chunk < size - fed ? chunk : size - fed;
+        ubjson_reader_feed(&reader, stream + fed, chunk);
+        fed += chunk;
+
+        enum ubjson_event event;
+        while ((event = ubjson_reader_next(&reader)) != UBJSON_EVENT_NEED_MORE && used < capacity)
+        {
+            struct ubjson_value const *value = &reader.value;
+            int written = 0;
+            switch (event)
+            {
+            case UBJSON_EVENT_ERROR:
+                written = snprintf(out + used, capacity - used, "error ");
+                break;
+            case UBJSON_EVENT_BEGIN_OBJECT:
+            case UBJSON_EVENT_BEGIN_ARRAY:
+                written = snprintf(out + used, capacity - used, "%c ", event == UBJSON_EVENT_BEGIN_OBJECT ? '{' : '[');
+                break;
+            case UBJSON_EVENT_END_OBJECT:
+            case UBJSON_EVENT_END_ARRAY:
+                written = snprintf(out + used, capacity - used, "%c", event == UBJSON_EVENT_END_OBJECT ? '}' : ']');
+                if (!reader.depth)
+                    written += snprintf(out + used + written, capacity - used - written, "@%zu",
+                                        (size_t)(reader.buf + reader.index - stream));
+                written += snprintf(out + used + written, capacity - used - written, " ");
+                break;
+            case UBJSON_EVENT_KEY:
+                written = snprintf(out + used, capacity - used, "%.*s:", (int)reader.string_length, reader.string);
+                break;
+            case UBJSON_EVENT_VALUE:
+                if (value->type == UBJSON_TYPE_STRING)
+                    written = snprintf(out + used, capacity - used, "'%.*s' ", (int)reader.string_length, reader.string);
+                else if (value->type == UBJSON_TYPE_TYPED_ARRAY)
+                {
+                    u8 const *bytes = value->v.typed_array.data;
+                    written = snprintf(out + used, capacity - used, "<");
+                    for (size_t i = 0; i < value->v.typed_array.count; i++)
+                        written += snprintf(out + used + written, capacity - used - written, "%d", bytes[i]);
+                    written += snprintf(out + used + written, capacity - used - written, "> ");
+                }
+                else if (value->type == UBJSON_TYPE_INT8)
+                    written = snprintf(out + used, capacity - used, "%d ", value->v.int8);
+                else if (value->type == UBJSON_TYPE_INT32)
+                    written = snprintf(out + used, capacity - used, "%ld ", (long)value->v.int32);
+                else
+                    written = snprintf(out + used, capacity - used, "type%d ", (int)value->type);
+                break;
+            default:
+                break;
+            }
+            used += written;
+        }
+    }
+    ubjson_reader_free(&reader);
+}
+
+// Chunks can end anywhere, in the middle of a key, a string, a count header or a `[$U#` blob, and the reader sends the
+// same events as for the whole stream at once.
+static void test_reader_chunks(void)
+{
+    static char const stream[] = "{i\x05" "titleSi\x07" "Playingi\x03" "ids[#i\x02" "Si\x01" "aSi\x02" "bci\x04"
+                                 "blob[$U#i\x04" "\x01\x02\x03\x04" "i\x03" "numl\x00\x01\x00\x00}"
+                                 "[$i#i\x03" "\x01\x02\x03" "{i\x01" "xZ}";
+    static char const expected[] = "{ title:'Playing' ids:[ 'a' 'bc' ] blob:<1234> num:65536 }@63 [ 1 2 3 ]@72 "
+                                   "{ x:type0 }@78 ";
+    size_t size = sizeof(stream) - 1;
+    char whole[256];
+    char split[256];
+
+    test_reader_events(stream, size, size, size, whole, sizeof(whole));
+    CHECK(!strcmp(whole, expected));
+
+    test_reader_events(stream, size, 1, 1, split, sizeof(split));
+    CHECK(!strcmp(split, expected));
+
+    for (size_t first = 1; first < size; first++)
+    {
+        test_reader_events(stream, size, first, size, split, sizeof(split));
+        CHECK(!strcmp(split, expected));
+    }
+}
+
+// Integers take the smallest marker they fit, on both sides of each boundary.
+static void test_writer_int_markers(void)
+{
+    static struct
+    {
+        i64 value;
+        char const *bytes;
+        size_t length;
+    } const cases[] = {
+        { 127, "i\x7f", 2 },
+        { 128, "U\x80", 2 },
+        { 255, "U\xff", 2 },
+        { 256, "I\x01\x00", 3 },
+        { -128, "i\x80", 2 },
+        { -129, "I\xff\x7f", 3 },
+        { INT16_MAX, "I\x7f\xff", 3 },
+        { (i64)INT16_MAX + 1, "l\x00\x00\x80\x00", 5 },
+        { INT16_MIN, "I\x80\x00", 3 },
+        { (i64)INT16_MIN - 1, "l\xff\xff\x7f\xff", 5 },
+        { INT32_MAX, "l\x7f\xff\xff\xff", 5 },
+        { (i64)INT32_MAX + 1, "L\x00\x00\x00\x00\x80\x00\x00\x00", 9 },
+        { INT32_MIN, "l\x80\x00\x00\x00", 5 },
+        { (i64)INT32_MIN - 1, "L\xff\xff\xff\xff\x7f\xff\xff\xff", 9 },
+    };
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(*cases); i++)
+    {
+        struct ubjson_writer writer;
+        ubjson_writer_init(&writer, NULL, 0);
+        CHECK(ubjson_writer_int(&writer, cases[i].value));
+        CHECK(writer.len == cases[i].length && !memcmp(writer.buf, cases[i].bytes, cases[i].length));
+        ubjson_writer_free(&writer);
+    }
+}
+
+// A document which outgrows the caller's buffer carries on in allocated memory, with what was already written.
+static void test_writer_grows(void)
+{
+    static char const expected[] = "{i\x01" "kSi\x0a" "value12345}";
+    char buf[8];
+    struct ubjson_writer writer;
+    ubjson_writer_init(&writer, buf, sizeof(buf));
+
+    CHECK(ubjson_writer_begin_object(&writer) && ubjson_writer_key(&writer, "k"));
+    CHECK(writer.buf == buf && !writer.owned);
+    CHECK(ubjson_writer_string(&writer, "value12345") && ubjson_writer_end_object(&writer));
+    CHECK(writer.buf != buf && writer.owned && writer.capacity >= writer.len);
+    CHECK(writer.len == sizeof(expected) - 1 && !memcmp(writer.buf, expected, writer.len));
+    ubjson_writer_free(&writer);
+}
+
+// Once the buffer can't grow, that write and every one after it are dropped until the writer is reset.
+static void test_writer_alloc_fails(void)
+{
+    char big[300];
+    memset(big, 'x', sizeof(big) - 1);
+    big[sizeof(big) - 1] = '\0';
+
+    size_t left = 1;
+    struct ubjson_writer writer;
+    ubjson_writer_init(&writer, NULL, 0);
+    writer.allocator = (struct ubjson_allocator){ test_bounded_alloc, test_bounded_realloc, test_bounded_free, &left };
+
+    CHECK(ubjson_writer_begin_array(&writer) && writer.owned);
+    CHECK(!ubjson_writer_string(&writer, big));
+    CHECK(writer.failed && writer.len == 1);
+    CHECK(!ubjson_writer_null(&writer) && !ubjson_writer_end_array(&writer));
+    CHECK(writer.failed && writer.len == 1);
+
+    ubjson_writer_reset(&writer);
+    CHECK(!writer.failed && ubjson_writer_null(&writer) && writer.len == 1 && writer.buf[0] == 'Z');
+    ubjson_writer_free(&writer);
+}
+
+// A ctx which is reset for each message stops allocating once it has seen one of the shape, and gives back what a
+// message bigger than UBJSON_CTX_RETAIN_MAX needed.
+static void test_reset_reuses(void)
+{
+    static char const message[] = "{i\x05" "eventSi\x06" "updatei\x06" "artist[Si\x02" "A1Si\x02" "A2]i\x04"
+                                  "tags{i\x01" "aTi\x01" "bF}i\x03" "raw[$U#i\x03" "\x01\x02\x03}";
+    struct ubjson_counter counter = { 0 };
+    struct ubjson_allocator allocator = ubjson_allocator_counting(&counter);
+    struct ubjson_ctx ctx;
+    ubjson_ctx_init_allocator(&ctx, &allocator, NULL, 0);
+
+    for (int i = 0; i < 2; i++)
+    {
+        ubjson_ctx_reset(&ctx, message, sizeof(message) - 1);
+        CHECK(ubjson_ctx_parse(&ctx) && ubjson_ctx_terminate(&ctx));
+    }
+    size_t allocations = counter.allocations;
+    size_t current = counter.current;
+    for (int i = 0; i < 16; i++)
+    {
+        ubjson_ctx_reset(&ctx, message, sizeof(message) - 1);
+        CHECK(ubjson_ctx_parse(&ctx) && ubjson_ctx_terminate(&ctx));
+    }
+    CHECK(counter.allocations == allocations);
+    CHECK(counter.current == current);
+
+    // A title bigger than what's kept makes both the source and its terminated copy too big to keep
+    size_t title = UBJSON_CTX_RETAIN_MAX + 1;
+    struct ubjson_writer writer;
+    ubjson_writer_init(&writer, NULL, 0);
+    char *big = malloc(title + 1);
+    CHECK(big);
+    if (big)
+    {
+        memset(big, 't', title);
+        big[title] = '\0';
+        ubjson_writer_begin_object(&writer);
+        ubjson_writer_key(&writer, "title");
+        ubjson_writer_string(&writer, big);
+        ubjson_writer_end_object(&writer);
+        free(big);
+    }
+    CHECK(!writer.failed);
+
+    ubjson_ctx_reset(&ctx, writer.buf, writer.len);
+    CHECK(ubjson_ctx_parse(&ctx) && ubjson_ctx_terminate(&ctx));
+    CHECK(counter.current > current + UBJSON_CTX_RETAIN_MAX);
+    ubjson_writer_free(&writer);
+
+    ubjson_ctx_reset(&ctx, message, sizeof(message) - 1);
+    CHECK(ctx.src_capacity <= UBJSON_CTX_RETAIN_MAX && ctx.strings_capacity <= UBJSON_CTX_RETAIN_MAX);
+    CHECK(ubjson_ctx_parse(&ctx) && ubjson_ctx_terminate(&ctx));
+    CHECK(counter.current <= current);
+
+    ubjson_ctx_free(&ctx);
+    CHECK(counter.current == 0);
+}
+
+// A block too large to allocate, or a size which would overflow once rounded up, fails the allocation, and the arena
+// goes on working.
+static void test_arena_alloc_fails(void)
+{
+    struct ubjson_arena arena;
+    ubjson_arena_init(&arena, 0);
+    void *small = ubjson_arena_alloc(&arena, 16);
+    CHECK(small);
+    CHECK(!ubjson_arena_alloc(&arena, SIZE_MAX / 4));
+    CHECK(!ubjson_arena_realloc(&arena, small, 16, SIZE_MAX / 4));
+    for (size_t size = SIZE_MAX - 64; size >= SIZE_MAX - 64; size++)
+    {
+        CHECK(!ubjson_arena_alloc(&arena, size));
+        CHECK(!ubjson_arena_realloc(&arena, small, 16, size));
+    }
+    CHECK(ubjson_arena_alloc(&arena, 16));
+    ubjson_arena_free(&arena);
+
+    // A block size too big to add a header to is taken as no more than the allocation needs
+    ubjson_arena_init(&arena, SIZE_MAX);
+    CHECK(ubjson_arena_alloc(&arena, 16));
+    ubjson_arena_free(&arena);
+}
+
+int main(void)
+{
+    test_counted_root();
+    test_render_exact();
+    test_string_views();
+    test_typed_swap_source();
+    test_cursor_alloc_fails();
+    test_arena_alloc_fails();
+    test_reader_pending_fails();
+    test_reader_chunks();
+    test_writer_int_markers();
+    test_writer_grows();
+    test_writer_alloc_fails();
+    test_reset_reuses();
+
+    if (failures)
+        fprintf(stderr, "%d checks failed\n", failures);
+    return failures != 0;
+}
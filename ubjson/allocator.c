@@ -0,0 +1,235 @@
+// Copyright (c) 2023 Ally Sommers
+// This code is licensed under the BSD 3-Clause License. A copy of this license
+// is included in the repository.
+
+#include "ubjson.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static void *ubjson_libc_alloc(void *user, size_t size)
+{
+    return malloc(size);
+}
+
+static void *ubjson_libc_realloc(void *user, void *ptr, size_t old_size, size_t size)
+{
+    return realloc(ptr, size);
+}
+
+static void ubjson_libc_free(void *user, void *ptr)
+{
+    free(ptr);
+}
+
+static struct ubjson_allocator const ubjson_libc = { ubjson_libc_alloc, ubjson_libc_realloc, ubjson_libc_free, NULL };
+static struct ubjson_allocator ubjson_default = { ubjson_libc_alloc, ubjson_libc_realloc, ubjson_libc_free, NULL };
+
+struct ubjson_allocator ubjson_allocator_libc(void)
+{
+    return ubjson_libc;
+}
+
+void ubjson_set_default_allocator(struct ubjson_allocator const *allocator)
+{
+    ubjson_default = allocator ? *allocator : ubjson_libc;
+}
+
+struct ubjson_allocator ubjson_default_allocator(void)
+{
+    return ubjson_default;
+}
+
+// Kept in front of each counted allocation, padded so what follows is as aligned as malloc()'s
+union ubjson_counter_header
+{
+    size_t size;
+    long double align_float;
+    long long align_int;
+    void *align_pointer;
+};
+
+static struct ubjson_allocator const *ubjson_counter_backing(struct ubjson_counter *counter)
+{
+    // Not the default allocator, which may well be this counter
+    if (!counter->backing.alloc)
+        counter->backing = ubjson_libc;
+    return &counter->backing;
+}
+
+static void ubjson_counter_add(struct ubjson_counter *counter, size_t size)
+{
+    counter->current += size;
+    counter->total += size;
+    counter->allocations++;
+    if (counter->current > counter->peak)
+        counter->peak = counter->current;
+}
+
+static void *ubjson_counter_alloc(void *user, size_t size)
+{
+    struct ubjson_counter *counter = user;
+    union ubjson_counter_header *header =
+        ubjson_counter_backing(counter)->alloc(counter->backing.user, sizeof(*header) + size);
+    if (!header)
+        return NULL;
+
+    header->size = size;
+    ubjson_counter_add(counter, size);
+    return header + 1;
+}
+
+static void *ubjson_counter_realloc(void *user, void *ptr, size_t old_size, size_t size)
+{
+    struct ubjson_counter *counter = user;
+    union ubjson_counter_header *header = (union ubjson_counter_header *)ptr - 1;
+    old_size = header->size;
+
+    header = ubjson_counter_backing(counter)->realloc(counter->backing.user, header, sizeof(*header) + old_size,
+                                                      sizeof(*header) + size);
+    if (!header)
+        return NULL;
+
+    header->size = size;
+    counter->current -= old_size;
+    ubjson_counter_add(counter, size);
+    return header + 1;
+}
+
+static void ubjson_counter_free(void *user, void *ptr)
+{
+    struct ubjson_counter *counter = user;
+    union ubjson_counter_header *header = (union ubjson_counter_header *)ptr - 1;
+
+    counter->current -= header->size;
+    if (ubjson_counter_backing(counter)->free)
+        counter->backing.free(counter->backing.user, header);
+}
+
+struct ubjson_allocator ubjson_allocator_counting(struct ubjson_counter *counter)
+{
+    struct ubjson_allocator allocator = { ubjson_counter_alloc, ubjson_counter_realloc, ubjson_counter_free, counter };
+    return allocator;
+}
+
+void *ubjson_allocator_realloc(struct ubjson_allocator const *allocator, void *ptr, size_t old_size, size_t size)
+{
+    if (!ptr)
+        return allocator->alloc(allocator->user, size);
+    return allocator->realloc(allocator->user, ptr, old_size, size);
+}
+
+void ubjson_allocator_free(struct ubjson_allocator const *allocator, void *ptr)
+{
+    if (ptr && allocator->free)
+        allocator->free(allocator->user, ptr);
+}
+
+void *ubjson_ctx_alloc(struct ubjson_ctx *ctx, size_t size)
+{
+    return ctx->allocator.alloc(ctx->allocator.user, size);
+}
+
+void *ubjson_ctx_calloc(struct ubjson_ctx *ctx, size_t size)
+{
+    void *ptr = ubjson_ctx_alloc(ctx, size);
+    if (ptr)
+        memset(ptr, 0, size);
+    return ptr;
+}
+
+void *ubjson_ctx_realloc(struct ubjson_ctx *ctx, void *ptr, size_t old_size, size_t size)
+{
+    return ubjson_allocator_realloc(&ctx->allocator, ptr, old_size, size);
+}
+
+void ubjson_ctx_release(struct ubjson_ctx *ctx, void *ptr)
+{
+    ubjson_allocator_free(&ctx->allocator, ptr);
+}
+
+void ubjson_ctx_recycle(struct ubjson_ctx *ctx, void *ptr, size_t size)
+{
+    if (!ptr)
+        return;
+    if (size > UBJSON_CTX_RETAIN_MAX)
+    {
+        ubjson_ctx_release(ctx, ptr);
+        return;
+    }
+
+    if (ctx->spare_count < UBJSON_CTX_SPARES)
+    {
+        ctx->spares[ctx->spare_count++] = (struct ubjson_spare) { ptr, size };
+        return;
+    }
+
+    // Full, so the smallest goes, which may be this one
+    size_t smallest = 0;
+    for (size_t i = 1; i < ctx->spare_count; i++)
+    {
+        if (ctx->spares[i].size < ctx->spares[smallest].size)
+            smallest = i;
+    }
+    if (ctx->spares[smallest].size >= size)
+    {
+        ubjson_ctx_release(ctx, ptr);
+        return;
+    }
+    ubjson_ctx_release(ctx, ctx->spares[smallest].data);
+    ctx->spares[smallest] = (struct ubjson_spare) { ptr, size };
+}
+
+void *ubjson_ctx_reuse(struct ubjson_ctx *ctx, size_t size, size_t *spare_size)
+{
+    size_t best = ctx->spare_count;
+    for (size_t i = 0; i < ctx->spare_count; i++)
+    {
+        if (ctx->spares[i].size >= size && (best == ctx->spare_count || ctx->spares[i].size < ctx->spares[best].size))
+            best = i;
+    }
+    if (best == ctx->spare_count)
+        return NULL;
+
+    void *data = ctx->spares[best].data;
+    *spare_size = ctx->spares[best].size;
+    ctx->spares[best] = ctx->spares[--ctx->spare_count];
+    return data;
+}
+
+struct ubjson_collection_list *ubjson_ctx_new_cursor(struct ubjson_ctx *ctx)
+{
+    struct ubjson_collection_list *cursor = ctx->spare_cursors;
+    if (!cursor)
+        return ubjson_ctx_calloc(ctx, sizeof(*cursor));
+
+    ctx->spare_cursors = cursor->parent;
+    memset(cursor, 0, sizeof(*cursor));
+    return cursor;
+}
+
+void ubjson_ctx_drop_cursor(struct ubjson_ctx *ctx, struct ubjson_collection_list *cursor)
+{
+    ubjson_ctx_release(ctx, cursor->key_index);
+    cursor->key_index = NULL;
+
+    // An arena's memory may be reset under a cursor kept here, so only an allocator which frees keeps them
+    if (!ctx->allocator.free)
+        return;
+    cursor->parent = ctx->spare_cursors;
+    ctx->spare_cursors = cursor;
+}
+
+void ubjson_ctx_free_spares(struct ubjson_ctx *ctx)
+{
+    for (size_t i = 0; i < ctx->spare_count; i++)
+        ubjson_ctx_release(ctx, ctx->spares[i].data);
+    ctx->spare_count = 0;
+
+    while (ctx->spare_cursors)
+    {
+        struct ubjson_collection_list *next = ctx->spare_cursors->parent;
+        ubjson_ctx_release(ctx, ctx->spare_cursors);
+        ctx->spare_cursors = next;
+    }
+}
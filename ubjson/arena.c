@@ -0,0 +1,139 @@
+// Copyright (c) 2023 Ally Sommers
+// This code is licensed under the BSD 3-Clause License. A copy of this license
+// is included in the repository.
+
+#include "ubjson.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define UBJSON_ARENA_ALIGN 16
+#define UBJSON_ARENA_ALIGNED(n) (((n) + UBJSON_ARENA_ALIGN - 1) & ~(size_t)(UBJSON_ARENA_ALIGN - 1))
+
+struct ubjson_arena_block
+{
+    struct ubjson_arena_block *next;
+    size_t size;
+    size_t used;
+};
+
+#define UBJSON_ARENA_HEADER UBJSON_ARENA_ALIGNED(sizeof(struct ubjson_arena_block))
+// The most that can be asked for at once: anything more overflows once it's rounded up and given a block header
+#define UBJSON_ARENA_SIZE_MAX (SIZE_MAX - UBJSON_ARENA_HEADER - UBJSON_ARENA_ALIGN)
+
+static char *ubjson_arena_data(struct ubjson_arena_block *block)
+{
+    return (char *)block + UBJSON_ARENA_HEADER;
+}
+
+void ubjson_arena_init(struct ubjson_arena *arena, size_t block_size)
+{
+    memset(arena, 0, sizeof(*arena));
+    arena->block_size = block_size ? block_size : UBJSON_ARENA_BLOCK_SIZE;
+}
+
+void ubjson_arena_reset(struct ubjson_arena *arena)
+{
+    // The blocks after the first are emptied as allocation reaches them again
+    arena->current = arena->first;
+    if (arena->first)
+        arena->first->used = 0;
+    arena->last = NULL;
+}
+
+void ubjson_arena_free(struct ubjson_arena *arena)
+{
+    struct ubjson_arena_block *block = arena->first;
+    while (block)
+    {
+        struct ubjson_arena_block *next = block->next;
+        free(block);
+        block = next;
+    }
+    ubjson_arena_init(arena, arena->block_size);
+}
+
+void *ubjson_arena_alloc(struct ubjson_arena *arena, size_t size)
+{
+    if (size > UBJSON_ARENA_SIZE_MAX)
+        return NULL;
+    size = size ? UBJSON_ARENA_ALIGNED(size) : UBJSON_ARENA_ALIGN;
+
+    struct ubjson_arena_block *block = arena->current;
+    struct ubjson_arena_block *tail = block;
+    while (block && size > block->size - block->used)
+    {
+        tail = block;
+        block = block->next;
+        if (block)
+            block->used = 0;
+    }
+
+    if (!block)
+    {
+        size_t block_size = arena->block_size ? arena->block_size : UBJSON_ARENA_BLOCK_SIZE;
+        if (size > block_size || block_size > UBJSON_ARENA_SIZE_MAX)
+            block_size = size;
+        block = malloc(UBJSON_ARENA_HEADER + block_size);
+        if (!block)
+            return NULL;
+        block->next = NULL;
+        block->size = block_size;
+        block->used = 0;
+        if (tail)
+            tail->next = block;
+        else
+            arena->first = block;
+    }
+
+    arena->current = block;
+    char *ptr = ubjson_arena_data(block) + block->used;
+    block->used += size;
+    arena->last = ptr;
+    return ptr;
+}
+
+void *ubjson_arena_realloc(struct ubjson_arena *arena, void *ptr, size_t old_size, size_t size)
+{
+    if (!ptr || size > UBJSON_ARENA_SIZE_MAX)
+        return ubjson_arena_alloc(arena, size);
+
+    // The last allocation grows where it is while its block has room, which is how a render buffer or the array
+    // being filled usually grows
+    if (ptr == arena->last)
+    {
+        size_t offset = (char *)ptr - ubjson_arena_data(arena->current);
+        size_t aligned = size ? UBJSON_ARENA_ALIGNED(size) : UBJSON_ARENA_ALIGN;
+        if (aligned <= arena->current->size - offset)
+        {
+            arena->current->used = offset + aligned;
+            return ptr;
+        }
+    }
+
+    if (size <= old_size)
+        return ptr;
+
+    void *moved = ubjson_arena_alloc(arena, size);
+    if (!moved)
+        return NULL;
+    memcpy(moved, ptr, old_size);
+    return moved;
+}
+
+static void *ubjson_arena_alloc_callback(void *user, size_t size)
+{
+    return ubjson_arena_alloc(user, size);
+}
+
+static void *ubjson_arena_realloc_callback(void *user, void *ptr, size_t old_size, size_t size)
+{
+    return ubjson_arena_realloc(user, ptr, old_size, size);
+}
+
+struct ubjson_allocator ubjson_allocator_arena(struct ubjson_arena *arena)
+{
+    struct ubjson_allocator allocator = { ubjson_arena_alloc_callback, ubjson_arena_realloc_callback, NULL, arena };
+    return allocator;
+}
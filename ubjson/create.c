@@ -7,6 +7,14 @@
 #include <stdlib.h>
 #include <string.h>
 
+static char *ubjson_ctx_strdup(struct ubjson_ctx *ctx, char const *str)
+{
+    size_t size = strlen(str) + 1;
+    char *copy = ubjson_ctx_alloc(ctx, size);
+    memcpy(copy, str, size);
+    return copy;
+}
+
 bool ubjson_ctx_enter_collection(struct ubjson_ctx *ctx)
 {
     struct ubjson_value next;
@@ -37,8 +45,11 @@ bool ubjson_ctx_enter_collection(struct ubjson_ctx *ctx)
     if (next.type != UBJSON_TYPE_OBJECT && next.type != UBJSON_TYPE_ARRAY)
         return false;
 
+    struct ubjson_collection_list *cursor = ubjson_ctx_new_cursor(ctx);
+    if (!cursor)
+        return false;
     struct ubjson_collection_list *parent = ctx->current;
-    ctx->current = calloc(sizeof(*ctx->current), 1);
+    ctx->current = cursor;
     ctx->current->parent = parent;
 
     if (next.type == UBJSON_TYPE_OBJECT)
@@ -81,7 +92,7 @@ bool ubjson_ctx_exit_collection(struct ubjson_ctx *ctx)
         }
     }
 
-    free(ctx->current);
+    ubjson_ctx_drop_cursor(ctx, ctx->current);
     ctx->current = parent;
 
     return true;
@@ -92,22 +103,25 @@ bool ubjson_ctx_add_kv_pair(struct ubjson_ctx *ctx, char const *key, struct ubjs
     if (ctx->current->type != UBJSON_TYPE_OBJECT)
         return false;
 
-    char *key_copy = malloc(strlen(key) + 1);
-    strcpy(key_copy, key);
-    struct ubjson_kv_pair kv = { key_copy, value };
+    struct ubjson_object *object = &ctx->current->collection.object;
+    struct ubjson_kv_pair kv = { ubjson_ctx_strdup(ctx, key), strlen(key), value };
 
-    if (ctx->current->collection.object.count + 1 > ctx->current->collection.object.capacity)
+    // The index of the keys doesn't have this one
+    if (ctx->current->key_index)
     {
-        if (ctx->current->collection.object.capacity)
-            ctx->current->collection.object.capacity *= 2;
-        else
-            ctx->current->collection.object.capacity = 4;
-        ctx->current->collection.object.kv_pairs =
-            realloc(ctx->current->collection.object.kv_pairs,
-                    sizeof(*ctx->current->collection.object.kv_pairs) * ctx->current->collection.object.capacity);
+        ubjson_ctx_release(ctx, ctx->current->key_index);
+        ctx->current->key_index = NULL;
     }
 
-    ctx->current->collection.object.kv_pairs[ctx->current->collection.object.count++] = kv;
+    if (object->count + 1 > object->capacity)
+    {
+        size_t capacity = object->capacity ? object->capacity * 2 : 4;
+        object->kv_pairs = ubjson_ctx_realloc(ctx, object->kv_pairs, sizeof(*object->kv_pairs) * object->capacity,
+                                              sizeof(*object->kv_pairs) * capacity);
+        object->capacity = capacity;
+    }
+
+    object->kv_pairs[object->count++] = kv;
 
     return true;
 }
@@ -146,35 +160,74 @@ bool ubjson_ctx_add_kv_pair_character(struct ubjson_ctx *ctx, char const *key, u
 
 bool ubjson_ctx_add_kv_pair_string(struct ubjson_ctx *ctx, char const *key, char const *value)
 {
-    char *value_copy = malloc(strlen(value) + 1);
-    strcpy(value_copy, value);
-    struct ubjson_value param = { .v.string = value_copy, .type = UBJSON_TYPE_STRING };
+    struct ubjson_value param = { .v.string = ubjson_ctx_strdup(ctx, value), .length = strlen(value),
+                                  .type = UBJSON_TYPE_STRING };
+    if (!ubjson_ctx_add_kv_pair(ctx, key, param))
+    {
+        ubjson_ctx_release(ctx, param.v.string);
+        return false;
+    }
+
+    return true;
+}
+
+// Copies `data` for a typed array value
+static bool ubjson_ctx_typed_array_value(struct ubjson_ctx *ctx, struct ubjson_value *value, enum ubjson_type type,
+                                         void const *data, size_t count)
+{
+    size_t size = ubjson_typed_width(type) * count;
+    if (!ubjson_typed_width(type))
+        return false;
+
+    value->v.typed_array.data = ubjson_ctx_alloc(ctx, size ? size : 1);
+    if (!value->v.typed_array.data)
+        return false;
+    if (size)
+        memcpy(value->v.typed_array.data, data, size);
+    value->v.typed_array.count = count;
+    value->v.typed_array.type = type;
+    value->v.typed_array.owned = true;
+    value->type = UBJSON_TYPE_TYPED_ARRAY;
+    return true;
+}
+
+bool ubjson_ctx_add_kv_pair_typed_array(struct ubjson_ctx *ctx, char const *key, enum ubjson_type type,
+                                        void const *data, size_t count)
+{
+    struct ubjson_value param;
+    if (!ubjson_ctx_typed_array_value(ctx, &param, type, data, count))
+        return false;
     if (!ubjson_ctx_add_kv_pair(ctx, key, param))
     {
-        free(value_copy);
+        ubjson_ctx_release(ctx, param.v.typed_array.data);
         return false;
     }
 
     return true;
 }
 
+bool ubjson_ctx_add_kv_pair_blob(struct ubjson_ctx *ctx, char const *key, void const *data, size_t length)
+{
+    struct ubjson_value param = { .v.typed_array = { (void *)data, length, UBJSON_TYPE_UINT8, false },
+                                  .type = UBJSON_TYPE_TYPED_ARRAY };
+    return ubjson_ctx_add_kv_pair(ctx, key, param);
+}
+
 bool ubjson_ctx_add(struct ubjson_ctx *ctx, struct ubjson_value value)
 {
     if (ctx->current->type != UBJSON_TYPE_ARRAY)
         return false;
 
-    if (ctx->current->collection.array.count + 1 > ctx->current->collection.array.capacity)
+    struct ubjson_array *array = &ctx->current->collection.array;
+    if (array->count + 1 > array->capacity)
     {
-        if (ctx->current->collection.array.capacity)
-            ctx->current->collection.array.capacity *= 2;
-        else
-            ctx->current->collection.array.capacity = 4;
-        ctx->current->collection.array.values =
-            realloc(ctx->current->collection.array.values,
-                    sizeof(*ctx->current->collection.array.values) * ctx->current->collection.array.capacity);
+        size_t capacity = array->capacity ? array->capacity * 2 : 4;
+        array->values = ubjson_ctx_realloc(ctx, array->values, sizeof(*array->values) * array->capacity,
+                                           sizeof(*array->values) * capacity);
+        array->capacity = capacity;
     }
 
-    ctx->current->collection.array.values[ctx->current->collection.array.count++] = value;
+    array->values[array->count++] = value;
 
     return true;
 }
@@ -213,28 +266,54 @@ bool ubjson_ctx_add_character(struct ubjson_ctx *ctx, u8 value)
 
 bool ubjson_ctx_add_string(struct ubjson_ctx *ctx, char const *value)
 {
-    char *value_copy = malloc(strlen(value) + 1);
-    strcpy(value_copy, value);
-    struct ubjson_value param = { .v.string = value_copy, .type = UBJSON_TYPE_STRING };
+    struct ubjson_value param = { .v.string = ubjson_ctx_strdup(ctx, value), .length = strlen(value),
+                                  .type = UBJSON_TYPE_STRING };
+    if (!ubjson_ctx_add(ctx, param))
+    {
+        ubjson_ctx_release(ctx, param.v.string);
+        return false;
+    }
+
+    return true;
+}
+
+bool ubjson_ctx_add_typed_array(struct ubjson_ctx *ctx, enum ubjson_type type, void const *data, size_t count)
+{
+    struct ubjson_value param;
+    if (!ubjson_ctx_typed_array_value(ctx, &param, type, data, count))
+        return false;
     if (!ubjson_ctx_add(ctx, param))
     {
-        free(value_copy);
+        ubjson_ctx_release(ctx, param.v.typed_array.data);
         return false;
     }
 
     return true;
 }
 
+bool ubjson_ctx_add_blob(struct ubjson_ctx *ctx, void const *data, size_t length)
+{
+    struct ubjson_value param = { .v.typed_array = { (void *)data, length, UBJSON_TYPE_UINT8, false },
+                                  .type = UBJSON_TYPE_TYPED_ARRAY };
+    return ubjson_ctx_add(ctx, param);
+}
+
 bool ubjson_ctx_create_object(struct ubjson_ctx *ctx)
 {
-    ctx->current = calloc(sizeof(*ctx->current), 1);
+    struct ubjson_collection_list *cursor = ubjson_ctx_new_cursor(ctx);
+    if (!cursor)
+        return false;
+    ctx->current = cursor;
     ctx->current->type = UBJSON_TYPE_OBJECT;
     return true;
 }
 
 bool ubjson_ctx_create_array(struct ubjson_ctx *ctx)
 {
-    ctx->current = calloc(sizeof(*ctx->current), 1);
+    struct ubjson_collection_list *cursor = ubjson_ctx_new_cursor(ctx);
+    if (!cursor)
+        return false;
+    ctx->current = cursor;
     ctx->current->type = UBJSON_TYPE_ARRAY;
     return true;
 }
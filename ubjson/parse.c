@@ -20,65 +20,110 @@
 #include <string.h>
 
 void ubjson_ctx_init(struct ubjson_ctx *ctx, char const *buf, size_t size)
+{
+    struct ubjson_allocator allocator = ubjson_default_allocator();
+    ubjson_ctx_init_allocator(ctx, &allocator, buf, size);
+}
+
+void ubjson_ctx_init_allocator(struct ubjson_ctx *ctx, struct ubjson_allocator const *allocator, char const *buf,
+                               size_t size)
 {
     memset(ctx, 0, sizeof(*ctx));
+    ctx->allocator = *allocator;
 
     if (buf && size)
     {
-        ctx->src_buf = malloc(size);
+        ctx->src_buf = ubjson_ctx_alloc(ctx, size);
         memcpy(ctx->src_buf, buf, size);
         ctx->src_len = size;
+        ctx->src_capacity = size;
     }
 }
 
-void ubjson_free_object(struct ubjson_object object);
-void ubjson_free_array(struct ubjson_array array);
+void ubjson_ctx_init_arena(struct ubjson_ctx *ctx, struct ubjson_arena *arena, char const *buf, size_t size)
+{
+    struct ubjson_allocator allocator = ubjson_allocator_arena(arena);
+    ubjson_ctx_init_allocator(ctx, &allocator, buf, size);
+}
 
-void ubjson_free_object(struct ubjson_object object)
+void ubjson_ctx_init_in_place(struct ubjson_ctx *ctx, char *buf, size_t size, bool take)
 {
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->allocator = ubjson_default_allocator();
+    ctx->src_buf = buf;
+    ctx->src_len = size;
+    ctx->src_borrowed = !take;
+    if (take)
+        ctx->src_capacity = size;
+}
+
+// Parsed strings live in the source buffer, so only a created tree's strings are freed.
+void ubjson_free_object(struct ubjson_ctx *ctx, struct ubjson_object object, bool free_strings);
+void ubjson_free_array(struct ubjson_ctx *ctx, struct ubjson_array array, bool free_strings);
+
+void ubjson_free_object(struct ubjson_ctx *ctx, struct ubjson_object object, bool free_strings)
+{
+    // Nothing is freed one by one with an allocator like an arena's
+    if (!ctx->allocator.free)
+        return;
+
     for (size_t i = 0; i < object.count; i++)
     {
-        free(object.kv_pairs[i].key);
+        if (free_strings)
+            ubjson_ctx_release(ctx, object.kv_pairs[i].key);
         switch (object.kv_pairs[i].value.type)
         {
         case UBJSON_TYPE_OBJECT:
-            ubjson_free_object(object.kv_pairs[i].value.v.object);
+            ubjson_free_object(ctx, object.kv_pairs[i].value.v.object, free_strings);
             break;
         case UBJSON_TYPE_ARRAY:
-            ubjson_free_array(object.kv_pairs[i].value.v.array);
+            ubjson_free_array(ctx, object.kv_pairs[i].value.v.array, free_strings);
             break;
         case UBJSON_TYPE_STRING:
-            free(object.kv_pairs[i].value.v.string);
+            if (free_strings)
+                ubjson_ctx_release(ctx, object.kv_pairs[i].value.v.string);
+            break;
+        case UBJSON_TYPE_TYPED_ARRAY:
+            if (object.kv_pairs[i].value.v.typed_array.owned)
+                ubjson_ctx_release(ctx, object.kv_pairs[i].value.v.typed_array.data);
             break;
         default:
             break;
         }
     }
 
-    free(object.kv_pairs);
+    ubjson_ctx_recycle(ctx, object.kv_pairs, sizeof(*object.kv_pairs) * object.capacity);
 }
 
-void ubjson_free_array(struct ubjson_array array)
+void ubjson_free_array(struct ubjson_ctx *ctx, struct ubjson_array array, bool free_strings)
 {
+    if (!ctx->allocator.free)
+        return;
+
     for (size_t i = 0; i < array.count; i++)
     {
         switch (array.values[i].type)
         {
         case UBJSON_TYPE_OBJECT:
-            ubjson_free_object(array.values[i].v.object);
+            ubjson_free_object(ctx, array.values[i].v.object, free_strings);
             break;
         case UBJSON_TYPE_ARRAY:
-            ubjson_free_array(array.values[i].v.array);
+            ubjson_free_array(ctx, array.values[i].v.array, free_strings);
             break;
         case UBJSON_TYPE_STRING:
-            free(array.values[i].v.string);
+            if (free_strings)
+                ubjson_ctx_release(ctx, array.values[i].v.string);
+            break;
+        case UBJSON_TYPE_TYPED_ARRAY:
+            if (array.values[i].v.typed_array.owned)
+                ubjson_ctx_release(ctx, array.values[i].v.typed_array.data);
             break;
         default:
             break;
         }
     }
 
-    free(array.values);
+    ubjson_ctx_recycle(ctx, array.values, sizeof(*array.values) * array.capacity);
 }
 
 void ubjson_ctx_free_creation(struct ubjson_ctx *ctx)
@@ -92,38 +137,110 @@ void ubjson_ctx_free_creation(struct ubjson_ctx *ctx)
         {
             if (ctx->current->type == UBJSON_TYPE_OBJECT)
             {
-                ubjson_free_object(ctx->current->collection.object);
+                ubjson_free_object(ctx, ctx->current->collection.object, true);
             }
             if (ctx->current->type == UBJSON_TYPE_ARRAY)
             {
-                ubjson_free_array(ctx->current->collection.array);
+                ubjson_free_array(ctx, ctx->current->collection.array, true);
             }
         }
 
-        free(ctx->current);
+        ubjson_ctx_drop_cursor(ctx, ctx->current);
+        ctx->current = NULL;
     }
 }
 
-void ubjson_ctx_free(struct ubjson_ctx *ctx)
+// The parsed document and anything created, whose arrays and cursors go to the spares.
+static void ubjson_ctx_free_tree(struct ubjson_ctx *ctx)
 {
     if (ctx->root.type == UBJSON_TYPE_OBJECT)
     {
-        ubjson_free_object(ctx->root.collection.object);
+        ubjson_free_object(ctx, ctx->root.collection.object, false);
     }
     if (ctx->root.type == UBJSON_TYPE_ARRAY)
     {
-        ubjson_free_array(ctx->root.collection.array);
+        ubjson_free_array(ctx, ctx->root.collection.array, false);
     }
-
-    free(ctx->src_buf);
-    free(ctx->render_buf);
+    memset(&ctx->root, 0, sizeof(ctx->root));
 
     ubjson_ctx_free_creation(ctx);
 }
 
+void ubjson_ctx_free(struct ubjson_ctx *ctx)
+{
+    if (!ctx->allocator.free)
+        return;
+
+    ubjson_ctx_free_tree(ctx);
+
+    if (!ctx->src_borrowed)
+        ubjson_ctx_release(ctx, ctx->src_buf);
+    if (!ctx->render_borrowed)
+        ubjson_ctx_release(ctx, ctx->render_buf);
+    ubjson_ctx_release(ctx, ctx->strings);
+
+    ubjson_ctx_free_spares(ctx);
+}
+
+void ubjson_ctx_reset(struct ubjson_ctx *ctx, char const *buf, size_t size)
+{
+    if (!ctx->allocator.free)
+    {
+        struct ubjson_allocator allocator = ctx->allocator;
+        ubjson_ctx_init_allocator(ctx, &allocator, buf, size);
+        return;
+    }
+
+    ubjson_ctx_free_tree(ctx);
+
+    if (ctx->render_borrowed || ctx->render_capacity > UBJSON_CTX_RETAIN_MAX)
+    {
+        if (!ctx->render_borrowed)
+            ubjson_ctx_release(ctx, ctx->render_buf);
+        ctx->render_buf = NULL;
+        ctx->render_capacity = 0;
+        ctx->render_borrowed = false;
+    }
+    ctx->render_index = 0;
+
+    if (ctx->strings_capacity > UBJSON_CTX_RETAIN_MAX)
+    {
+        ubjson_ctx_release(ctx, ctx->strings);
+        ctx->strings = NULL;
+        ctx->strings_capacity = 0;
+    }
+    ctx->string_bytes = 0;
+    ctx->terminated = false;
+
+    if (ctx->src_borrowed || ctx->src_capacity > UBJSON_CTX_RETAIN_MAX || ctx->src_capacity < size)
+    {
+        if (!ctx->src_borrowed)
+            ubjson_ctx_release(ctx, ctx->src_buf);
+        ctx->src_buf = NULL;
+        ctx->src_capacity = 0;
+        ctx->src_borrowed = false;
+    }
+    ctx->src_len = 0;
+    ctx->src_index = 0;
+    ctx->src_swapped = 0;
+
+    if (buf && size)
+    {
+        if (!ctx->src_buf)
+        {
+            ctx->src_buf = ubjson_ctx_alloc(ctx, size);
+            if (!ctx->src_buf)
+                return;
+            ctx->src_capacity = size;
+        }
+        memcpy(ctx->src_buf, buf, size);
+        ctx->src_len = size;
+    }
+}
+
 char const *ubjson_ctx_consume(struct ubjson_ctx *ctx, size_t count)
 {
-    if (ctx->src_index + count >= ctx->src_len)
+    if (count > ctx->src_len - ctx->src_index)
     {
         ctx->src_index = ctx->src_len;
         return NULL;
@@ -132,49 +249,110 @@ char const *ubjson_ctx_consume(struct ubjson_ctx *ctx, size_t count)
     return ctx->src_buf + ctx->src_index - count;
 }
 
+// The next byte, or '\0' once the source has run out.
 char ubjson_ctx_peek(struct ubjson_ctx *ctx)
 {
+    if (ctx->src_index >= ctx->src_len)
+        return '\0';
     return ctx->src_buf[ctx->src_index];
 }
 
-bool ubjson_ctx_parse_string(struct ubjson_ctx *ctx, char **str)
+// Copies the next `count` bytes to `out`, which needn't be aligned. Fails if the source ends first, so a frame
+// which was cut short is rejected rather than read past.
+bool ubjson_ctx_take(struct ubjson_ctx *ctx, void *out, size_t count);
+
+bool ubjson_ctx_take(struct ubjson_ctx *ctx, void *out, size_t count)
 {
-    i64 length;
+    char const *src = ubjson_ctx_consume(ctx, count);
+    if (!src)
+        return false;
+    memcpy(out, src, count);
+    return true;
+}
 
-    switch (*ubjson_ctx_consume(ctx, 1))
+// Reads an integer's marker and value, as a string's length or a collection's count is written.
+static bool ubjson_ctx_parse_length(struct ubjson_ctx *ctx, i64 *length)
+{
+    char marker;
+    if (!ubjson_ctx_take(ctx, &marker, 1))
+        return false;
+
+    switch (marker)
     {
     case 'i': // i8
-        length = (i8)*ubjson_ctx_consume(ctx, 1);
+    {
+        i8 n;
+        if (!ubjson_ctx_take(ctx, &n, 1))
+            return false;
+        *length = n;
         break;
+    }
     case 'U': // u8
-        length = (u8)*ubjson_ctx_consume(ctx, 1);
+    {
+        u8 n;
+        if (!ubjson_ctx_take(ctx, &n, 1))
+            return false;
+        *length = n;
         break;
+    }
     case 'I': // i16
-        length = (i16)be16toh(*(i16 *)ubjson_ctx_consume(ctx, 2));
+    {
+        i16 n;
+        if (!ubjson_ctx_take(ctx, &n, 2))
+            return false;
+        *length = (i16)be16toh(n);
         break;
+    }
     case 'l': // i32
-        length = (i32)be32toh(*(i32 *)ubjson_ctx_consume(ctx, 4));
+    {
+        i32 n;
+        if (!ubjson_ctx_take(ctx, &n, 4))
+            return false;
+        *length = (i32)be32toh(n);
         break;
+    }
     case 'L': // i64
-        length = (i64)be64toh(*(i64 *)ubjson_ctx_consume(ctx, 8));
+    {
+        i64 n;
+        if (!ubjson_ctx_take(ctx, &n, 8))
+            return false;
+        *length = (i64)be64toh(n);
         break;
+    }
     default:
         return false;
     }
 
-    *str = malloc(length + 1);
-    memcpy(*str, ubjson_ctx_consume(ctx, length), length);
-    (*str)[length] = '\0';
+    return *length >= 0;
+}
+
+bool ubjson_ctx_parse_string(struct ubjson_ctx *ctx, char **str, size_t *length)
+{
+    i64 prefix;
+    if (!ubjson_ctx_parse_length(ctx, &prefix))
+        return false;
+
+    char const *src = ubjson_ctx_consume(ctx, prefix);
+    if (!src)
+        return false;
 
+    *str = (char *)src;
+    *length = prefix;
+    ctx->string_bytes += *length + 1;
     return true;
 }
 
 bool ubjson_ctx_parse_array(struct ubjson_ctx *ctx, struct ubjson_array *array);
 bool ubjson_ctx_parse_object(struct ubjson_ctx *ctx, struct ubjson_object *object);
+static bool ubjson_ctx_parse_header(struct ubjson_ctx *ctx, char *type, i64 *count);
+static bool ubjson_ctx_parse_elements(struct ubjson_ctx *ctx, char type, i64 count, struct ubjson_array *array);
+static bool ubjson_ctx_parse_typed_array(struct ubjson_ctx *ctx, char type, i64 count,
+                                         struct ubjson_typed_array *array);
 
-bool ubjson_ctx_parse_value(struct ubjson_ctx *ctx, struct ubjson_value *value)
+// Parses the value after `marker`, which a `$`-typed collection's values share instead of having their own.
+static bool ubjson_ctx_parse_payload(struct ubjson_ctx *ctx, char marker, struct ubjson_value *value)
 {
-    switch (*ubjson_ctx_consume(ctx, 1))
+    switch (marker)
     {
     case 'Z': // null
         value->type = UBJSON_TYPE_NULL;
@@ -190,42 +368,54 @@ bool ubjson_ctx_parse_value(struct ubjson_ctx *ctx, struct ubjson_value *value)
         return true;
     case 'i': // i8
         value->type = UBJSON_TYPE_INT8;
-        value->v.int8 = (i8)*ubjson_ctx_consume(ctx, 1);
-        return true;
+        return ubjson_ctx_take(ctx, &value->v.int8, 1);
     case 'U': // u8
         value->type = UBJSON_TYPE_UINT8;
-        value->v.uint8 = (u8)*ubjson_ctx_consume(ctx, 1);
-        return true;
+        return ubjson_ctx_take(ctx, &value->v.uint8, 1);
     case 'I': // i16
         value->type = UBJSON_TYPE_INT16;
-        value->v.int16 = (i16)be16toh(*(i16 *)ubjson_ctx_consume(ctx, 2));
+        if (!ubjson_ctx_take(ctx, &value->v.int16, 2))
+            return false;
+        value->v.int16 = (i16)be16toh(value->v.int16);
         return true;
     case 'l': // i32
         value->type = UBJSON_TYPE_INT32;
-        value->v.int32 = (i32)be32toh(*(i32 *)ubjson_ctx_consume(ctx, 4));
+        if (!ubjson_ctx_take(ctx, &value->v.int32, 4))
+            return false;
+        value->v.int32 = (i32)be32toh(value->v.int32);
         return true;
     case 'L': // i64
         value->type = UBJSON_TYPE_INT64;
-        value->v.int64 = (i64)be64toh(*(i64 *)ubjson_ctx_consume(ctx, 8));
+        if (!ubjson_ctx_take(ctx, &value->v.int64, 8))
+            return false;
+        value->v.int64 = (i64)be64toh(value->v.int64);
         return true;
     case 'd': // float32
         value->type = UBJSON_TYPE_FLOAT32;
-        value->v.float32 = *(float *)ubjson_ctx_consume(ctx, 4);
-        return true;
+        return ubjson_ctx_take(ctx, &value->v.float32, 4);
     case 'D': // float64
         value->type = UBJSON_TYPE_FLOAT64;
-        value->v.float64 = *(double *)ubjson_ctx_consume(ctx, 8);
-        return true;
+        return ubjson_ctx_take(ctx, &value->v.float64, 8);
     case 'C': // char
         value->type = UBJSON_TYPE_CHAR;
-        value->v.character = (u8)*ubjson_ctx_consume(ctx, 1);
-        return true;
+        return ubjson_ctx_take(ctx, &value->v.character, 1);
     case 'S': // string
         value->type = UBJSON_TYPE_STRING;
-        return ubjson_ctx_parse_string(ctx, &value->v.string);
+        return ubjson_ctx_parse_string(ctx, &value->v.string, &value->length);
     case '[':
+    {
+        char type;
+        i64 count;
+        if (!ubjson_ctx_parse_header(ctx, &type, &count))
+            return false;
+        if (ubjson_typed_type(type) != UBJSON_TYPE_NULL)
+        {
+            value->type = UBJSON_TYPE_TYPED_ARRAY;
+            return ubjson_ctx_parse_typed_array(ctx, type, count, &value->v.typed_array);
+        }
         value->type = UBJSON_TYPE_ARRAY;
-        return ubjson_ctx_parse_array(ctx, &value->v.array);
+        return ubjson_ctx_parse_elements(ctx, type, count, &value->v.array);
+    }
     case '{':
         value->type = UBJSON_TYPE_OBJECT;
         return ubjson_ctx_parse_object(ctx, &value->v.object);
@@ -234,84 +424,206 @@ bool ubjson_ctx_parse_value(struct ubjson_ctx *ctx, struct ubjson_value *value)
     }
 }
 
-bool ubjson_ctx_parse_array(struct ubjson_ctx *ctx, struct ubjson_array *array)
+bool ubjson_ctx_parse_value(struct ubjson_ctx *ctx, struct ubjson_value *value)
 {
-    array->values = NULL;
-    array->count = 0;
-    array->capacity = 0;
+    char marker;
+    if (!ubjson_ctx_take(ctx, &marker, 1))
+        return false;
+
+    return ubjson_ctx_parse_payload(ctx, marker, value);
+}
+
+// A value of a collection: one with its own marker, or the payload of one of `type`'s if that's set
+static bool ubjson_ctx_parse_member(struct ubjson_ctx *ctx, char type, struct ubjson_value *value)
+{
+    if (type)
+        return ubjson_ctx_parse_payload(ctx, type, value);
+    return ubjson_ctx_peek(ctx) != '\0' && ubjson_ctx_parse_value(ctx, value);
+}
+
+// Reads what may follow a collection's opening marker: `$` and the marker its values share, which needs a count
+// after it, and `#` and that count. `*type` is 0 and `*count` -1 when they're missing.
+static bool ubjson_ctx_parse_header(struct ubjson_ctx *ctx, char *type, i64 *count)
+{
+    *type = 0;
+    *count = -1;
 
-    if (ubjson_ctx_peek(ctx) == ']')
+    if (ubjson_ctx_peek(ctx) == '$')
     {
         ubjson_ctx_consume(ctx, 1);
+        if (!ubjson_ctx_take(ctx, type, 1) || *type == '[' || *type == '{' || ubjson_ctx_peek(ctx) != '#')
+            return false;
+    }
+
+    if (ubjson_ctx_peek(ctx) == '#')
+    {
+        ubjson_ctx_consume(ctx, 1);
+        // Every value takes a byte or more, but for those of a collection typed with a marker alone, like `[$Z#`.
+        // They're held to the same limit, so that no count asks for more memory than the input could fill.
+        if (!ubjson_ctx_parse_length(ctx, count) || (u64)*count > ctx->src_len - ctx->src_index)
+            return false;
+    }
+
+    return true;
+}
+
+static bool ubjson_ctx_parse_typed_array(struct ubjson_ctx *ctx, char type, i64 count,
+                                         struct ubjson_typed_array *array)
+{
+    array->type = ubjson_typed_type(type);
+    array->count = 0;
+    array->data = NULL;
+    array->owned = false;
+
+    size_t width = ubjson_typed_width(array->type);
+    if ((u64)count > (ctx->src_len - ctx->src_index) / width)
+        return false;
+
+    char *src = (char *)ubjson_ctx_consume(ctx, count * width);
+    if (!src)
+        return false;
+
+    // Read where it lies if it's aligned for its type and either needn't be swapped or is in the ctx's own src_buf, where
+    // swapping it touches nothing of the caller's. One which starts before `src_swapped` was swapped there by an
+    // earlier parse of the same source.
+    bool swap = ubjson_typed_needs_swap(array->type);
+    if ((uintptr_t)src % width || (swap && ctx->src_borrowed))
+    {
+        array->data = ubjson_ctx_alloc(ctx, count * width);
+        if (!array->data)
+            return false;
+        array->owned = true;
+        ubjson_typed_swap(array->data, src, array->type, count);
+    }
+    else
+    {
+        array->data = src;
+        if (swap && (size_t)(src - ctx->src_buf) >= ctx->src_swapped)
+        {
+            ubjson_typed_swap(src, src, array->type, count);
+            ctx->src_swapped = ctx->src_index;
+        }
+    }
+
+    array->count = count;
+    return true;
+}
+
+// Room for a collection's `count` members or values of `width` bytes each, or for its first few if it isn't counted,
+// taken from the spares if one is big enough. A counted collection is otherwise allocated once, at its exact size, and
+// an uncounted one is left to grow as it's filled.
+static bool ubjson_ctx_parse_storage(struct ubjson_ctx *ctx, void **data, size_t *capacity, size_t width, i64 count)
+{
+    size_t wanted = count < 0 ? 4 : (size_t)count;
+    size_t size;
+    if (!wanted)
         return true;
+
+    *data = ubjson_ctx_reuse(ctx, width * wanted, &size);
+    if (!*data)
+    {
+        if (count < 0)
+            return true;
+        size = width * wanted;
+        *data = ubjson_ctx_alloc(ctx, size);
+        if (!*data)
+            return false;
     }
-    if (ubjson_ctx_peek(ctx) == '\0')
+    *capacity = size / width;
+    return true;
+}
+
+static bool ubjson_ctx_parse_elements(struct ubjson_ctx *ctx, char type, i64 count, struct ubjson_array *array)
+{
+    array->values = NULL;
+    array->count = 0;
+    array->capacity = 0;
+
+    if (!ubjson_ctx_parse_storage(ctx, (void **)&array->values, &array->capacity, sizeof(*array->values), count))
         return false;
 
     while (true)
     {
-        if (ubjson_ctx_peek(ctx) == ']')
+        if (count < 0 ? ubjson_ctx_peek(ctx) == ']' : array->count == (size_t)count)
         {
-            ubjson_ctx_consume(ctx, 1);
+            if (count < 0)
+                ubjson_ctx_consume(ctx, 1);
             return true;
         }
-        if (ubjson_ctx_peek(ctx) == '\0')
-            return false; // TODO: Free array contents
 
         struct ubjson_value value;
-        if (!ubjson_ctx_parse_value(ctx, &value))
-            return false; // TODO: Free array contents
+        if (!ubjson_ctx_parse_member(ctx, type, &value))
+        {
+            ubjson_free_array(ctx, *array, false);
+            array->values = NULL;
+            array->count = 0;
+            return false;
+        }
 
         if (array->count + 1 > array->capacity)
         {
-            if (array->capacity)
-                array->capacity *= 2;
-            else
-                array->capacity = 4;
-            array->values = realloc(array->values, sizeof(*array->values) * array->capacity);
+            size_t capacity = array->capacity ? array->capacity * 2 : 4;
+            array->values = ubjson_ctx_realloc(ctx, array->values, sizeof(*array->values) * array->capacity,
+                                               sizeof(*array->values) * capacity);
+            array->capacity = capacity;
         }
 
         array->values[array->count++] = value;
     }
 }
 
+bool ubjson_ctx_parse_array(struct ubjson_ctx *ctx, struct ubjson_array *array)
+{
+    char type;
+    i64 count;
+    array->values = NULL;
+    array->count = 0;
+    array->capacity = 0;
+
+    if (!ubjson_ctx_parse_header(ctx, &type, &count))
+        return false;
+    return ubjson_ctx_parse_elements(ctx, type, count, array);
+}
+
 bool ubjson_ctx_parse_object(struct ubjson_ctx *ctx, struct ubjson_object *object)
 {
+    char type;
+    i64 count;
     object->kv_pairs = NULL;
     object->count = 0;
     object->capacity = 0;
 
-    if (ubjson_ctx_peek(ctx) == '}')
-    {
-        ubjson_ctx_consume(ctx, 1);
-        return true;
-    }
-    if (ubjson_ctx_peek(ctx) == '\0')
+    if (!ubjson_ctx_parse_header(ctx, &type, &count))
+        return false;
+
+    if (!ubjson_ctx_parse_storage(ctx, (void **)&object->kv_pairs, &object->capacity, sizeof(*object->kv_pairs), count))
         return false;
 
     while (true)
     {
-        if (ubjson_ctx_peek(ctx) == '}')
+        if (count < 0 ? ubjson_ctx_peek(ctx) == '}' : object->count == (size_t)count)
         {
-            ubjson_ctx_consume(ctx, 1);
+            if (count < 0)
+                ubjson_ctx_consume(ctx, 1);
             return true;
         }
-        if (ubjson_ctx_peek(ctx) == '\0')
-            return false; // TODO: Free object contents
 
         struct ubjson_kv_pair kv_pair;
-        if (!ubjson_ctx_parse_string(ctx, &kv_pair.key))
-            return false; // TODO: Free object contents
-        if (!ubjson_ctx_parse_value(ctx, &kv_pair.value))
-            return false; // TODO: Free object contents
+        if (ubjson_ctx_peek(ctx) == '\0' || !ubjson_ctx_parse_string(ctx, &kv_pair.key, &kv_pair.key_length) ||
+            !ubjson_ctx_parse_member(ctx, type, &kv_pair.value))
+        {
+            ubjson_free_object(ctx, *object, false);
+            object->kv_pairs = NULL;
+            object->count = 0;
+            return false;
+        }
 
         if (object->count + 1 > object->capacity)
         {
-            if (object->capacity)
-                object->capacity *= 2;
-            else
-                object->capacity = 4;
-            object->kv_pairs = realloc(object->kv_pairs, sizeof(*object->kv_pairs) * object->capacity);
+            size_t capacity = object->capacity ? object->capacity * 2 : 4;
+            object->kv_pairs = ubjson_ctx_realloc(ctx, object->kv_pairs, sizeof(*object->kv_pairs) * object->capacity,
+                                                  sizeof(*object->kv_pairs) * capacity);
+            object->capacity = capacity;
         }
 
         object->kv_pairs[object->count++] = kv_pair;
@@ -320,9 +632,13 @@ bool ubjson_ctx_parse_object(struct ubjson_ctx *ctx, struct ubjson_object *objec
 
 bool ubjson_ctx_parse(struct ubjson_ctx *ctx)
 {
-    ubjson_ctx_free_creation(ctx);
+    ubjson_ctx_free_tree(ctx);
+    ctx->string_bytes = 0;
+    ctx->terminated = false;
 
-    char start = *ubjson_ctx_consume(ctx, 1);
+    char start;
+    if (!ubjson_ctx_take(ctx, &start, 1))
+        return false;
     if (start == '{')
     {
         ctx->root.type = UBJSON_TYPE_OBJECT;
@@ -332,7 +648,9 @@ bool ubjson_ctx_parse(struct ubjson_ctx *ctx)
         bool result = ubjson_ctx_parse_object(ctx, &ctx->root.collection.object);
         if (result)
         {
-            ctx->current = calloc(sizeof(*ctx->current), 1);
+            ctx->current = ubjson_ctx_new_cursor(ctx);
+            if (!ctx->current)
+                return false;
             ctx->current->collection = ctx->root.collection;
             ctx->current->type = UBJSON_TYPE_OBJECT;
             ctx->current->is_from_parse = true;
@@ -348,7 +666,9 @@ bool ubjson_ctx_parse(struct ubjson_ctx *ctx)
         bool result = ubjson_ctx_parse_array(ctx, &ctx->root.collection.array);
         if (result)
         {
-            ctx->current = calloc(sizeof(*ctx->current), 1);
+            ctx->current = ubjson_ctx_new_cursor(ctx);
+            if (!ctx->current)
+                return false;
             ctx->current->collection = ctx->root.collection;
             ctx->current->type = UBJSON_TYPE_ARRAY;
             ctx->current->is_from_parse = true;
@@ -357,3 +677,64 @@ bool ubjson_ctx_parse(struct ubjson_ctx *ctx)
     }
     return false;
 }
+
+static char *ubjson_terminate_string(char *out, char **str, size_t length)
+{
+    memcpy(out, *str, length);
+    out[length] = '\0';
+    *str = out;
+    return out + length + 1;
+}
+
+static char *ubjson_terminate_array(char *out, struct ubjson_array *array);
+
+static char *ubjson_terminate_value(char *out, struct ubjson_value *value)
+{
+    switch (value->type)
+    {
+    case UBJSON_TYPE_STRING:
+        return ubjson_terminate_string(out, &value->v.string, value->length);
+    case UBJSON_TYPE_ARRAY:
+        return ubjson_terminate_array(out, &value->v.array);
+    case UBJSON_TYPE_OBJECT:
+        for (size_t i = 0; i < value->v.object.count; i++)
+        {
+            struct ubjson_kv_pair *kv_pair = &value->v.object.kv_pairs[i];
+            out = ubjson_terminate_string(out, &kv_pair->key, kv_pair->key_length);
+            out = ubjson_terminate_value(out, &kv_pair->value);
+        }
+        return out;
+    default:
+        return out;
+    }
+}
+
+static char *ubjson_terminate_array(char *out, struct ubjson_array *array)
+{
+    for (size_t i = 0; i < array->count; i++)
+        out = ubjson_terminate_value(out, &array->values[i]);
+    return out;
+}
+
+bool ubjson_ctx_terminate(struct ubjson_ctx *ctx)
+{
+    if (ctx->terminated || !ctx->string_bytes)
+        return true;
+
+    if (ctx->string_bytes > ctx->strings_capacity)
+    {
+        char *strings = ubjson_ctx_alloc(ctx, ctx->string_bytes);
+        if (!strings)
+            return false;
+        ubjson_ctx_release(ctx, ctx->strings);
+        ctx->strings = strings;
+        ctx->strings_capacity = ctx->string_bytes;
+    }
+
+    struct ubjson_value root = { .v.object = ctx->root.collection.object, .type = ctx->root.type };
+    if (ctx->root.type == UBJSON_TYPE_ARRAY)
+        root.v.array = ctx->root.collection.array;
+    ubjson_terminate_value(ctx->strings, &root);
+    ctx->terminated = true;
+    return true;
+}
@@ -11,7 +11,7 @@
 #endif
 #include <string.h>
 
-bool ubjson_read_value(void *out, struct ubjson_value value, enum ubjson_type expected)
+bool ubjson_read_value(struct ubjson_ctx *ctx, void *out, struct ubjson_value value, enum ubjson_type expected)
 {
     if (!((value.type == UBJSON_TYPE_FALSE || value.type == UBJSON_TYPE_TRUE) &&
           (expected == UBJSON_TYPE_FALSE || expected == UBJSON_TYPE_TRUE)))
@@ -59,8 +59,11 @@ bool ubjson_read_value(void *out, struct ubjson_value value, enum ubjson_type ex
         *(char *)out = value.v.character;
         break;
     case UBJSON_TYPE_STRING:
-        *(char **)out = malloc(strlen(value.v.string) + 1);
-        strcpy(*(char **)out, value.v.string);
+        *(char **)out = ubjson_ctx_alloc(ctx, value.length + 1);
+        if (!*(char **)out)
+            return false;
+        memcpy(*(char **)out, value.v.string, value.length);
+        (*(char **)out)[value.length] = '\0';
         break;
     case UBJSON_TYPE_ARRAY:
         *(size_t *)out = value.v.array.count;
@@ -68,6 +71,9 @@ bool ubjson_read_value(void *out, struct ubjson_value value, enum ubjson_type ex
     case UBJSON_TYPE_OBJECT:
         *(size_t *)out = value.v.object.count;
         break;
+    case UBJSON_TYPE_TYPED_ARRAY:
+        *(struct ubjson_typed_array *)out = value.v.typed_array;
+        break;
     }
 
     return true;
@@ -78,16 +84,19 @@ bool ubjson_ctx_read_kv_pair(struct ubjson_ctx *ctx, char **key, void *out, enum
     if (ctx->current->type != UBJSON_TYPE_OBJECT)
         return false;
 
-    char *index_key = ctx->current->collection.object.kv_pairs[ctx->current->index].key;
-    struct ubjson_value value = ctx->current->collection.object.kv_pairs[ctx->current->index].value;
+    struct ubjson_kv_pair const *kv_pair = &ctx->current->collection.object.kv_pairs[ctx->current->index];
+    struct ubjson_value value = kv_pair->value;
 
     if (key)
     {
-        *key = malloc(strlen(index_key) + 1);
-        strcpy(*key, index_key);
+        *key = ubjson_ctx_alloc(ctx, kv_pair->key_length + 1);
+        if (!*key)
+            return false;
+        memcpy(*key, kv_pair->key, kv_pair->key_length);
+        (*key)[kv_pair->key_length] = '\0';
     }
 
-    if (!ubjson_read_value(out, value, expected))
+    if (!ubjson_read_value(ctx, out, value, expected))
         return false;
 
     return true;
@@ -117,5 +126,84 @@ bool ubjson_ctx_read(struct ubjson_ctx *ctx, void *out, enum ubjson_type expecte
 
     struct ubjson_value value = ctx->current->collection.array.values[ctx->current->index];
 
-    return ubjson_read_value(out, value, expected);
+    return ubjson_read_value(ctx, out, value, expected);
+}
+
+// FNV-1a
+static size_t ubjson_key_hash(char const *key, size_t length)
+{
+    u64 hash = 14695981039346656037ull;
+    for (size_t i = 0; i < length; i++)
+        hash = (hash ^ (u8)key[i]) * 1099511628211ull;
+    return (size_t)hash;
+}
+
+// Open addressing with linear probing, at most half full. The members are inserted in order, so of two with the same
+// key the first is met first.
+static bool ubjson_ctx_index_keys(struct ubjson_ctx *ctx)
+{
+    struct ubjson_collection_list *current = ctx->current;
+    struct ubjson_object const *object = &current->collection.object;
+
+    size_t slots = 1;
+    while (slots < object->count * 2)
+        slots *= 2;
+    current->key_index = ubjson_ctx_calloc(ctx, sizeof(*current->key_index) * slots);
+    if (!current->key_index)
+        return false;
+    current->key_index_mask = slots - 1;
+
+    for (size_t i = 0; i < object->count; i++)
+    {
+        size_t slot = ubjson_key_hash(object->kv_pairs[i].key, object->kv_pairs[i].key_length);
+        while (current->key_index[slot & current->key_index_mask])
+            slot++;
+        current->key_index[slot & current->key_index_mask] = i + 1;
+    }
+
+    return true;
+}
+
+struct ubjson_value *ubjson_ctx_find(struct ubjson_ctx *ctx, char const *key)
+{
+    struct ubjson_collection_list *current = ctx->current;
+    if (!current || current->type != UBJSON_TYPE_OBJECT)
+        return NULL;
+
+    struct ubjson_object *object = &current->collection.object;
+    size_t length = strlen(key);
+
+    // An index which can't be allocated just leaves the object to be scanned
+    if (!current->key_index && object->count >= UBJSON_FIND_INDEX_THRESHOLD)
+        ubjson_ctx_index_keys(ctx);
+
+    if (current->key_index)
+    {
+        for (size_t slot = ubjson_key_hash(key, length); current->key_index[slot & current->key_index_mask]; slot++)
+        {
+            size_t i = current->key_index[slot & current->key_index_mask] - 1;
+            if (object->kv_pairs[i].key_length == length && !memcmp(object->kv_pairs[i].key, key, length))
+            {
+                current->index = i;
+                return &object->kv_pairs[i].value;
+            }
+        }
+        return NULL;
+    }
+
+    for (size_t i = 0; i < object->count; i++)
+    {
+        if (object->kv_pairs[i].key_length == length && !memcmp(object->kv_pairs[i].key, key, length))
+        {
+            current->index = i;
+            return &object->kv_pairs[i].value;
+        }
+    }
+    return NULL;
+}
+
+bool ubjson_ctx_get(struct ubjson_ctx *ctx, char const *key, void *out, enum ubjson_type expected)
+{
+    struct ubjson_value *value = ubjson_ctx_find(ctx, key);
+    return value && ubjson_read_value(ctx, out, *value, expected);
 }
@@ -0,0 +1,474 @@
+// Copyright (c) 2023 Ally Sommers
+// This code is licensed under the BSD 3-Clause License. A copy of this license
+// is included in the repository.
+
+#include "ubjson.h"
+
+#ifdef _WIN32
+#define be16toh(n) __builtin_bswap16(n)
+#define be32toh(n) __builtin_bswap32(n)
+#define be64toh(n) __builtin_bswap64(n)
+#else
+#include <endian.h>
+#endif
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+void ubjson_reader_init(struct ubjson_reader *reader)
+{
+    memset(reader, 0, sizeof(*reader));
+    reader->allocator = ubjson_default_allocator();
+}
+
+void ubjson_reader_free(struct ubjson_reader *reader)
+{
+    struct ubjson_allocator allocator = reader->allocator;
+    ubjson_allocator_free(&allocator, reader->pending);
+    ubjson_reader_init(reader);
+    reader->allocator = allocator;
+}
+
+void ubjson_reader_feed(struct ubjson_reader *reader, char const *buf, size_t len)
+{
+    reader->buf = buf;
+    reader->len = len;
+    reader->index = 0;
+}
+
+// Reads the length prefix of a string or key at `data`. Returns the size of the prefix, or 0 if `len` bytes don't
+// hold all of it, in which case `*needed` is set to how many would.
+static size_t ubjson_reader_length(char const *data, size_t len, i64 *length, size_t *needed, bool *malformed)
+{
+    size_t size;
+    switch (data[0])
+    {
+    case 'i':
+    case 'U':
+        size = 1;
+        break;
+    case 'I':
+        size = 2;
+        break;
+    case 'l':
+        size = 4;
+        break;
+    case 'L':
+        size = 8;
+        break;
+    default:
+        *malformed = true;
+        return 0;
+    }
+
+    if (len < 1 + size)
+    {
+        *needed = 1 + size;
+        return 0;
+    }
+
+    switch (data[0])
+    {
+    case 'i':
+        *length = (i8)data[1];
+        break;
+    case 'U':
+        *length = (u8)data[1];
+        break;
+    case 'I':
+    {
+        i16 n;
+        memcpy(&n, data + 1, 2);
+        *length = (i16)be16toh(n);
+        break;
+    }
+    case 'l':
+    {
+        i32 n;
+        memcpy(&n, data + 1, 4);
+        *length = (i32)be32toh(n);
+        break;
+    }
+    case 'L':
+    {
+        i64 n;
+        memcpy(&n, data + 1, 8);
+        *length = (i64)be64toh(n);
+        break;
+    }
+    }
+
+    if (*length < 0 || (u64)*length > SIZE_MAX - 16)
+    {
+        *malformed = true;
+        return 0;
+    }
+    return 1 + size;
+}
+
+// Decodes the value after `marker` at the start of `payload`, like ubjson_reader_token(), with `*size` not counting
+// the marker.
+static enum ubjson_event ubjson_reader_value(struct ubjson_reader *reader, char marker, char const *payload,
+                                             size_t len, size_t *size)
+{
+    struct ubjson_value *value = &reader->value;
+    bool malformed = false;
+    i64 length;
+    size_t header;
+
+    *size = 0;
+    switch (marker)
+    {
+    case 'Z':
+        value->type = UBJSON_TYPE_NULL;
+        return UBJSON_EVENT_VALUE;
+    case 'N':
+        value->type = UBJSON_TYPE_NOOP;
+        return UBJSON_EVENT_VALUE;
+    case 'T':
+        value->type = UBJSON_TYPE_TRUE;
+        return UBJSON_EVENT_VALUE;
+    case 'F':
+        value->type = UBJSON_TYPE_FALSE;
+        return UBJSON_EVENT_VALUE;
+    case 'S':
+        *size = 1;
+        if (!len)
+            return UBJSON_EVENT_NEED_MORE;
+        header = ubjson_reader_length(payload, len, &length, size, &malformed);
+        if (malformed)
+            return UBJSON_EVENT_ERROR;
+        if (!header)
+            return UBJSON_EVENT_NEED_MORE;
+        *size = header + length;
+        if (len < *size)
+            return UBJSON_EVENT_NEED_MORE;
+
+        value->type = UBJSON_TYPE_STRING;
+        reader->string = payload + header;
+        reader->string_length = length;
+        return UBJSON_EVENT_VALUE;
+    }
+
+    // Numbers: a fixed-size payload
+    switch (marker)
+    {
+    case 'i':
+    case 'U':
+    case 'C':
+        *size = 1;
+        break;
+    case 'I':
+        *size = 2;
+        break;
+    case 'l':
+    case 'd':
+        *size = 4;
+        break;
+    case 'L':
+    case 'D':
+        *size = 8;
+        break;
+    default:
+        return UBJSON_EVENT_ERROR;
+    }
+    if (len < *size)
+        return UBJSON_EVENT_NEED_MORE;
+
+    switch (marker)
+    {
+    case 'i':
+        value->type = UBJSON_TYPE_INT8;
+        value->v.int8 = (i8)payload[0];
+        break;
+    case 'U':
+        value->type = UBJSON_TYPE_UINT8;
+        value->v.uint8 = (u8)payload[0];
+        break;
+    case 'C':
+        value->type = UBJSON_TYPE_CHAR;
+        value->v.character = (u8)payload[0];
+        break;
+    case 'I':
+        value->type = UBJSON_TYPE_INT16;
+        memcpy(&value->v.int16, payload, 2);
+        value->v.int16 = (i16)be16toh(value->v.int16);
+        break;
+    case 'l':
+        value->type = UBJSON_TYPE_INT32;
+        memcpy(&value->v.int32, payload, 4);
+        value->v.int32 = (i32)be32toh(value->v.int32);
+        break;
+    case 'L':
+        value->type = UBJSON_TYPE_INT64;
+        memcpy(&value->v.int64, payload, 8);
+        value->v.int64 = (i64)be64toh(value->v.int64);
+        break;
+    case 'd':
+        value->type = UBJSON_TYPE_FLOAT32;
+        memcpy(&value->v.float32, payload, 4);
+        break;
+    case 'D':
+        value->type = UBJSON_TYPE_FLOAT64;
+        memcpy(&value->v.float64, payload, 8);
+        break;
+    }
+    return UBJSON_EVENT_VALUE;
+}
+
+// Decodes a collection's opening marker and the `$` type and `#` count which may follow it into `opening`. There's
+// always at least one byte after the marker, if only the one closing an empty collection. A `[$U#` array inside a
+// document is decoded whole instead.
+static enum ubjson_event ubjson_reader_collection(struct ubjson_reader *reader, char const *data, size_t len,
+                                                  size_t *size)
+{
+    struct ubjson_reader_frame opening = { data[0], 0, -1 };
+    size_t used = 1;
+
+    if (len < 2)
+    {
+        *size = 2;
+        return UBJSON_EVENT_NEED_MORE;
+    }
+
+    if (data[1] == '$')
+    {
+        if (len < 4)
+        {
+            *size = 4;
+            return UBJSON_EVENT_NEED_MORE;
+        }
+        if (data[2] == '[' || data[2] == '{' || data[3] != '#')
+            return UBJSON_EVENT_ERROR;
+        opening.type = data[2];
+        used = 3;
+    }
+
+    if (data[used] == '#')
+    {
+        bool malformed = false;
+        size_t header = 0;
+        *size = used + 2;
+        if (len >= used + 2)
+            header = ubjson_reader_length(data + used + 1, len - used - 1, &opening.remaining, size, &malformed);
+        if (malformed)
+            return UBJSON_EVENT_ERROR;
+        if (!header)
+        {
+            if (len >= used + 2)
+                *size += used + 1;
+            return UBJSON_EVENT_NEED_MORE;
+        }
+        used += 1 + header;
+    }
+
+    *size = used;
+
+    // Binary data in a document is read all at once, as one value
+    if (reader->depth && opening.kind == '[' && opening.type == 'U')
+    {
+        *size = used + opening.remaining;
+        if (len < *size)
+            return UBJSON_EVENT_NEED_MORE;
+
+        reader->value.type = UBJSON_TYPE_TYPED_ARRAY;
+        reader->value.v.typed_array = (struct ubjson_typed_array) { (void *)(data + used), opening.remaining,
+                                                                    UBJSON_TYPE_UINT8, false };
+        return UBJSON_EVENT_VALUE;
+    }
+
+    reader->opening = opening;
+    return opening.kind == '{' ? UBJSON_EVENT_BEGIN_OBJECT : UBJSON_EVENT_BEGIN_ARRAY;
+}
+
+// Decodes the token at the start of `data` without touching the reader's state unless it's complete. Returns its
+// event with `*size` set to its length, or UBJSON_EVENT_NEED_MORE with `*size` set to a length it's known to need.
+static enum ubjson_event ubjson_reader_token(struct ubjson_reader *reader, char const *data, size_t len, size_t *size)
+{
+    struct ubjson_reader_frame const *frame = reader->depth ? &reader->stack[reader->depth - 1] : NULL;
+
+    if (reader->key_next)
+    {
+        bool malformed = false;
+        i64 length;
+        size_t header;
+
+        *size = 1;
+        if (!len)
+            return UBJSON_EVENT_NEED_MORE;
+        // A counted object ends without a marker
+        if (data[0] == '}')
+            return frame->remaining < 0 ? UBJSON_EVENT_END_OBJECT : UBJSON_EVENT_ERROR;
+
+        header = ubjson_reader_length(data, len, &length, size, &malformed);
+        if (malformed)
+            return UBJSON_EVENT_ERROR;
+        if (!header)
+            return UBJSON_EVENT_NEED_MORE;
+        *size = header + length;
+        if (len < *size)
+            return UBJSON_EVENT_NEED_MORE;
+
+        reader->string = data + header;
+        reader->string_length = length;
+        return UBJSON_EVENT_KEY;
+    }
+
+    // The values of a typed collection have no markers of their own
+    if (frame && frame->type)
+        return ubjson_reader_value(reader, frame->type, data, len, size);
+
+    *size = 1;
+    if (!len)
+        return UBJSON_EVENT_NEED_MORE;
+
+    // A document is an object or an array
+    if (!reader->depth && data[0] != '{' && data[0] != '[')
+        return UBJSON_EVENT_ERROR;
+
+    switch (data[0])
+    {
+    case '{':
+    case '[':
+        return ubjson_reader_collection(reader, data, len, size);
+    case ']':
+        return frame->kind == '[' && frame->remaining < 0 ? UBJSON_EVENT_END_ARRAY : UBJSON_EVENT_ERROR;
+    }
+
+    enum ubjson_event event = ubjson_reader_value(reader, data[0], data + 1, len - 1, size);
+    *size += 1;
+    return event;
+}
+
+// Moves the reader past a complete token.
+static enum ubjson_event ubjson_reader_advance(struct ubjson_reader *reader, enum ubjson_event event)
+{
+    switch (event)
+    {
+    case UBJSON_EVENT_BEGIN_OBJECT:
+    case UBJSON_EVENT_BEGIN_ARRAY:
+        if (reader->depth == UBJSON_READER_MAX_DEPTH)
+        {
+            reader->failed = true;
+            return UBJSON_EVENT_ERROR;
+        }
+        reader->stack[reader->depth++] = reader->opening;
+        reader->key_next = event == UBJSON_EVENT_BEGIN_OBJECT;
+        break;
+    case UBJSON_EVENT_END_OBJECT:
+    case UBJSON_EVENT_END_ARRAY:
+        reader->depth--;
+        reader->key_next = false;
+        if (!reader->depth)
+            break;
+        // The collection which ended was a value of its parent
+        // fall through
+    case UBJSON_EVENT_VALUE:
+    {
+        struct ubjson_reader_frame *frame = &reader->stack[reader->depth - 1];
+        reader->key_next = frame->kind == '{';
+        if (frame->remaining > 0)
+            frame->remaining--;
+        break;
+    }
+    case UBJSON_EVENT_KEY:
+        reader->key_next = false;
+        break;
+    case UBJSON_EVENT_ERROR:
+        reader->failed = true;
+        break;
+    default:
+        break;
+    }
+    return event;
+}
+
+enum ubjson_event ubjson_reader_next(struct ubjson_reader *reader)
+{
+    if (reader->failed)
+        return UBJSON_EVENT_ERROR;
+
+    // The last token was put together in `pending`, and what it pointed to has now been seen
+    if (reader->pending_used)
+    {
+        reader->pending_len = 0;
+        reader->pending_used = false;
+    }
+
+    // A counted collection ends after its last value, with no marker to read
+    if (reader->depth && !reader->stack[reader->depth - 1].remaining)
+        return ubjson_reader_advance(reader, reader->stack[reader->depth - 1].kind == '{' ? UBJSON_EVENT_END_OBJECT
+                                                                                          : UBJSON_EVENT_END_ARRAY);
+
+    enum ubjson_event event;
+    size_t size;
+
+    // A token which was split between chunks: top it up, only as far as it's known to reach, until it's complete
+    while (reader->pending_len)
+    {
+        event = ubjson_reader_token(reader, reader->pending, reader->pending_len, &size);
+        if (event != UBJSON_EVENT_NEED_MORE)
+        {
+            // Telling whether a collection is typed or counted takes the byte after its marker, which may not be
+            // part of it. That byte came from the chunk, so it's left there.
+            if (event != UBJSON_EVENT_ERROR && size < reader->pending_len)
+                reader->index -= reader->pending_len - size;
+            reader->pending_used = true;
+            return ubjson_reader_advance(reader, event);
+        }
+
+        size_t available = reader->len - reader->index;
+        if (!available)
+            return UBJSON_EVENT_NEED_MORE;
+
+        // Doubling, so binary data arriving in many chunks isn't copied again for each of them. It's never more than
+        // the token is known to need, nor more than twice what has arrived, whatever its length prefix claims.
+        size_t take = size - reader->pending_len < available ? size - reader->pending_len : available;
+        if (reader->pending_len + take > reader->pending_capacity)
+        {
+            size_t capacity = reader->pending_capacity * 2 < size ? reader->pending_capacity * 2 : size;
+            if (capacity < reader->pending_len + take)
+                capacity = reader->pending_len + take;
+            char *pending = ubjson_allocator_realloc(&reader->allocator, reader->pending, reader->pending_capacity,
+                                                     capacity);
+            if (!pending)
+            {
+                reader->failed = true;
+                return UBJSON_EVENT_ERROR;
+            }
+            reader->pending = pending;
+            reader->pending_capacity = capacity;
+        }
+        memcpy(reader->pending + reader->pending_len, reader->buf + reader->index, take);
+        reader->pending_len += take;
+        reader->index += take;
+    }
+
+    event = ubjson_reader_token(reader, reader->buf + reader->index, reader->len - reader->index, &size);
+    if (event != UBJSON_EVENT_NEED_MORE)
+    {
+        if (event != UBJSON_EVENT_ERROR)
+            reader->index += size;
+        return ubjson_reader_advance(reader, event);
+    }
+
+    // Keep what there is of the token; the caller is free to reuse the chunk
+    size_t rest = reader->len - reader->index;
+    if (rest > reader->pending_capacity)
+    {
+        char *pending = ubjson_allocator_realloc(&reader->allocator, reader->pending, reader->pending_capacity, rest);
+        if (!pending)
+        {
+            reader->failed = true;
+            return UBJSON_EVENT_ERROR;
+        }
+        reader->pending = pending;
+        reader->pending_capacity = rest;
+    }
+    if (rest)
+        memcpy(reader->pending, reader->buf + reader->index, rest);
+    reader->pending_len = rest;
+    reader->index = reader->len;
+    return UBJSON_EVENT_NEED_MORE;
+}
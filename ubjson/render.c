@@ -20,10 +20,51 @@
 #include <stddef.h>
 #include <string.h>
 
+#define UBJSON_RENDER_MIN_CAPACITY 256
+
+// Makes room for `len` more bytes. Rendering a whole document reserves its exact size up front, so growing by half
+// again only happens to callers appending piece by piece.
+static bool ubjson_ctx_reserve_render(struct ubjson_ctx *ctx, size_t len, bool exact)
+{
+    size_t needed = ctx->render_index + len;
+    if (needed <= ctx->render_capacity)
+        return true;
+
+    size_t capacity = needed;
+    if (!exact)
+    {
+        capacity = ctx->render_capacity + ctx->render_capacity / 2;
+        if (capacity < UBJSON_RENDER_MIN_CAPACITY)
+            capacity = UBJSON_RENDER_MIN_CAPACITY;
+        if (capacity < needed)
+            capacity = needed;
+    }
+
+    char *buf;
+    if (ctx->render_borrowed)
+    {
+        // Moving off the caller's buffer
+        buf = ubjson_ctx_alloc(ctx, capacity);
+        if (buf && ctx->render_index)
+            memcpy(buf, ctx->render_buf, ctx->render_index);
+    }
+    else
+    {
+        buf = ubjson_ctx_realloc(ctx, ctx->render_buf, ctx->render_capacity, capacity);
+    }
+    if (!buf)
+        return false;
+
+    ctx->render_buf = buf;
+    ctx->render_capacity = capacity;
+    ctx->render_borrowed = false;
+    return true;
+}
+
 bool ubjson_ctx_append_bytes_to_render(struct ubjson_ctx *ctx, char *str, size_t len)
 {
-    while (ctx->render_index + len >= ctx->render_capacity)
-        ctx->render_buf = realloc(ctx->render_buf, ctx->render_capacity *= 2);
+    if (!ubjson_ctx_reserve_render(ctx, len, false))
+        return false;
 
     memcpy(ctx->render_buf + ctx->render_index, str, len);
     ctx->render_index += len;
@@ -32,20 +73,127 @@ bool ubjson_ctx_append_bytes_to_render(struct ubjson_ctx *ctx, char *str, size_t
 
 bool ubjson_ctx_append_byte_to_render(struct ubjson_ctx *ctx, char b)
 {
-    if (ctx->render_index + 1 >= ctx->render_capacity)
-        ctx->render_buf = realloc(ctx->render_buf, ctx->render_capacity += 256);
+    if (!ubjson_ctx_reserve_render(ctx, 1, false))
+        return false;
 
     ctx->render_buf[ctx->render_index++] = b;
     return true;
 }
 
-bool ubjson_ctx_render_string(struct ubjson_ctx *ctx, char *str, bool is_key)
+void ubjson_ctx_render_into(struct ubjson_ctx *ctx, char *buf, size_t capacity)
+{
+    if (!ctx->render_borrowed)
+        ubjson_ctx_release(ctx, ctx->render_buf);
+    ctx->render_buf = buf;
+    ctx->render_index = 0;
+    ctx->render_capacity = capacity;
+    ctx->render_borrowed = true;
+}
+
+size_t ubjson_measure_int(i64 value)
+{
+    // 'i' or 'U'
+    if (value >= INT8_MIN && value <= UINT8_MAX)
+        return 2;
+    if (value >= INT16_MIN && value <= INT16_MAX)
+        return 3;
+    if (value >= INT32_MIN && value <= INT32_MAX)
+        return 5;
+    return 9;
+}
+
+size_t ubjson_measure_string(size_t length, bool is_key)
+{
+    return (is_key ? 0 : 1) + ubjson_measure_int((i64)length) + length;
+}
+
+size_t ubjson_measure_value(struct ubjson_value const *value)
+{
+    switch (value->type)
+    {
+    case UBJSON_TYPE_NULL:
+    case UBJSON_TYPE_NOOP:
+    case UBJSON_TYPE_TRUE:
+    case UBJSON_TYPE_FALSE:
+        return 1;
+    case UBJSON_TYPE_INT8:
+    case UBJSON_TYPE_UINT8:
+    case UBJSON_TYPE_CHAR:
+        return 2;
+    case UBJSON_TYPE_INT16:
+        return 3;
+    case UBJSON_TYPE_INT32:
+    case UBJSON_TYPE_FLOAT32:
+        return 5;
+    case UBJSON_TYPE_INT64:
+    case UBJSON_TYPE_FLOAT64:
+        return 9;
+    case UBJSON_TYPE_STRING:
+        return ubjson_measure_string(value->length, false);
+    case UBJSON_TYPE_ARRAY:
+        return ubjson_measure_array(&value->v.array);
+    case UBJSON_TYPE_OBJECT:
+        return ubjson_measure_object(&value->v.object);
+    case UBJSON_TYPE_TYPED_ARRAY:
+        // '[', '$', its marker, '#', its count and its elements
+        return 4 + ubjson_measure_int((i64)value->v.typed_array.count) +
+               ubjson_typed_width(value->v.typed_array.type) * value->v.typed_array.count;
+    case UBJSON_TYPE_HIGHPRECISION:
+    default:
+        return 0;
+    }
+}
+
+size_t ubjson_measure_array(struct ubjson_array const *array)
+{
+    size_t size = 2;
+    for (size_t i = 0; i < array->count; i++)
+        size += ubjson_measure_value(&array->values[i]);
+    return size;
+}
+
+size_t ubjson_measure_object(struct ubjson_object const *object)
+{
+    size_t size = 2;
+    for (size_t i = 0; i < object->count; i++)
+        size += ubjson_measure_string(object->kv_pairs[i].key_length, true) +
+                ubjson_measure_value(&object->kv_pairs[i].value);
+    return size;
+}
+
+// The collection ubjson_ctx_render_creation() renders
+static struct ubjson_collection_list *ubjson_ctx_creation_root(struct ubjson_ctx *ctx)
+{
+    struct ubjson_collection_list *root = ctx->current;
+    while (root && root->parent)
+        root = root->parent;
+    return root;
+}
+
+size_t ubjson_ctx_measure(struct ubjson_ctx *ctx)
+{
+    if (ctx->root.type == UBJSON_TYPE_OBJECT)
+        return ubjson_measure_object(&ctx->root.collection.object);
+    if (ctx->root.type == UBJSON_TYPE_ARRAY)
+        return ubjson_measure_array(&ctx->root.collection.array);
+    return 0;
+}
+
+size_t ubjson_ctx_measure_creation(struct ubjson_ctx *ctx)
+{
+    struct ubjson_collection_list *root = ubjson_ctx_creation_root(ctx);
+    if (root && root->type == UBJSON_TYPE_OBJECT)
+        return ubjson_measure_object(&root->collection.object);
+    if (root && root->type == UBJSON_TYPE_ARRAY)
+        return ubjson_measure_array(&root->collection.array);
+    return 0;
+}
+
+bool ubjson_ctx_render_string(struct ubjson_ctx *ctx, char const *str, size_t len, bool is_key)
 {
     if (!is_key)
         ubjson_ctx_append_byte_to_render(ctx, 'S');
 
-    size_t len = strlen(str);
-
     if (len <= INT8_MAX)
     {
         ubjson_ctx_append_byte_to_render(ctx, 'i');
@@ -78,10 +226,58 @@ bool ubjson_ctx_render_string(struct ubjson_ctx *ctx, char *str, bool is_key)
     }
 
 write_string:
-    ubjson_ctx_append_bytes_to_render(ctx, str, len);
+    ubjson_ctx_append_bytes_to_render(ctx, (char *)str, len);
     return false;
 }
 
+// Appends a count, which like a string's length takes the smallest marker it fits
+static void ubjson_ctx_render_count(struct ubjson_ctx *ctx, size_t count)
+{
+    if (count <= INT8_MAX)
+    {
+        ubjson_ctx_append_byte_to_render(ctx, 'i');
+        ubjson_ctx_append_byte_to_render(ctx, count);
+    }
+    else if (count <= UINT8_MAX)
+    {
+        ubjson_ctx_append_byte_to_render(ctx, 'U');
+        ubjson_ctx_append_byte_to_render(ctx, count);
+    }
+    else if (count <= INT16_MAX)
+    {
+        ubjson_ctx_append_byte_to_render(ctx, 'I');
+        ubjson_ctx_append_bytes_to_render(ctx, (char *)&(i16) { htobe16(count) }, 2);
+    }
+    else if (count <= INT32_MAX)
+    {
+        ubjson_ctx_append_byte_to_render(ctx, 'l');
+        ubjson_ctx_append_bytes_to_render(ctx, (char *)&(i32) { htobe32(count) }, 4);
+    }
+    else
+    {
+        ubjson_ctx_append_byte_to_render(ctx, 'L');
+        ubjson_ctx_append_bytes_to_render(ctx, (char *)&(i64) { htobe64(count) }, 8);
+    }
+}
+
+// The elements are swapped straight into the render buffer as one block
+static bool ubjson_ctx_render_typed_array(struct ubjson_ctx *ctx, struct ubjson_typed_array const *array)
+{
+    char marker = ubjson_typed_marker(array->type);
+    if (!marker)
+        return false;
+
+    size_t size = ubjson_typed_width(array->type) * array->count;
+    if (!ubjson_ctx_reserve_render(ctx, 4 + ubjson_measure_int((i64)array->count) + size, false))
+        return false;
+
+    ubjson_ctx_append_bytes_to_render(ctx, (char[]) { '[', '$', marker, '#' }, 4);
+    ubjson_ctx_render_count(ctx, array->count);
+    ubjson_typed_swap(ctx->render_buf + ctx->render_index, array->data, array->type, array->count);
+    ctx->render_index += size;
+    return true;
+}
+
 bool ubjson_ctx_render_value(struct ubjson_ctx *ctx, struct ubjson_value *value)
 {
     switch (value->type)
@@ -131,11 +327,13 @@ bool ubjson_ctx_render_value(struct ubjson_ctx *ctx, struct ubjson_value *value)
         ubjson_ctx_append_byte_to_render(ctx, value->v.character);
         return true;
     case UBJSON_TYPE_STRING:
-        return ubjson_ctx_render_string(ctx, value->v.string, false);
+        return ubjson_ctx_render_string(ctx, value->v.string, value->length, false);
     case UBJSON_TYPE_ARRAY:
         return ubjson_ctx_render_array(ctx, value->v.array);
     case UBJSON_TYPE_OBJECT:
         return ubjson_ctx_render_object(ctx, value->v.object);
+    case UBJSON_TYPE_TYPED_ARRAY:
+        return ubjson_ctx_render_typed_array(ctx, &value->v.typed_array);
     case UBJSON_TYPE_HIGHPRECISION:
     default:
         return false;
@@ -162,7 +360,7 @@ bool ubjson_ctx_render_object(struct ubjson_ctx *ctx, struct ubjson_object objec
 
     for (size_t i = 0; i < object.count; i++)
     {
-        ubjson_ctx_render_string(ctx, object.kv_pairs[i].key, true);
+        ubjson_ctx_render_string(ctx, object.kv_pairs[i].key, object.kv_pairs[i].key_length, true);
         ubjson_ctx_render_value(ctx, &object.kv_pairs[i].value);
     }
 
@@ -173,6 +371,9 @@ bool ubjson_ctx_render_object(struct ubjson_ctx *ctx, struct ubjson_object objec
 
 bool ubjson_ctx_render(struct ubjson_ctx *ctx)
 {
+    if (!ubjson_ctx_reserve_render(ctx, ubjson_ctx_measure(ctx), true))
+        return false;
+
     if (ctx->root.type == UBJSON_TYPE_OBJECT)
     {
         return ubjson_ctx_render_object(ctx, ctx->root.collection.object);
@@ -186,12 +387,12 @@ bool ubjson_ctx_render(struct ubjson_ctx *ctx)
 
 bool ubjson_ctx_render_creation(struct ubjson_ctx *ctx)
 {
-    if (!ctx->current)
+    struct ubjson_collection_list *root = ubjson_ctx_creation_root(ctx);
+    if (!root)
         return false;
 
-    struct ubjson_collection_list *root = ctx->current;
-    while (root->parent)
-        root = root->parent;
+    if (!ubjson_ctx_reserve_render(ctx, ubjson_ctx_measure_creation(ctx), true))
+        return false;
 
     if (root->type == UBJSON_TYPE_OBJECT)
     {
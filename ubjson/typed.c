@@ -0,0 +1,130 @@
+// Copyright (c) 2023 Ally Sommers
+// This code is licensed under the BSD 3-Clause License. A copy of this license
+// is included in the repository.
+
+#include "ubjson.h"
+
+#ifdef _WIN32
+#define be16toh(n) __builtin_bswap16(n)
+#define be64toh(n) __builtin_bswap64(n)
+#else
+#include <endian.h>
+#endif
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+size_t ubjson_typed_width(enum ubjson_type type)
+{
+    switch (type)
+    {
+    case UBJSON_TYPE_INT8:
+    case UBJSON_TYPE_UINT8:
+        return 1;
+    case UBJSON_TYPE_INT16:
+        return 2;
+    case UBJSON_TYPE_INT32:
+    case UBJSON_TYPE_FLOAT32:
+        return 4;
+    case UBJSON_TYPE_INT64:
+    case UBJSON_TYPE_FLOAT64:
+        return 8;
+    default:
+        return 0;
+    }
+}
+
+char ubjson_typed_marker(enum ubjson_type type)
+{
+    switch (type)
+    {
+    case UBJSON_TYPE_INT8:
+        return 'i';
+    case UBJSON_TYPE_UINT8:
+        return 'U';
+    case UBJSON_TYPE_INT16:
+        return 'I';
+    case UBJSON_TYPE_INT32:
+        return 'l';
+    case UBJSON_TYPE_INT64:
+        return 'L';
+    case UBJSON_TYPE_FLOAT32:
+        return 'd';
+    case UBJSON_TYPE_FLOAT64:
+        return 'D';
+    default:
+        return 0;
+    }
+}
+
+enum ubjson_type ubjson_typed_type(char marker)
+{
+    switch (marker)
+    {
+    case 'i':
+        return UBJSON_TYPE_INT8;
+    case 'U':
+        return UBJSON_TYPE_UINT8;
+    case 'I':
+        return UBJSON_TYPE_INT16;
+    case 'l':
+        return UBJSON_TYPE_INT32;
+    case 'L':
+        return UBJSON_TYPE_INT64;
+    case 'd':
+        return UBJSON_TYPE_FLOAT32;
+    case 'D':
+        return UBJSON_TYPE_FLOAT64;
+    default:
+        return UBJSON_TYPE_NULL;
+    }
+}
+
+// Swaps the 2-, 4- or 8-byte lanes of a whole 64-bit word at a time, then whatever is left an element at a time. The
+// words go through memcpy(), so `data` needn't be aligned, and the test of `width` is the same for every one of them,
+// so the compiler can move it out of the loop and vectorise what's left.
+static void ubjson_typed_swap_in_place(char *data, size_t width, size_t count)
+{
+    size_t size = width * count;
+    size_t i = 0;
+
+    for (; i + 8 <= size; i += 8)
+    {
+        u64 word;
+        memcpy(&word, data + i, 8);
+        if (width == 2)
+            word = ((word & 0x00ff00ff00ff00ffull) << 8) | ((word >> 8) & 0x00ff00ff00ff00ffull);
+        else if (width == 4)
+            word = (u64)be64toh(word) << 32 | (u64)be64toh(word) >> 32;
+        else
+            word = be64toh(word);
+        memcpy(data + i, &word, 8);
+    }
+
+    for (; i < size; i += width)
+    {
+        for (size_t j = 0; j < width / 2; j++)
+        {
+            char byte = data[i + j];
+            data[i + j] = data[i + width - 1 - j];
+            data[i + width - 1 - j] = byte;
+        }
+    }
+}
+
+bool ubjson_typed_needs_swap(enum ubjson_type type)
+{
+    // Floats stay in host order, and there's nothing to swap on a big-endian host
+    return ubjson_typed_width(type) >= 2 && type != UBJSON_TYPE_FLOAT32 && type != UBJSON_TYPE_FLOAT64 &&
+           be16toh(1) != 1;
+}
+
+void ubjson_typed_swap(void *dst, void const *src, enum ubjson_type type, size_t count)
+{
+    size_t width = ubjson_typed_width(type);
+    if (dst != src && count)
+        memmove(dst, src, width * count);
+
+    if (ubjson_typed_needs_swap(type))
+        ubjson_typed_swap_in_place(dst, width, count);
+}
@@ -41,7 +41,8 @@ enum ubjson_type
     UBJSON_TYPE_CHAR,
     UBJSON_TYPE_STRING,
     UBJSON_TYPE_ARRAY,
-    UBJSON_TYPE_OBJECT
+    UBJSON_TYPE_OBJECT,
+    UBJSON_TYPE_TYPED_ARRAY
 };
 
 enum ubjson_ctx_state
@@ -70,6 +71,17 @@ struct ubjson_array
     size_t capacity;
 };
 
+// A `$`-typed, `#`-counted array of numbers, kept as one block in host byte order instead of as a value apiece.
+struct ubjson_typed_array
+{
+    void *data;
+    size_t count;
+    // Of every element: one of the integer or float types
+    enum ubjson_type type;
+    // `data` was allocated for the array, rather than pointing into the source buffer or at the caller's memory
+    bool owned;
+};
+
 struct ubjson_value
 {
     union
@@ -88,13 +100,18 @@ struct ubjson_value
 
         struct ubjson_array array;
         struct ubjson_object object;
+        struct ubjson_typed_array typed_array;
     } v;
+    // Of a string, in bytes. A parsed string is a view into src_buf with no terminator after it, until
+    // ubjson_ctx_terminate() copies it out.
+    size_t length;
     enum ubjson_type type;
 };
 
 struct ubjson_kv_pair
 {
     char *key;
+    size_t key_length;
     struct ubjson_value value;
 };
 
@@ -104,11 +121,69 @@ union ubjson_object_or_array
     struct ubjson_array array;
 };
 
+// How libubjson allocates. The library never passes `free` or `realloc` a NULL pointer. `free` may itself be NULL
+// for an allocator which only releases memory in bulk, like an arena; freeing a ctx then doesn't walk its tree.
+struct ubjson_allocator
+{
+    void *(*alloc)(void *user, size_t size);
+    // `old_size` is the size `ptr` was last allocated with
+    void *(*realloc)(void *user, void *ptr, size_t old_size, size_t size);
+    void (*free)(void *user, void *ptr);
+    void *user;
+};
+
+// Hands out memory from large blocks with a bump pointer. A ctx using one takes everything it needs from it and
+// frees nothing itself; ubjson_arena_reset() then releases it all at once and keeps the blocks, so a steady stream
+// of messages stops allocating once the blocks are big enough. A zeroed arena is ready to use. Not thread-safe.
+#define UBJSON_ARENA_BLOCK_SIZE 16384
+
+struct ubjson_arena
+{
+    struct ubjson_arena_block *first;
+    struct ubjson_arena_block *current;
+    size_t block_size;
+    // The last allocation, which ubjson_arena_realloc() can grow in place
+    void *last;
+};
+
+// Counts what goes through it on the way to `backing`, or libc if that's left zeroed. Each allocation carries a
+// small header with its size, so `current` stays exact. Not thread-safe.
+struct ubjson_counter
+{
+    struct ubjson_allocator backing;
+    // Bytes allocated and not yet freed, and the most there ever were
+    size_t current;
+    size_t peak;
+    // Bytes and allocations handed out over its lifetime, reallocations included
+    size_t total;
+    size_t allocations;
+};
+
+// What a ctx keeps of one document for the next, once ubjson_ctx_reset() is used instead of freeing it: its buffers,
+// the arrays of members and values its collections had, up to UBJSON_CTX_SPARES of them, and its cursors. Anything
+// over UBJSON_CTX_RETAIN_MAX bytes is released, so one huge message doesn't hold on to its memory for good.
+#define UBJSON_CTX_RETAIN_MAX 65536
+#define UBJSON_CTX_SPARES 16
+
+struct ubjson_spare
+{
+    void *data;
+    size_t size;
+};
+
 struct ubjson_ctx
 {
+    // Parsed strings and keys point into src_buf, which is never written to when it's the caller's
     char *src_buf;
     size_t src_len;
     size_t src_index;
+    // src_buf belongs to the caller
+    bool src_borrowed;
+    // What src_buf was allocated with, when it's the ctx's own
+    size_t src_capacity;
+    // The end of the last typed array swapped to host order where it lies in src_buf, which is only done to the ctx's
+    // own, so that parsing the same source again doesn't swap it back
+    size_t src_swapped;
 
     struct ubjson_collection
     {
@@ -125,31 +200,98 @@ struct ubjson_ctx
         size_t index;
 
         bool is_from_parse;
+
+        // An object's keys hashed, once ubjson_ctx_find() has looked one up in a large enough object: each of the
+        // `key_index_mask` + 1 slots holds the index of a member plus one, or 0 if it's free
+        size_t *key_index;
+        size_t key_index_mask;
     } * current;
 
     char *render_buf;
     size_t render_index;
     size_t render_capacity;
+    // render_buf belongs to the caller; see ubjson_ctx_render_into()
+    bool render_borrowed;
+
+    // Terminated copies of every parsed string and key, made by ubjson_ctx_terminate(). `string_bytes` is what they
+    // take, counted while parsing.
+    char *strings;
+    size_t strings_capacity;
+    size_t string_bytes;
+    bool terminated;
+
+    // Arrays of members or values, and cursors chained through `parent`, given back by collections which have been
+    // freed and not yet used again. Only an allocator which frees one at a time fills them.
+    struct ubjson_spare spares[UBJSON_CTX_SPARES];
+    size_t spare_count;
+    struct ubjson_collection_list *spare_cursors;
+
+    // Where everything above comes from
+    struct ubjson_allocator allocator;
 };
 
+// Uses the default allocator; see ubjson_set_default_allocator().
 void ubjson_ctx_init(struct ubjson_ctx *ctx, char const *buf, size_t size);
+// Like ubjson_ctx_init(), with the copy of `buf` and everything parsed or created taken from `allocator`.
+void ubjson_ctx_init_allocator(struct ubjson_ctx *ctx, struct ubjson_allocator const *allocator, char const *buf,
+                               size_t size);
+// Like ubjson_ctx_init(), with everything taken from `arena`. Freeing the ctx is then O(1); the memory is only
+// reclaimed by resetting the arena.
+void ubjson_ctx_init_arena(struct ubjson_ctx *ctx, struct ubjson_arena *arena, char const *buf, size_t size);
+// Like ubjson_ctx_init(), but parses `buf` where it is instead of copying it. If `take` is set, `buf` must come from
+// the default allocator and is freed with the ctx; otherwise it has to outlive the ctx.
+void ubjson_ctx_init_in_place(struct ubjson_ctx *ctx, char *buf, size_t size, bool take);
+// Empties a ctx for the next document and copies `buf` in, like freeing and initializing it again with the same
+// allocator, but keeping what memory it can; a ctx kept for a whole connection then stops allocating for messages of
+// the same shape. Anything read out of the last document, and any buffer passed to ubjson_ctx_render_into(), is
+// left alone. With an allocator which doesn't free, like an arena's, nothing is kept.
+void ubjson_ctx_reset(struct ubjson_ctx *ctx, char const *buf, size_t size);
 void ubjson_ctx_free(struct ubjson_ctx *ctx);
 
 // PARSE //
-bool ubjson_ctx_parse_string(struct ubjson_ctx *ctx, char **str);
+// Collections may be `$`-typed and `#`-counted, as long as their values aren't collections themselves. A count is never
+// more than the bytes left to parse. A typed array of numbers inside the document becomes one UBJSON_TYPE_TYPED_ARRAY,
+// swapped to host order where it lies in src_buf if that's aligned for its type and src_buf is the ctx's own, and copied
+// otherwise; the document itself is always an array or an object, so one which is a typed array gets a value per
+// element instead.
+//
+// Strings and keys are (pointer, length) views into src_buf, which parsing leaves as it was; they aren't terminated. A
+// borrowed src_buf is never written to, so the caller can parse it again.
+bool ubjson_ctx_parse_string(struct ubjson_ctx *ctx, char **str, size_t *length);
 bool ubjson_ctx_parse_value(struct ubjson_ctx *ctx, struct ubjson_value *value);
 bool ubjson_ctx_parse_array(struct ubjson_ctx *ctx, struct ubjson_array *array);
 bool ubjson_ctx_parse_object(struct ubjson_ctx *ctx, struct ubjson_object *object);
 bool ubjson_ctx_parse(struct ubjson_ctx *ctx);
+// Copies every string and key of the parsed document, terminated, into one allocation and points the tree at the
+// copies, for callers which want C strings; protocol.h's decoders do. Does nothing the second time. Fails only if the
+// allocation does, leaving the views as they were.
+bool ubjson_ctx_terminate(struct ubjson_ctx *ctx);
 //
 
 // RENDER //
-bool ubjson_ctx_render_string(struct ubjson_ctx *ctx, char *str, bool is_key);
+bool ubjson_ctx_render_string(struct ubjson_ctx *ctx, char const *str, size_t length, bool is_key);
 bool ubjson_ctx_render_value(struct ubjson_ctx *ctx, struct ubjson_value *value);
 bool ubjson_ctx_render_array(struct ubjson_ctx *ctx, struct ubjson_array array);
 bool ubjson_ctx_render_object(struct ubjson_ctx *ctx, struct ubjson_object object);
+// Both make room for exactly the whole document before rendering any of it.
 bool ubjson_ctx_render(struct ubjson_ctx *ctx);
 bool ubjson_ctx_render_creation(struct ubjson_ctx *ctx);
+// Renders into `buf`, such as one on the stack, from its beginning instead of allocating. A document which doesn't fit
+// is rendered into allocated memory of exactly its size instead.
+void ubjson_ctx_render_into(struct ubjson_ctx *ctx, char *buf, size_t capacity);
+//
+
+// MEASURE //
+// The exact number of bytes rendering would produce. Strings and keys use the smallest length marker, as the
+// renderer and ubjson_writer do.
+size_t ubjson_measure_int(i64 value);
+size_t ubjson_measure_string(size_t length, bool is_key);
+size_t ubjson_measure_value(struct ubjson_value const *value);
+size_t ubjson_measure_array(struct ubjson_array const *array);
+size_t ubjson_measure_object(struct ubjson_object const *object);
+// Of what ubjson_ctx_render() and ubjson_ctx_render_creation() would render.
+size_t ubjson_ctx_measure(struct ubjson_ctx *ctx);
+size_t ubjson_ctx_measure_creation(struct ubjson_ctx *ctx);
 //
 
 // CREATE //
@@ -170,6 +312,12 @@ bool ubjson_ctx_add_kv_pair_float32(struct ubjson_ctx *ctx, char const *key, flo
 bool ubjson_ctx_add_kv_pair_float64(struct ubjson_ctx *ctx, char const *key, double value);
 bool ubjson_ctx_add_kv_pair_character(struct ubjson_ctx *ctx, char const *key, u8 value);
 bool ubjson_ctx_add_kv_pair_string(struct ubjson_ctx *ctx, char const *key, char const *value);
+// `data` is `count` elements of `type` in host byte order, and is copied.
+bool ubjson_ctx_add_kv_pair_typed_array(struct ubjson_ctx *ctx, char const *key, enum ubjson_type type,
+                                        void const *data, size_t count);
+// Binary data, as a `[$U#` array. The bytes aren't copied into the tree, so they have to stay valid and unchanged
+// until it's rendered for the last time.
+bool ubjson_ctx_add_kv_pair_blob(struct ubjson_ctx *ctx, char const *key, void const *data, size_t length);
 
 bool ubjson_ctx_add_array(struct ubjson_ctx *ctx);
 bool ubjson_ctx_add_object(struct ubjson_ctx *ctx);
@@ -182,12 +330,206 @@ bool ubjson_ctx_add_float32(struct ubjson_ctx *ctx, float value);
 bool ubjson_ctx_add_float64(struct ubjson_ctx *ctx, double value);
 bool ubjson_ctx_add_character(struct ubjson_ctx *ctx, u8 value);
 bool ubjson_ctx_add_string(struct ubjson_ctx *ctx, char const *value);
+bool ubjson_ctx_add_typed_array(struct ubjson_ctx *ctx, enum ubjson_type type, void const *data, size_t count);
+bool ubjson_ctx_add_blob(struct ubjson_ctx *ctx, void const *data, size_t length);
 //
 
 // READ //
+// Strings and keys are copied with the ctx's allocator, terminated, and are the caller's to free with
+// ubjson_ctx_release(); to look at one without a copy, take the view in the value ubjson_ctx_find() returns, as
+// protocol.h does. A typed array is read as its struct ubjson_typed_array, whose data stays the ctx's.
 bool ubjson_ctx_read_kv_pair(struct ubjson_ctx *ctx, char **key, void *out, enum ubjson_type expected);
 bool ubjson_ctx_read(struct ubjson_ctx *ctx, void *out, enum ubjson_type expected);
 bool ubjson_ctx_next_value(struct ubjson_ctx *ctx);
+
+// Objects with at least this many members are searched through a hash index of their keys, built the first time
+// one is looked up; smaller ones are scanned, comparing lengths before bytes.
+#define UBJSON_FIND_INDEX_THRESHOLD 16
+
+// Looks `key` up in the object the ctx is in, wherever it is, and moves to it so that ubjson_ctx_read_kv_pair() and,
+// in a parsed document, ubjson_ctx_enter_collection() use it. Of a key which appears twice, the first is found.
+struct ubjson_value *ubjson_ctx_find(struct ubjson_ctx *ctx, char const *key);
+// Like ubjson_ctx_read_kv_pair(), for the value of `key`.
+bool ubjson_ctx_get(struct ubjson_ctx *ctx, char const *key, void *out, enum ubjson_type expected);
+//
+
+// ARENA //
+// `block_size` of 0 means UBJSON_ARENA_BLOCK_SIZE; larger allocations get a block of their own.
+void ubjson_arena_init(struct ubjson_arena *arena, size_t block_size);
+void ubjson_arena_reset(struct ubjson_arena *arena);
+void ubjson_arena_free(struct ubjson_arena *arena);
+// Both return NULL if a new block can't be allocated, or the size is too close to SIZE_MAX to round up, leaving the
+// arena as it was.
+void *ubjson_arena_alloc(struct ubjson_arena *arena, size_t size);
+void *ubjson_arena_realloc(struct ubjson_arena *arena, void *ptr, size_t old_size, size_t size);
+
+//
+
+// ALLOCATOR //
+struct ubjson_allocator ubjson_allocator_libc(void);
+struct ubjson_allocator ubjson_allocator_arena(struct ubjson_arena *arena);
+// `counter` has to be zeroed, or have only its `backing` set, before it's first used.
+struct ubjson_allocator ubjson_allocator_counting(struct ubjson_counter *counter);
+
+// What ubjson_ctx_init() and ubjson_reader_init() use from then on; NULL goes back to libc. Set it before anything
+// is allocated, since memory has to be freed by the allocator it came from.
+void ubjson_set_default_allocator(struct ubjson_allocator const *allocator);
+struct ubjson_allocator ubjson_default_allocator(void);
+
+// What the rest of the library allocates with. NULL pointers are handled here rather than by the allocator.
+void *ubjson_allocator_realloc(struct ubjson_allocator const *allocator, void *ptr, size_t old_size, size_t size);
+void ubjson_allocator_free(struct ubjson_allocator const *allocator, void *ptr);
+void *ubjson_ctx_alloc(struct ubjson_ctx *ctx, size_t size);
+void *ubjson_ctx_calloc(struct ubjson_ctx *ctx, size_t size);
+void *ubjson_ctx_realloc(struct ubjson_ctx *ctx, void *ptr, size_t old_size, size_t size);
+void ubjson_ctx_release(struct ubjson_ctx *ctx, void *ptr);
+
+// Keeps a collection's array of `size` bytes in the ctx's spares, or releases it if it's too large. Once they're full
+// the smallest is released.
+void ubjson_ctx_recycle(struct ubjson_ctx *ctx, void *ptr, size_t size);
+// Takes the smallest spare of at least `size` bytes and sets `spare_size` to its size, or returns NULL.
+void *ubjson_ctx_reuse(struct ubjson_ctx *ctx, size_t size, size_t *spare_size);
+// A zeroed cursor, from the spares if there is one, or NULL if one can't be allocated.
+struct ubjson_collection_list *ubjson_ctx_new_cursor(struct ubjson_ctx *ctx);
+// Releases the cursor's key index, and keeps the cursor itself among the spares.
+void ubjson_ctx_drop_cursor(struct ubjson_ctx *ctx, struct ubjson_collection_list *cursor);
+void ubjson_ctx_free_spares(struct ubjson_ctx *ctx);
+//
+
+// TYPED ARRAY //
+// On the wire a typed array of numbers is its header and then its elements back to back, big-endian. Floats are the
+// exception: the library writes and reads them in host order, as it does everywhere else.
+// The size of an element of `type`, or 0 if it isn't a number a typed array can hold.
+size_t ubjson_typed_width(enum ubjson_type type);
+// The marker for elements of `type`, or 0 if it isn't one of those numbers.
+char ubjson_typed_marker(enum ubjson_type type);
+// The type of elements with `marker`, or UBJSON_TYPE_NULL if it isn't one of those numbers.
+enum ubjson_type ubjson_typed_type(char marker);
+// Whether elements of `type` are in a different order on the wire than on this host.
+bool ubjson_typed_needs_swap(enum ubjson_type type);
+// Copies `count` elements of `type` from `src` to `dst`, which may be the same or unaligned, converting them between
+// wire and host order.
+void ubjson_typed_swap(void *dst, void const *src, enum ubjson_type type, size_t count);
+//
+
+// WRITER //
+// Encodes a document straight into bytes as it's described, with no tree in between: begin a collection, write a key
+// before each value of an object, and end it. Integers, string lengths included, take the smallest marker they fit.
+// Bytes go to the buffer given to ubjson_writer_init(), and to one from `allocator` once that is full. Nothing checks
+// that the calls describe a well-formed document.
+struct ubjson_writer
+{
+    char *buf;
+    size_t len;
+    size_t capacity;
+    // `buf` came from `allocator` rather than the caller
+    bool owned;
+    // The buffer couldn't grow; the write which needed it and all after it were dropped
+    bool failed;
+    // The default allocator unless it's replaced right after ubjson_writer_init()
+    struct ubjson_allocator allocator;
+};
+
+// `buf` may be NULL, in which case everything is written to allocated memory.
+void ubjson_writer_init(struct ubjson_writer *writer, char *buf, size_t capacity);
+void ubjson_writer_free(struct ubjson_writer *writer);
+// Starts over at the beginning of the buffer, keeping it.
+void ubjson_writer_reset(struct ubjson_writer *writer);
+
+bool ubjson_writer_begin_object(struct ubjson_writer *writer);
+bool ubjson_writer_end_object(struct ubjson_writer *writer);
+bool ubjson_writer_begin_array(struct ubjson_writer *writer);
+bool ubjson_writer_end_array(struct ubjson_writer *writer);
+bool ubjson_writer_key(struct ubjson_writer *writer, char const *key);
+
+bool ubjson_writer_null(struct ubjson_writer *writer);
+bool ubjson_writer_bool(struct ubjson_writer *writer, bool value);
+bool ubjson_writer_int(struct ubjson_writer *writer, i64 value);
+bool ubjson_writer_float32(struct ubjson_writer *writer, float value);
+bool ubjson_writer_float64(struct ubjson_writer *writer, double value);
+bool ubjson_writer_character(struct ubjson_writer *writer, u8 value);
+bool ubjson_writer_string(struct ubjson_writer *writer, char const *value);
+bool ubjson_writer_string_length(struct ubjson_writer *writer, char const *value, size_t length);
+// Writes `count` elements of `type`, in host byte order at `data`, as one `$`-typed, `#`-counted array.
+bool ubjson_writer_typed_array(struct ubjson_writer *writer, enum ubjson_type type, void const *data, size_t count);
+// Writes binary data as a `[$U#` array.
+bool ubjson_writer_blob(struct ubjson_writer *writer, void const *data, size_t length);
+// Appends bytes which are already encoded, such as a whole frame.
+bool ubjson_writer_raw(struct ubjson_writer *writer, char const *bytes, size_t length);
+//
+
+// READER //
+// Reads a stream of documents token by token, without building a tree, from chunks of any size: feed it whatever
+// recv() returned and call ubjson_reader_next() until it asks for more. A token split between chunks is carried
+// over in `pending`, so besides that the reader only keeps the nesting of the document it's in.
+//
+// Collections may be `$`-typed and `#`-counted, as long as their values aren't collections themselves. A typed
+// collection's values come one VALUE event at a time like any others, and a counted one's END event follows its last
+// value without a marker of its own. The exception is binary data inside a document: a `[$U#` array comes as a single
+// VALUE, a UBJSON_TYPE_TYPED_ARRAY of UBJSON_TYPE_UINT8 whose read-only `data` points at its bytes like `string` does.
+#define UBJSON_READER_MAX_DEPTH 32
+
+enum ubjson_event
+{
+    // The chunk is used up; feed the next one
+    UBJSON_EVENT_NEED_MORE,
+    // Malformed input, nested too deep, or no memory to keep a token split between chunks. The reader stays failed
+    // until it's initialized again
+    UBJSON_EVENT_ERROR,
+    UBJSON_EVENT_BEGIN_OBJECT,
+    // A document ends with the END event which brings the depth back to 0; the next token starts another
+    UBJSON_EVENT_END_OBJECT,
+    UBJSON_EVENT_BEGIN_ARRAY,
+    UBJSON_EVENT_END_ARRAY,
+    // In `string`
+    UBJSON_EVENT_KEY,
+    // In `value`; a string's type is UBJSON_TYPE_STRING with its bytes in `string` instead
+    UBJSON_EVENT_VALUE,
+};
+
+struct ubjson_reader_frame
+{
+    // '{' or '['
+    char kind;
+    // The marker all of its values share if it's `$`-typed, and 0 otherwise
+    char type;
+    // How many more values it has if it's `#`-counted, and -1 otherwise
+    i64 remaining;
+};
+
+struct ubjson_reader
+{
+    // The chunk being read; `index` is how much of it has been consumed
+    char const *buf;
+    size_t len;
+    size_t index;
+
+    struct ubjson_reader_frame stack[UBJSON_READER_MAX_DEPTH];
+    size_t depth;
+    // The collection the last BEGIN event opened, until it's pushed
+    struct ubjson_reader_frame opening;
+    bool key_next;
+    bool failed;
+
+    // The last token read. `string` isn't NUL-terminated, and both stay valid until the next call
+    struct ubjson_value value;
+    char const *string;
+    size_t string_length;
+
+    char *pending;
+    size_t pending_len;
+    size_t pending_capacity;
+    bool pending_used;
+    // Where `pending` comes from; the default allocator unless it's replaced right after ubjson_reader_init()
+    struct ubjson_allocator allocator;
+};
+
+void ubjson_reader_init(struct ubjson_reader *reader);
+void ubjson_reader_free(struct ubjson_reader *reader);
+// Hands the reader its next chunk, which has to stay valid until ubjson_reader_next() returns NEED_MORE or the
+// chunk is replaced. Anything left unread of the previous chunk is dropped.
+void ubjson_reader_feed(struct ubjson_reader *reader, char const *buf, size_t len);
+enum ubjson_event ubjson_reader_next(struct ubjson_reader *reader);
 //
 
 #ifdef __cplusplus
@@ -0,0 +1,215 @@
+// Copyright (c) 2023 Ally Sommers
+// This code is licensed under the BSD 3-Clause License. A copy of this license
+// is included in the repository.
+
+#include "ubjson.h"
+
+#ifdef _WIN32
+#define htobe16(n) __builtin_bswap16(n)
+#define htobe32(n) __builtin_bswap32(n)
+#define htobe64(n) __builtin_bswap64(n)
+#else
+#include <endian.h>
+#endif
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#define UBJSON_WRITER_MIN_CAPACITY 256
+
+void ubjson_writer_init(struct ubjson_writer *writer, char *buf, size_t capacity)
+{
+    memset(writer, 0, sizeof(*writer));
+    writer->buf = buf;
+    writer->capacity = buf ? capacity : 0;
+    writer->allocator = ubjson_default_allocator();
+}
+
+void ubjson_writer_free(struct ubjson_writer *writer)
+{
+    struct ubjson_allocator allocator = writer->allocator;
+    if (writer->owned)
+        ubjson_allocator_free(&allocator, writer->buf);
+    ubjson_writer_init(writer, NULL, 0);
+    writer->allocator = allocator;
+}
+
+void ubjson_writer_reset(struct ubjson_writer *writer)
+{
+    writer->len = 0;
+    writer->failed = false;
+}
+
+static bool ubjson_writer_reserve(struct ubjson_writer *writer, size_t count)
+{
+    if (writer->failed)
+        return false;
+    if (writer->len + count <= writer->capacity)
+        return true;
+
+    size_t capacity = writer->capacity ? writer->capacity * 2 : UBJSON_WRITER_MIN_CAPACITY;
+    while (capacity < writer->len + count)
+        capacity *= 2;
+
+    char *buf;
+    if (writer->owned)
+    {
+        buf = ubjson_allocator_realloc(&writer->allocator, writer->buf, writer->capacity, capacity);
+    }
+    else
+    {
+        // Moving off the caller's buffer
+        buf = writer->allocator.alloc(writer->allocator.user, capacity);
+        if (buf && writer->len)
+            memcpy(buf, writer->buf, writer->len);
+    }
+
+    if (!buf)
+    {
+        writer->failed = true;
+        return false;
+    }
+
+    writer->buf = buf;
+    writer->capacity = capacity;
+    writer->owned = true;
+    return true;
+}
+
+static bool ubjson_writer_marker(struct ubjson_writer *writer, char marker)
+{
+    if (!ubjson_writer_reserve(writer, 1))
+        return false;
+    writer->buf[writer->len++] = marker;
+    return true;
+}
+
+static bool ubjson_writer_marker_bytes(struct ubjson_writer *writer, char marker, void const *bytes, size_t count)
+{
+    if (!ubjson_writer_reserve(writer, 1 + count))
+        return false;
+    writer->buf[writer->len] = marker;
+    memcpy(writer->buf + writer->len + 1, bytes, count);
+    writer->len += 1 + count;
+    return true;
+}
+
+bool ubjson_writer_begin_object(struct ubjson_writer *writer)
+{
+    return ubjson_writer_marker(writer, '{');
+}
+
+bool ubjson_writer_end_object(struct ubjson_writer *writer)
+{
+    return ubjson_writer_marker(writer, '}');
+}
+
+bool ubjson_writer_begin_array(struct ubjson_writer *writer)
+{
+    return ubjson_writer_marker(writer, '[');
+}
+
+bool ubjson_writer_end_array(struct ubjson_writer *writer)
+{
+    return ubjson_writer_marker(writer, ']');
+}
+
+bool ubjson_writer_int(struct ubjson_writer *writer, i64 value)
+{
+    if (value >= INT8_MIN && value <= INT8_MAX)
+        return ubjson_writer_marker_bytes(writer, 'i', &(i8) { (i8)value }, 1);
+    if (value >= 0 && value <= UINT8_MAX)
+        return ubjson_writer_marker_bytes(writer, 'U', &(u8) { (u8)value }, 1);
+    if (value >= INT16_MIN && value <= INT16_MAX)
+        return ubjson_writer_marker_bytes(writer, 'I', &(i16) { htobe16((i16)value) }, 2);
+    if (value >= INT32_MIN && value <= INT32_MAX)
+        return ubjson_writer_marker_bytes(writer, 'l', &(i32) { htobe32((i32)value) }, 4);
+    return ubjson_writer_marker_bytes(writer, 'L', &(i64) { htobe64(value) }, 8);
+}
+
+// A key is a string without the 'S' marker
+static bool ubjson_writer_key_or_string(struct ubjson_writer *writer, char const *value, size_t length, bool is_key)
+{
+    // All of it at once, so the parts below can't fail halfway
+    if (!ubjson_writer_reserve(writer, ubjson_measure_string(length, is_key)))
+        return false;
+    if (!is_key)
+        writer->buf[writer->len++] = 'S';
+    ubjson_writer_int(writer, (i64)length);
+    memcpy(writer->buf + writer->len, value, length);
+    writer->len += length;
+    return true;
+}
+
+bool ubjson_writer_key(struct ubjson_writer *writer, char const *key)
+{
+    return ubjson_writer_key_or_string(writer, key, strlen(key), true);
+}
+
+bool ubjson_writer_null(struct ubjson_writer *writer)
+{
+    return ubjson_writer_marker(writer, 'Z');
+}
+
+bool ubjson_writer_bool(struct ubjson_writer *writer, bool value)
+{
+    return ubjson_writer_marker(writer, value ? 'T' : 'F');
+}
+
+// Floats are written in host byte order, as ubjson_ctx_render_value() writes them
+bool ubjson_writer_float32(struct ubjson_writer *writer, float value)
+{
+    return ubjson_writer_marker_bytes(writer, 'd', &value, 4);
+}
+
+bool ubjson_writer_float64(struct ubjson_writer *writer, double value)
+{
+    return ubjson_writer_marker_bytes(writer, 'D', &value, 8);
+}
+
+bool ubjson_writer_character(struct ubjson_writer *writer, u8 value)
+{
+    return ubjson_writer_marker_bytes(writer, 'C', &value, 1);
+}
+
+bool ubjson_writer_string(struct ubjson_writer *writer, char const *value)
+{
+    return ubjson_writer_key_or_string(writer, value, strlen(value), false);
+}
+
+bool ubjson_writer_string_length(struct ubjson_writer *writer, char const *value, size_t length)
+{
+    return ubjson_writer_key_or_string(writer, value, length, false);
+}
+
+bool ubjson_writer_raw(struct ubjson_writer *writer, char const *bytes, size_t length)
+{
+    if (!ubjson_writer_reserve(writer, length))
+        return false;
+    memcpy(writer->buf + writer->len, bytes, length);
+    writer->len += length;
+    return true;
+}
+
+bool ubjson_writer_typed_array(struct ubjson_writer *writer, enum ubjson_type type, void const *data, size_t count)
+{
+    char marker = ubjson_typed_marker(type);
+    if (!marker)
+        return false;
+
+    size_t size = ubjson_typed_width(type) * count;
+    if (!ubjson_writer_reserve(writer, 4 + ubjson_measure_int((i64)count) + size))
+        return false;
+
+    memcpy(writer->buf + writer->len, (char[]) { '[', '$', marker, '#' }, 4);
+    writer->len += 4;
+    ubjson_writer_int(writer, (i64)count);
+    ubjson_typed_swap(writer->buf + writer->len, data, type, count);
+    writer->len += size;
+    return true;
+}
+
+bool ubjson_writer_blob(struct ubjson_writer *writer, void const *data, size_t length)
+{
+    return ubjson_writer_typed_array(writer, UBJSON_TYPE_UINT8, data, length);
+}
@@ -0,0 +1,83 @@
+// Copyright (c) 2023 Ally Sommers
+// This code is licensed under the BSD 3-Clause License. A copy of this license
+// is included in the repository.
+
+#ifndef VISUALISATION_H
+#define VISUALISATION_H
+
+// Like protocol.h this header doesn't include anything itself; include <stdint.h> (or anything that pulls it in)
+// first.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// foo_mpris pushes frames to foobard over this socket, next to the command socket.
+#define VIS_SOCKET_NAME "foo_mpris_vis.sock"
+
+// foobard hands out the ring below to anyone connecting here: the reply is a single byte carrying the ring's file
+// descriptor as SCM_RIGHTS, which the client maps read-only.
+#define VIS_RING_SOCKET_PATH "/tmp/foobard_vis.sock"
+
+#define VIS_FRAME_MAGIC 0x53495646 // "FVIS"
+#define VIS_MAX_CHANNELS 8
+#define VIS_MAX_BINS 1024
+
+enum vis_frame_kind
+{
+    // `bins` FFT magnitudes per channel, lowest frequency first, unscaled as foobar2000 computes them; there's no fixed
+    // upper bound, so clients pick their own range.
+    VIS_FRAME_SPECTRUM = 0,
+    // The frame interval split into `bins` segments, each holding the largest absolute sample per channel.
+    VIS_FRAME_PEAKS = 1,
+};
+
+// Sent as-is in native byte order, followed by channels * bins floats interleaved by channel like an audio_chunk.
+struct vis_frame_header
+{
+    uint32_t magic;
+    uint16_t kind;
+    uint16_t channels;
+    uint32_t bins;
+    uint32_t sample_rate;
+    // Seconds since playback started or last seeked, as reported by visualisation_stream.
+    double time;
+};
+
+#define VIS_FRAME_MAX_SIZE (sizeof(struct vis_frame_header) + VIS_MAX_CHANNELS * VIS_MAX_BINS * sizeof(float))
+
+// The shared ring starts with this header and is followed by `slot_count` slots of `slot_size` bytes, each a
+// vis_ring_slot followed by the frame data. foobard is the only writer and never waits for readers: frame n goes
+// into slot n % slot_count, so a reader which falls behind simply finds newer frames there.
+//
+// `write_sequence` is the number of frames published so far. A slot's `sequence` is odd while the slot is being
+// written and 2 * (n + 1) once frame n is complete, which lets readers use the frame in place:
+//
+//     n = load_acquire(&ring->write_sequence) - 1;
+//     s = load_acquire(&slot->sequence);   // must be 2 * (n + 1)
+//     ... read slot->header and the data following it ...
+//     fence_acquire(); s == load_relaxed(&slot->sequence) -> the frame wasn't overwritten meanwhile.
+struct vis_ring
+{
+    uint32_t magic;
+    uint32_t slot_count;
+    uint32_t slot_size;
+    uint32_t reserved;
+    uint64_t write_sequence;
+};
+
+struct vis_ring_slot
+{
+    uint64_t sequence;
+    struct vis_frame_header header;
+};
+
+#define VIS_RING_SLOT_COUNT 16
+#define VIS_RING_SLOT_SIZE (sizeof(struct vis_ring_slot) + VIS_MAX_CHANNELS * VIS_MAX_BINS * sizeof(float))
+#define VIS_RING_SIZE (sizeof(struct vis_ring) + VIS_RING_SLOT_COUNT * VIS_RING_SLOT_SIZE)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif